@@ -0,0 +1,313 @@
+#include <tvi.h>
+#include <clock.h>
+#include <thread.h>
+
+// Microbenchmarks for the editing and file primitives. Each workload runs
+// on a fresh EditorState without a screen; results go to stdout as JSON.
+//
+// Usage: bench [dir] [file MB]
+//   dir      where the load/save workloads put their file (default build)
+//   file MB  size of that file (default 100)
+
+static int first_result = 1;
+
+// Deterministic generator, so every run edits the same positions
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ull;
+
+static unsigned rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 32);
+}
+
+static void report(const char* name, long ops, size_t bytes, double ms,
+                   size_t allocs, size_t alloc_size) {
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %ld, \"ms\": %.3f, \"ns_per_op\": %.1f",
+           first_result ? "" : ",", name, ops, ms, ops ? ms * 1e6 / ops : 0.0);
+    if (bytes) printf(", \"mb_per_s\": %.1f", ms > 0 ? bytes / 1048576.0 / (ms / 1000) : 0.0);
+    printf(", \"allocs\": %zu, \"alloc_bytes\": %zu}", allocs, alloc_size);
+    first_result = 0;
+    fflush(stdout);
+}
+
+// Start and stop the clock and allocation counters around a workload
+typedef struct {
+    double start;
+    size_t allocs;
+    size_t bytes;
+} Timer;
+
+static Timer timer_start(void) {
+    Timer t = { clock_ms(), alloc_count(), alloc_bytes() };
+    return t;
+}
+
+static void timer_report(Timer t, const char* name, long ops, size_t bytes) {
+    double ms = clock_ms() - t.start;
+    report(name, ops, bytes, ms, alloc_count() - t.allocs, alloc_bytes() - t.bytes);
+}
+
+// Synthetic text: lines of 0..max_width-1 letters
+static char* make_lines(size_t lines, int max_width, size_t* length) {
+    char* data = malloc(lines * (size_t)max_width + 1);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed for bench data\n");
+        exit(1);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < lines; i++) {
+        int width = rng() % max_width;
+        for (int j = 0; j < width; j++) data[n++] = 'a' + j % 26;
+        if (i + 1 < lines) data[n++] = '\n';
+    }
+    *length = n;
+    return data;
+}
+
+static void setup(EditorState* state, size_t lines, int max_width) {
+    init_editor(state);
+    if (lines > 0) {
+        size_t length;
+        char* data = make_lines(lines, max_width, &length);
+        if (!text_load_memory(state->text, data, length, NULL, NULL)) {
+            fprintf(stderr, "Memory allocation failed for bench data\n");
+            exit(1);
+        }
+    }
+}
+
+static void teardown(EditorState* state) {
+    text_free(state->text);
+    undo_free(state->undo);
+    free(state->filename);
+}
+
+static void set_cursor(EditorState* state, int row, int col) {
+    int length = (int)text_line_length(state->text, row);
+    state->cursor_row = row;
+    state->cursor_col = col < length ? col : length;
+}
+
+// Typing at the end of one ever-growing line
+static void bench_type_long_line(void) {
+    EditorState state;
+    setup(&state, 0, 0);
+    long ops = 1000000;
+    Timer t = timer_start();
+    for (long i = 0; i < ops; i++) insert_char(&state, 'a' + i % 26);
+    timer_report(t, "type_long_line", ops, 0);
+    teardown(&state);
+}
+
+// Typing into the middle of a 1 MB line
+static void bench_type_mid_line(void) {
+    EditorState state;
+    setup(&state, 0, 0);
+    for (int i = 0; i < 1 << 20; i++) insert_char(&state, 'x');
+    set_cursor(&state, 0, 1 << 19);
+    long ops = 100000;
+    Timer t = timer_start();
+    for (long i = 0; i < ops; i++) insert_char(&state, 'a' + i % 26);
+    timer_report(t, "type_mid_line", ops, 0);
+    teardown(&state);
+}
+
+// Many short lines: ten characters and Enter, repeated
+static void bench_short_lines(void) {
+    EditorState state;
+    setup(&state, 0, 0);
+    long lines = 100000;
+    Timer t = timer_start();
+    for (long i = 0; i < lines; i++) {
+        for (int j = 0; j < 10; j++) insert_char(&state, 'a' + j);
+        insert_newline(&state);
+    }
+    timer_report(t, "short_lines", lines * 11, 0);
+    teardown(&state);
+}
+
+// Inserts and backspaces at random positions of a 1M-line buffer
+static void bench_random_edits(void) {
+    EditorState state;
+    setup(&state, 1000000, 80);
+    int rows = (int)text_line_count(state.text);
+    long ops = 100000;
+    Timer t = timer_start();
+    for (long i = 0; i < ops; i++) {
+        set_cursor(&state, rng() % rows, rng() % 80);
+        if (rng() % 2) insert_char(&state, 'z');
+        else delete_char(&state);
+    }
+    timer_report(t, "random_edits", ops, 0);
+    teardown(&state);
+}
+
+// Drop a buffer fragmented by 200K scattered inserts
+static void bench_free_pieces(void) {
+    EditorState state;
+    setup(&state, 1000000, 80);
+    int rows = (int)text_line_count(state.text);
+    long ops = 200000;
+    for (long i = 0; i < ops; i++) {
+        set_cursor(&state, rng() % rows, rng() % 80);
+        insert_char(&state, 'z');
+    }
+    text_flush(state.text);
+    Timer t = timer_start();
+    text_clear(state.text);
+    timer_report(t, "free_pieces", ops, 0);
+    teardown(&state);
+}
+
+// Backspace at the start of line 2 of a 1M-line buffer: joins at the top
+static void bench_join_top(void) {
+    EditorState state;
+    setup(&state, 1000000, 80);
+    long ops = 100000;
+    Timer t = timer_start();
+    for (long i = 0; i < ops; i++) {
+        set_cursor(&state, 1, 0);
+        delete_char(&state);
+    }
+    timer_report(t, "join_top", ops, 0);
+    teardown(&state);
+}
+
+// Enter near the start of line 1 of a 1M-line buffer: splits at the top
+static void bench_split_top(void) {
+    EditorState state;
+    setup(&state, 1000000, 80);
+    long ops = 100000;
+    Timer t = timer_start();
+    for (long i = 0; i < ops; i++) {
+        set_cursor(&state, 0, 5);
+        insert_newline(&state);
+    }
+    timer_report(t, "split_top", ops, 0);
+    teardown(&state);
+}
+
+static int write_file(const char* path, size_t mb) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return 0;
+    size_t length;
+    char* data = make_lines(1 << 16, 120, &length);
+    size_t written = 0;
+    while (written < mb << 20) {
+        if (fwrite(data, 1, length, file) != length || fputc('\n', file) == EOF) break;
+        written += length + 1;
+    }
+    free(data);
+    return fclose(file) == 0 && written >= mb << 20;
+}
+
+static size_t file_size(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size > 0 ? (size_t)size : 0;
+}
+
+// Load (including the full line index) and substitute on 1, 2, 4...
+// threads, search the file, then save the untouched and the edited buffer
+static void bench_load_save(const char* dir, size_t mb) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/bench-%zumb.txt", dir, mb);
+    if (!write_file(path, mb)) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return;
+    }
+    size_t bytes = file_size(path);
+    char name[64];
+
+    int cpus = thread_cpu_count();
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > cpus) threads = cpus;
+        EditorState state;
+        init_editor(&state);
+        state.index_threads = threads;
+        Timer t = timer_start();
+        load_file(&state, path);
+        text_index_wait(state.text);
+        snprintf(name, sizeof(name), "load_%zumb_%dt", mb, threads);
+        timer_report(t, name, 1, bytes);
+        teardown(&state);
+        if (threads == cpus) break;
+    }
+
+    // Global regex replace over every line on 1, 2, 4... workers
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > cpus) threads = cpus;
+        EditorState state;
+        init_editor(&state);
+        state.index_threads = threads;
+        load_file(&state, path);
+        text_index_wait(state.text);
+        Timer t = timer_start();
+        substitute_command(&state, "%s/b[a-d]\\+/X/g");
+        snprintf(name, sizeof(name), "substitute_%zumb_%dt", mb, threads);
+        timer_report(t, name, 1, bytes);
+        teardown(&state);
+        if (threads == cpus) break;
+    }
+
+    EditorState state;
+    init_editor(&state);
+    state.filename = _strdup(path);
+    load_file(&state, path);
+    text_index_wait(state.text);
+
+    // A pattern that is not there: every byte is scanned
+    const char* pattern = "no such line";
+    size_t at;
+    Timer t = timer_start();
+    text_find(state.text, pattern, strlen(pattern), 0, text_size(state.text), 0, &at);
+    snprintf(name, sizeof(name), "search_%zumb", mb);
+    timer_report(t, name, 1, bytes);
+
+    t = timer_start();
+    save_file(&state);
+    snprintf(name, sizeof(name), "save_%zumb", mb);
+    timer_report(t, name, 1, bytes);
+
+    state.fsync_on_save = 1;
+    t = timer_start();
+    save_file(&state);
+    snprintf(name, sizeof(name), "save_%zumb_fsync", mb);
+    timer_report(t, name, 1, bytes);
+    state.fsync_on_save = 0;
+
+    // Scatter pieces through the file, then save again
+    int rows = (int)text_line_count(state.text);
+    for (int i = 0; i < 10000; i++) {
+        set_cursor(&state, rng() % rows, rng() % 60);
+        insert_char(&state, 'z');
+    }
+    t = timer_start();
+    save_file(&state);
+    snprintf(name, sizeof(name), "save_%zumb_edited", mb);
+    timer_report(t, name, 1, bytes);
+
+    teardown(&state);
+    remove(path);
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = argc > 1 ? argv[1] : "build";
+    size_t mb = argc > 2 ? (size_t)atoi(argv[2]) : 100;
+
+    printf("{\"benchmarks\": [");
+    bench_type_long_line();
+    bench_type_mid_line();
+    bench_short_lines();
+    bench_random_edits();
+    bench_free_pieces();
+    bench_join_top();
+    bench_split_top();
+    if (mb > 0) bench_load_save(dir, mb);
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef TVI_CLOCK_H
+#define TVI_CLOCK_H
+
+#include <stddef.h>
+
+// Monotonic time in milliseconds, for measurements
+double clock_ms(void);
+
+// Calls to malloc/calloc/realloc and bytes requested by them since start.
+// Counted only in builds with TVI_COUNT_ALLOCS defined and where the
+// allocator can be wrapped (glibc); elsewhere both stay 0.
+size_t alloc_count(void);
+size_t alloc_bytes(void);
+
+// Peak resident set size in KB, or 0 where unknown
+size_t peak_rss_kb(void);
+
+#endif // TVI_CLOCK_H
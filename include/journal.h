@@ -0,0 +1,76 @@
+#ifndef TVI_JOURNAL_H
+#define TVI_JOURNAL_H
+
+#include <stddef.h>
+#include <text.h>
+
+// Crash-recovery journal (the swap file). Edits since the file was last
+// loaded or saved are appended to it as compact binary records: an insert
+// with its bytes, a delete with only its length, or text taken in from the
+// file itself while following it. Records are collected in memory and
+// written as one batch when JOURNAL_GROUP_OPS edits or JOURNAL_GROUP_BYTES
+// bytes have built up, or JOURNAL_GROUP_MS after the first of them (group
+// commit), so typing costs no system call per key. Consecutive typing and
+// backspacing over it fold into one insert record.
+//
+// Each batch carries its length and a checksum; a batch cut short by a
+// crash is ignored on recovery along with anything after it. The header
+// names the on-disk file the edits apply to by its size and modification
+// time.
+
+typedef struct Journal Journal;
+
+#define JOURNAL_GROUP_OPS 256
+#define JOURNAL_GROUP_BYTES (64 << 10)
+#define JOURNAL_GROUP_MS 1000
+
+// The on-disk file a journal's edits start from
+typedef struct {
+    size_t size;
+    long long mtime;
+} JournalBase;
+
+// Start an empty journal at path. Returns NULL with errno EEXIST if a
+// journal is already there, e.g. left by a crash or another editor.
+Journal* journal_create(const char* path, JournalBase base);
+
+// Read which file the journal at path starts from. Returns 0 if there is
+// no journal there or it cannot be read.
+int journal_base(const char* path, JournalBase* base);
+
+// Replay the journal at path onto buf, which holds the file it was started
+// from; bytes taken in from that file while following it are read back
+// from filename. *base is set to the file the journal names and *edits to
+// the records applied. The journal stays open for the edits that follow,
+// without any torn batch at its end. Returns NULL if it cannot be read or
+// an edit fails.
+Journal* journal_recover(const char* path, const char* filename, TextBuffer* buf,
+                         JournalBase* base, size_t* edits);
+
+// Close the journal, deleting its file if remove is set
+void journal_close(Journal* j, int remove);
+
+// Record an edit that has just been applied. These return 0 if a batch
+// could not be written.
+int journal_insert(Journal* j, size_t offset, const char* text, size_t length);
+int journal_delete(Journal* j, size_t offset, size_t length);
+
+// Text inserted at offset that is bytes [file_offset, file_offset + length)
+// of the file, read while following it
+int journal_adopt(Journal* j, size_t offset, size_t file_offset, size_t length);
+
+// Write the pending batch if it is due, or at once with journal_flush.
+// Both return 0 if the write failed.
+int journal_poll(Journal* j);
+int journal_flush(Journal* j);
+
+// 1 if edits wait to be written
+int journal_pending(Journal* j);
+
+// Position after everything recorded so far, flushing first; taken when a
+// save starts. Once the save is done, journal_rebase starts the journal
+// afresh from the file written, keeping the edits made after mark.
+size_t journal_mark(Journal* j);
+int journal_rebase(Journal* j, size_t mark, JournalBase base);
+
+#endif // TVI_JOURNAL_H
@@ -0,0 +1,29 @@
+#ifndef TVI_LZ_H
+#define TVI_LZ_H
+
+#include <stddef.h>
+
+// Small LZ77 block codec for parking text that is not being looked at.
+// A block is a series of sequences, each a run of literal bytes followed by
+// a copy of earlier output:
+//
+//   token      high nibble: literal count, low nibble: copy length - 4;
+//              15 means more follows as bytes of 255 ending in one < 255
+//   literals
+//   offset     2 bytes, little endian, 1..65535 back from the output end
+//   (more copy length bytes)
+//
+// The last sequence stops after its literals. Blocks are self-contained.
+
+// Largest compressed size of length bytes
+size_t lz_bound(size_t length);
+
+// Compress src into dst, which holds lz_bound(length) bytes; returns the
+// compressed size
+size_t lz_compress(const char* src, size_t length, char* dst);
+
+// Decompress a block that expands to exactly length bytes into dst.
+// Returns 0 if the block is malformed.
+int lz_decompress(const char* src, size_t packed, char* dst, size_t length);
+
+#endif // TVI_LZ_H
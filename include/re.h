@@ -0,0 +1,40 @@
+#ifndef TVI_RE_H
+#define TVI_RE_H
+
+#include <stddef.h>
+
+// Small regular expressions for :s, in vi syntax:
+//
+//   c          a literal character         .      any character
+//   [abc]      one of a set; ranges a-z, negated with [^...]
+//   ^  $       start / end of the line, at the ends of the pattern only
+//   *          zero or more of the atom before it, as many as possible
+//   \+  \?     one or more, zero or one
+//   \t         a tab; a backslash before anything else makes it literal
+//
+// A pattern matches within one line; lines are passed without their '\n'.
+// Matching takes time linear in the line length for any pattern.
+// A compiled pattern is read-only and may be shared between threads.
+
+typedef struct Regex Regex;
+
+// Returns NULL and points *error at a message if the pattern is invalid
+Regex* re_compile(const char* pattern, const char** error);
+void re_free(Regex* re);
+
+// Leftmost match in line[from, length]: returns 1 and sets [*start, *end)
+// if there is one. Matches may be empty.
+int re_search(const Regex* re, const char* line, size_t length, size_t from,
+              size_t* start, size_t* end);
+
+// re_search with one matcher only, for tests: RE_BACKTRACK backtracks
+// without a budget, RE_PIKE runs the Pike VM. Both give re_search's match.
+enum {
+    RE_BACKTRACK,
+    RE_PIKE
+};
+
+int re_search_with(const Regex* re, int matcher, const char* line, size_t length, size_t from,
+                   size_t* start, size_t* end);
+
+#endif // TVI_RE_H
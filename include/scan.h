@@ -0,0 +1,25 @@
+#ifndef TVI_SCAN_H
+#define TVI_SCAN_H
+
+#include <stddef.h>
+
+// Vectorized byte scanning. Uses AVX2 when the CPU has it, SSE2 on other
+// x86-64 machines and a scalar loop everywhere else.
+
+// Number of '\n' bytes in data[0, length)
+size_t scan_count_lf(const char* data, size_t length);
+
+// Append base + i + 1 to *starts for every '\n' at data[i], growing the
+// array as needed. Returns 0 if an allocation fails.
+int scan_index_lf(const char* data, size_t length, size_t base,
+                  size_t** starts, size_t* count, size_t* cap);
+
+#define SCAN_NONE ((size_t)-1)
+
+// Position of the first / last occurrence of pat[0, pat_len) in
+// data[0, length), or SCAN_NONE. Candidates are filtered a block at a time on the
+// first and last byte of the pattern and only those are compared in full.
+size_t scan_find(const char* data, size_t length, const char* pat, size_t pat_len);
+size_t scan_rfind(const char* data, size_t length, const char* pat, size_t pat_len);
+
+#endif // TVI_SCAN_H
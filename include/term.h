@@ -0,0 +1,74 @@
+#ifndef TVI_TERM_H
+#define TVI_TERM_H
+
+#include <stddef.h>
+
+// Terminal backends. screen.c draws each frame into a grid of Cells and
+// hands it to the active backend together with the previous frame (front);
+// the backend sends only the cells that differ and updates front to match.
+
+// Cell colors
+enum {
+    ATTR_BLANK,           // Empty screen
+    ATTR_TEXT,            // File text
+    ATTR_MODE,            // Mode line and line numbers
+    ATTR_MATCH            // Search match
+};
+
+typedef struct {
+    char ch;
+    unsigned char attr;
+} Cell;
+
+// Keys
+enum {
+    KEY_NONE,
+    KEY_CHAR,             // Printable character in KeyEvent.ch
+    KEY_ENTER,
+    KEY_BACKSPACE,
+    KEY_ESCAPE,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_PASTE,            // Pasted text in KeyEvent.text
+    KEY_CTRL              // Ctrl with the lowercase letter in KeyEvent.ch
+};
+
+typedef struct {
+    int key;
+    char ch;
+    const char* text;     // KEY_PASTE: owned by the backend, valid until
+    size_t length;        // the next read_key
+} KeyEvent;
+
+// What one flush sent to the terminal
+typedef struct {
+    int cells;            // Cells written
+    size_t bytes;         // Bytes written
+} FlushStats;
+
+typedef struct {
+    const char* name;
+    int (*init)(void);
+    void (*cleanup)(void);
+    int (*get_size)(int* rows, int* cols);
+    void (*flush)(const Cell* back, Cell* front, int rows, int cols,
+                  int cursor_row, int cursor_col, FlushStats* stats);
+    // 1: event read, 0: timeout or non-key event, -1: error.
+    // timeout_ms < 0 waits indefinitely.
+    int (*read_key)(KeyEvent* event, int timeout_ms);
+} TermBackend;
+
+#ifdef _WIN32
+extern const TermBackend win32_term;
+#else
+extern const TermBackend posix_term;
+
+// Run posix_term on a server client's descriptors instead of the terminal
+// (-1: the terminal again); call before init_screen
+void posix_term_attach(int in, int out, int rows, int cols);
+int posix_term_closed(void);
+#endif
+
+#endif // TVI_TERM_H
@@ -0,0 +1,231 @@
+#ifndef TVI_TEXT_H
+#define TVI_TEXT_H
+
+#include <stddef.h>
+
+// Piece-table text engine. Pure C with no console dependency.
+//
+// The document is stored as an ordered sequence of pieces, each one a span
+// of either the read-only original buffer (the loaded file) or one of the
+// append-only add buffers (everything typed since). Pieces live in a
+// balanced tree (treap) that caches subtree byte and newline counts, so
+// inserts, deletes and line lookups are O(log n) in the number of pieces.
+// Typing within a line goes through a gap buffer (Line) that is written back
+// to the tree lazily.
+//
+// Lines are separated by '\n'. A document of N newlines has N + 1 lines;
+// the trailing newline of a loaded file is not part of the text (see
+// text_load_memory) and is added back when saving.
+
+// Releases an original buffer that is not plain heap memory, e.g. a mapping
+typedef void (*TextReleaseFn)(char* data, size_t length, void* ctx);
+
+// One contiguous source of bytes plus the offsets of its line starts
+typedef struct {
+    char* data;           // Bytes (freed with release, or free() if NULL)
+    size_t length;        // Bytes in use
+    size_t capacity;      // Bytes allocated (add buffers only)
+    size_t* line_starts;  // line_starts[k] = offset just past the k-th '\n'; [0] = 0
+    size_t line_count;    // Entries in line_starts
+    size_t line_cap;      // Allocated entries in line_starts
+    size_t line_stride;   // > 1: line_starts holds only every line_stride-th start
+    TextReleaseFn release;
+    void* release_ctx;
+    char* index_data;     // Memory holding line_starts if it came from outside
+    size_t index_length;  // (see text_load_indexed), given back with
+    TextReleaseFn index_release; // index_release; otherwise line_starts is heap
+    void* index_ctx;
+    char* packed;         // Compressed copy of a full add buffer, NULL if none;
+    size_t packed_length; // data may then be NULL until it is read again
+    unsigned used;        // Packer tick of the last read
+    int readers;          // Readers using data, which may not be dropped
+} TextChunk;
+
+typedef struct PieceNode PieceNode;
+typedef struct NodeSlab NodeSlab;
+typedef struct InternTable InternTable;
+typedef struct TextPager TextPager;
+typedef struct TextPacker TextPacker;
+typedef struct TextIndexer TextIndexer;
+typedef struct TextSnapshot TextSnapshot;
+typedef struct TextSnapshotPack TextSnapshotPack;
+
+// Line under edit, held as a gap buffer outside the piece tree. Its text is
+// data[0, gap_start) followed by data[gap_end, capacity).
+typedef struct {
+    char* data;
+    size_t length;        // Text bytes, excluding the gap
+    size_t capacity;      // Bytes allocated
+    size_t gap_start;
+    size_t gap_end;
+} Line;
+
+// The document
+typedef struct {
+    TextChunk* chunks;    // [0] is the original file, [1..] are add buffers
+    int num_chunks;
+    int chunk_cap;
+    PieceNode* root;      // Piece tree
+    NodeSlab* slabs;      // Storage for the tree's nodes, newest first
+    PieceNode* free_nodes; // Nodes given back, linked through left
+    unsigned seed;        // Treap priority generator state
+    Line line;            // Edit line
+    size_t line_row;      // Row held in the edit line
+    size_t line_tree_length; // Length of that row in the piece tree
+    int line_active;      // 1 if the edit line holds a row
+    int line_dirty;       // 1 if the edit line differs from the tree
+    TextIndexer* indexer; // Background line indexing, NULL when done
+    TextSnapshot* snapshot; // Live snapshot, NULL if none
+    InternTable* interned; // Lines already in the add buffers, NULL if off
+    TextPager* pager;     // Resident pages of the original, NULL unless paged
+    size_t page_budget;   // Large-file mode budget for the next load, 0 = off
+    TextReleaseFn page_evict;
+    void* page_evict_ctx;
+    TextPacker* packer;   // Compression of full add buffers, NULL if off
+    size_t changes;       // Edits since the text was loaded or cleared
+} TextBuffer;
+
+// One contiguous run of document bytes
+typedef struct {
+    const char* data;     // NULL while in a compressed add buffer
+    size_t length;
+} TextSpan;
+
+// Frozen view of a document for readers on other threads. It lists the
+// document's bytes as spans pointing into the buffer's chunks, which stay
+// valid however the buffer is edited afterwards: the original buffer is
+// read-only and add buffers are only ever appended to. If the buffer is
+// cleared or freed first, its chunks are handed over to the snapshot and
+// released with it. Spans in compressed add buffers whose bytes are not in
+// memory are inflated by text_snapshot_foreach as it reaches them.
+struct TextSnapshot {
+    TextSpan* spans;
+    size_t count;
+    size_t length;        // Total bytes
+    TextBuffer* owner;    // Buffer the spans point into, NULL once detached
+    TextChunk* chunks;    // Chunks taken over from the owner when detached
+    int num_chunks;
+    TextChunk* spare;     // Empty chunk array given to the owner on detach
+    const char* paged;    // Original buffer in large-file mode, else NULL
+    size_t paged_length;
+    size_t paged_dropped; // Pages of paged before this offset have been dropped
+    TextReleaseFn evict;  // Drops pages of paged from memory
+    void* evict_ctx;
+    TextSnapshotPack* pack; // Compressed add buffers read from, NULL if none
+};
+
+// Large-file mode, for originals too big to keep in memory. While a budget
+// is set, an original loaded afterwards gets a sparse line index (one entry
+// per TEXT_LINE_STRIDE lines; positions in between are found by scanning)
+// and at most budget bytes of it stay resident. Reads through the buffer
+// touch it a TEXT_PAGE_SIZE page at a time, and once more pages are
+// resident than the budget allows, the least recently used are dropped with
+// evict, to be read back from the file on the next access. Indexing drops
+// each part once scanned, and a save drops each page once written (see
+// text_snapshot_evict). Edits live in the add buffers as usual, so the
+// original is never copied. Setting a budget on a paged buffer applies it
+// at once; 0 stops evicting there and turns the mode off for later loads.
+#define TEXT_PAGE_SIZE (2 * 1024 * 1024) // A huge page, so a fault never maps part of the next one
+#define TEXT_LINE_STRIDE 64
+void text_set_paging(TextBuffer* buf, size_t budget, TextReleaseFn evict, void* ctx);
+
+// Lifetime
+TextBuffer* text_create(void);
+void text_free(TextBuffer* buf);
+void text_clear(TextBuffer* buf);
+int text_load_memory(TextBuffer* buf, char* data, size_t length,
+                     TextReleaseFn release, void* release_ctx);
+int text_load_parallel(TextBuffer* buf, char* data, size_t length,
+                       TextReleaseFn release, void* release_ctx, int threads);
+
+// Line index of an original buffer, as kept between runs: count line
+// starts, one per stride lines. For text_load_indexed, starts lies within
+// data, which release gives back once the buffer is done with it.
+typedef struct {
+    size_t* starts;
+    size_t count;
+    size_t stride;
+    char* data;
+    size_t length;
+    TextReleaseFn release;
+    void* release_ctx;
+} TextLineIndex;
+
+// Like text_load_memory, but with the line index of data already built, so
+// nothing is scanned. The stride must be the one the load would use
+// (TEXT_LINE_STRIDE in large-file mode, else 1). Returns 0 if it is not or
+// the index does not fit data (its starts are checked in one pass); the
+// caller then keeps both.
+int text_load_indexed(TextBuffer* buf, char* data, size_t length,
+                      TextReleaseFn release, void* release_ctx, const TextLineIndex* index);
+
+// The original buffer's line index, for keeping. Returns 0 while it is
+// still being built. Only starts, count and stride are set.
+int text_line_index(TextBuffer* buf, TextLineIndex* index);
+
+// Background indexing
+int text_index_poll(TextBuffer* buf);
+void text_index_wait(TextBuffer* buf);
+int text_index_progress(TextBuffer* buf);
+
+// Memory the buffer holds: the original as far as it may be resident (all
+// of it, unless paged), add buffers, compressed copies and line indexes
+size_t text_memory(TextBuffer* buf);
+
+// Queries
+size_t text_size(TextBuffer* buf);
+size_t text_line_count(TextBuffer* buf);
+size_t text_line_start(TextBuffer* buf, size_t row);
+size_t text_line_length(TextBuffer* buf, size_t row);
+size_t text_offset(TextBuffer* buf, size_t row, size_t col);
+void text_position(TextBuffer* buf, size_t offset, size_t* row, size_t* col);
+
+// Reading
+typedef int (*TextChunkFn)(const char* data, size_t length, void* ctx);
+size_t text_read(TextBuffer* buf, size_t offset, char* dst, size_t length);
+size_t text_get_line(TextBuffer* buf, size_t row, size_t col, char* dst, size_t length);
+int text_foreach(TextBuffer* buf, size_t offset, size_t length, TextChunkFn fn, void* ctx);
+
+// Searching
+#define TEXT_FIND_MAX 256     // Longest pattern text_find accepts
+int text_find(TextBuffer* buf, const char* pat, size_t pat_len, size_t from, size_t to,
+              int backward, size_t* at);
+
+// Snapshots. One may be live per buffer; create and free it on the thread
+// that edits the buffer, read it from any thread. Bytes handed out by
+// text_snapshot_foreach stay valid until text_snapshot_evict is called on
+// them: that drops written pages of a paged original and frees an inflated
+// add buffer once all of its bytes have been written.
+TextSnapshot* text_snapshot(TextBuffer* buf);
+void text_snapshot_free(TextSnapshot* snap);
+int text_snapshot_foreach(const TextSnapshot* snap, TextChunkFn fn, void* ctx);
+void text_snapshot_evict(TextSnapshot* snap, const char* data, size_t length);
+
+// Editing
+int text_insert(TextBuffer* buf, size_t offset, const char* text, size_t length);
+int text_delete(TextBuffer* buf, size_t offset, size_t length);
+int text_insert_char(TextBuffer* buf, size_t row, size_t col, char c);
+int text_delete_char(TextBuffer* buf, size_t row, size_t col);
+int text_flush(TextBuffer* buf);
+
+// Interning. While on, each inserted line that is already in an add buffer
+// becomes a piece pointing at the existing copy instead of being appended
+// again, so repeated lines (log lines, stack frames, separators) put back by
+// :s, undo or the edit line share one copy. Pieces are immutable, so editing
+// a shared line writes the new text elsewhere and leaves the other copies
+// alone. Returns 0 if the table cannot be allocated.
+int text_set_intern(TextBuffer* buf, int on);
+
+// Compression. While on, a background thread compresses each add buffer
+// once it is full, and the plain bytes of a compressed buffer are dropped
+// when they have not been read for a while; reading, searching or editing
+// text there inflates them again. text_pack_poll installs finished work
+// and drops cold buffers; call it from the editing thread's loop, which
+// should keep waking up while text_pack_pending. Turning compression off
+// inflates everything; returns 0 if the thread cannot be started or the
+// memory to inflate is not there.
+int text_set_compress(TextBuffer* buf, int on);
+void text_pack_poll(TextBuffer* buf);
+int text_pack_pending(TextBuffer* buf);
+
+#endif // TVI_TEXT_H
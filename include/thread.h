@@ -0,0 +1,34 @@
+#ifndef TVI_THREAD_H
+#define TVI_THREAD_H
+
+// Minimal threads, mutexes and condition variables over Win32 or pthreads
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE Thread;
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Cond;
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#endif
+
+typedef void (*ThreadFn)(void* arg);
+
+int thread_create(Thread* thread, ThreadFn fn, void* arg);
+void thread_join(Thread thread);
+int thread_cpu_count(void);
+
+void mutex_init(Mutex* mutex);
+void mutex_destroy(Mutex* mutex);
+void mutex_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+
+void cond_init(Cond* cond);
+void cond_destroy(Cond* cond);
+void cond_wait(Cond* cond, Mutex* mutex);
+void cond_broadcast(Cond* cond);
+
+#endif // TVI_THREAD_H
@@ -1,23 +1,58 @@
 #ifndef TVI_H
 #define TVI_H
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <text.h>
+#include <term.h>
+#include <undo.h>
+#include <journal.h>
 
-// Structure to represent a single line of text
+#ifndef _WIN32
+#define _strdup strdup
+#endif
+
+typedef struct SaveJob SaveJob;
+typedef struct Follow Follow;
+
+// Files larger than this open in large-file mode unless told otherwise
+#define PAGE_DEFAULT_BUDGET ((size_t)1024 << 20)
+
+// Memory for all open buffers together unless told otherwise
+#define BUFFER_DEFAULT_BUDGET ((size_t)2048 << 20)
+
+// A file in the buffer list. The one shown lives in EditorState; the fields
+// here hold the others, and are stale for the one shown until it is left.
 typedef struct {
-    char* data;
-    int length;
-} Line;
+    char* filename;       // NULL for a buffer with no file
+    TextBuffer* text;     // NULL until first shown, and again once evicted
+    UndoJournal* undo;
+    Journal* swap;
+    int recover;          // Recover the swap file when first loaded
+    int following;        // Follow the file again when shown
+    int cursor_row;
+    int cursor_col;
+    int row_offset;
+    int col_offset;
+    size_t file_length;
+    long long file_mtime;
+    int cache_index;
+    size_t saved_changes;
+    unsigned long shown;  // When last shown, for evicting the least recent
+} Buffer;
 
 // Structure to hold the entire editor state
 typedef struct {
-    Line* lines;          // Array of lines
-    int num_lines;        // Number of lines
+    TextBuffer* text;     // Document text
     int cursor_row;       // Current cursor row position
     int cursor_col;       // Current cursor column position
+    int row_offset;       // First file row shown in the viewport
+    int col_offset;       // First column shown in the viewport
     int screen_rows;      // Number of rows in the terminal
     int screen_cols;      // Number of columns in the terminal
     char* filename;       // Current filename
@@ -25,6 +60,33 @@ typedef struct {
     char command[256];    // Buffer for command input
     int show_numbers;     // Flag for line numbers (0: off, 1: on)
     int welcome_screen;   // Flag for welcome screen display
+    int index_threads;    // Workers for line indexing and :s (0: one per CPU)
+    int dirty_from;       // First file row to redraw (none if > dirty_to)
+    int dirty_to;         // Last file row to redraw
+    int show_stats;       // Flag for render statistics in the mode line
+    int quit;             // Set when the editor should exit
+    int fsync_on_save;    // Flag for flushing saves to disk before returning
+    char message[256];    // Status shown in the mode line until the next key
+    SaveJob* save_job;    // Save running in the background, NULL if none
+    UndoJournal* undo;    // Edit history for u and Ctrl-R
+    char prompt;          // Command line prompt: ':', or '/' and '?' for a search
+    char search[256];     // Last search pattern
+    int search_backward;  // Flag for the last search going up (?)
+    int show_matches;     // Flag for highlighting matches of the search pattern
+    size_t search_origin; // Cursor offset when the search prompt opened
+    size_t page_budget;   // Memory for a file in large-file mode; larger files use it (0: off)
+    size_t file_length;   // Bytes in the file as loaded, saved or followed
+    long long file_mtime; // Modification time of the file as loaded
+    int cache_index;      // Flag for keeping the line index once it is built
+    Follow* follow;       // File watched for appended text, NULL if none
+    Journal* swap;        // Swap file recording unsaved edits, NULL if none
+    size_t saved_changes; // text->changes as of the last load or save
+    Buffer* buffers;      // Open files; buffers[current] is the one shown
+    int num_buffers;
+    int current;
+    size_t buffer_budget; // Memory for all buffers before unmodified ones are evicted (0: no limit)
+    int use_swap;         // Flag for keeping a swap file for every file loaded
+    size_t undo_limit;    // Undo memory cap of each buffer
 } EditorState;
 
 // Screen handling functions
@@ -32,24 +94,87 @@ void init_screen(EditorState* state);
 void cleanup_screen();
 void update_terminal_size(EditorState* state);
 void refresh_screen(EditorState* state);
+void scroll_to_cursor(EditorState* state);
 void draw_borders(EditorState* state);
 void draw_lines(EditorState* state);
 void draw_status_bar(EditorState* state);
 void draw_command_line(EditorState* state);
+void clear_row(int y, unsigned char attr);
+void mark_dirty(EditorState* state, int from, int to);
+void invalidate_screen(EditorState* state);
+FlushStats screen_flush_stats();
+int screen_read_key(KeyEvent* event, int timeout_ms);
+void screen_set_backend(const TermBackend* backend);
 
 
 // Editor initialization and cleanup
 void init_editor(EditorState* state);
 void free_lines(EditorState* state);
 
+// Background work, shared by every loop that runs the editor
+int editor_busy(EditorState* state);
+void editor_poll(EditorState* state);
+
 // File operations
 int load_file(EditorState* state, const char* filename);
 int save_file(EditorState* state);
+int save_file_async(EditorState* state);
+int save_poll(EditorState* state);
+int save_wait(EditorState* state);
+int save_progress(EditorState* state);
+void set_page_budget(EditorState* state, size_t bytes);
+void index_cache_poll(EditorState* state);
+
+// Swap file
+int swap_open(EditorState* state, int recover);
+void swap_poll(EditorState* state);
+void swap_flush(EditorState* state);
+void swap_close(EditorState* state);
+void swap_insert(EditorState* state, size_t offset, const char* text, size_t length);
+void swap_delete(EditorState* state, size_t offset, size_t length);
+void swap_adopt(EditorState* state, size_t offset, size_t file_offset, size_t length);
+
+// Buffer list
+int buffer_add(EditorState* state, const char* filename, int recover);
+int buffer_switch(EditorState* state, int index);
+int buffer_edit(EditorState* state, const char* filename);
+void buffer_next(EditorState* state, int step);
+void buffer_list(EditorState* state);
+void buffer_set_budget(EditorState* state, size_t bytes);
+void buffer_set_undo_limit(EditorState* state, size_t bytes);
+void buffer_free_all(EditorState* state, int keep_modified);
+
+// Follow mode
+int follow_start(EditorState* state);
+void follow_stop(EditorState* state);
+void follow_saved(EditorState* state);
+int follow_poll(EditorState* state);
+int follow_pending(EditorState* state);
 
 // Input handling
 void handle_input(EditorState* state);
 int process_command(EditorState* state, const char* cmd);
 
+// Search
+void search_begin(EditorState* state, char prompt);
+void search_update(EditorState* state);
+void search_finish(EditorState* state);
+void search_cancel(EditorState* state);
+void search_next(EditorState* state, int reverse);
+const char* search_pattern(EditorState* state);
+
+// Substitute
+int substitute_command(EditorState* state, const char* cmd);
+
+// Server mode
+int server_socket_path(char* path, size_t size);
+int server_run(EditorState* state, const char* socket_path);
+int client_run(const char* socket_path, const char* filename);
+
+// Headless keystroke replay
+int replay_open(const char* path);
+int replay_run(EditorState* state, double load_ms);
+
 // Welcome screen
 void show_welcome_screen(EditorState* state);
 
@@ -58,10 +183,21 @@ void move_cursor_up(EditorState* state);
 void move_cursor_down(EditorState* state);
 void move_cursor_left(EditorState* state);
 void move_cursor_right(EditorState* state);
+void motion_lines(EditorState* state, long count);
+void motion_chars(EditorState* state, long count);
+void motion_goto_line(EditorState* state, size_t line);
+void motion_line_start(EditorState* state);
+void motion_line_end(EditorState* state, long count);
+void motion_word(EditorState* state, char kind, long count);
+int line_end_col(EditorState* state, size_t row);
 
 // Editing functions
 void insert_char(EditorState* state, char c);
+void insert_text(EditorState* state, const char* text, size_t length);
 void delete_char(EditorState* state);
 void insert_newline(EditorState* state);
+void undo_edit(EditorState* state);
+void redo_edit(EditorState* state);
+int crlf_document(EditorState* state);
 
 #endif // TVI_H
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef TVI_UNDO_H
+#define TVI_UNDO_H
+
+#include <stddef.h>
+#include <text.h>
+
+// Undo journal. Every edit is recorded as a primitive insert or delete at a
+// document offset, together with the bytes it added or removed, in one
+// contiguous arena: memory follows the volume of edits, not the file size.
+// Records are grouped into undo units; undo reverts the newest unit and
+// redo reapplies it. Typing that continues where the last insert ended
+// extends that record instead of adding one.
+
+typedef struct {
+    char* data;           // Records, oldest first
+    size_t used;          // Bytes of records
+    size_t capacity;      // Bytes allocated
+    size_t top;           // Records in [0, top) can be undone, [top, used) redone
+    size_t limit;         // Memory cap; the oldest units are dropped past it
+    int group_open;       // The next record joins the newest unit
+    int extendable;       // The newest record may be extended
+} UndoJournal;
+
+#define UNDO_DEFAULT_LIMIT (64u << 20)
+
+UndoJournal* undo_create(size_t limit);
+void undo_free(UndoJournal* j);
+void undo_clear(UndoJournal* j);
+void undo_set_limit(UndoJournal* j, size_t limit);
+
+// Record an edit that has just been applied. Both return 0 if the record
+// could not be stored, in which case the history is dropped.
+int undo_insert(UndoJournal* j, size_t offset, const char* text, size_t length);
+int undo_delete(UndoJournal* j, size_t offset, const char* text, size_t length);
+
+// Close the current unit; the next edit starts a new one
+void undo_break(UndoJournal* j);
+
+// Receives each edit that undo or redo applies, if given
+typedef void (*UndoApplyFn)(int insert, size_t offset, const char* text, size_t length, void* ctx);
+
+// Revert or reapply one unit on buf. *offset is set to where the cursor
+// belongs afterwards. Return 0 if there is nothing to do or an edit failed.
+int undo_undo(UndoJournal* j, TextBuffer* buf, size_t* offset, UndoApplyFn applied, void* ctx);
+int undo_redo(UndoJournal* j, TextBuffer* buf, size_t* offset, UndoApplyFn applied, void* ctx);
+
+#endif // TVI_UNDO_H
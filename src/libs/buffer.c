@@ -0,0 +1,268 @@
+#include <tvi.h>
+
+// The buffer list: every file given on the command line or opened with :e.
+// A buffer's file is loaded when it is first shown, not when it is added,
+// so opening dozens of files costs nothing until they are looked at. The
+// buffer shown lives in EditorState as before; leaving it moves its fields
+// into its Buffer, and showing another moves that one's back.
+//
+// Once the buffers together hold more than buffer_budget (see text_memory),
+// unmodified ones not shown are evicted, least recently shown first: their
+// text and undo history are freed and the file is loaded again when they
+// are next shown, which a cached line index (see index_cache_poll) makes
+// quick for large files. Modified buffers, and buffers with no file, are
+// never evicted. A followed file is only followed while it is shown; it
+// catches up on what was appended meanwhile when shown again.
+
+// Ticks on every switch; a buffer's shown is the tick it was last shown at
+static unsigned long shows;
+
+static int buffer_modified(TextBuffer* text, size_t saved_changes) {
+    return text && text->changes != saved_changes;
+}
+
+// Move the shown buffer's fields out of the editor state into b
+static void buffer_stash(EditorState* state, Buffer* b) {
+    b->following = state->follow != NULL;
+    follow_stop(state);
+    swap_flush(state);
+    b->text = state->text;
+    b->undo = state->undo;
+    b->swap = state->swap;
+    b->cursor_row = state->cursor_row;
+    b->cursor_col = state->cursor_col;
+    b->row_offset = state->row_offset;
+    b->col_offset = state->col_offset;
+    b->file_length = state->file_length;
+    b->file_mtime = state->file_mtime;
+    b->cache_index = state->cache_index;
+    b->saved_changes = state->saved_changes;
+}
+
+// Free a buffer's text, keeping its place in the list. The swap file is
+// deleted unless keep_swap is set.
+static void buffer_unload(Buffer* b, int keep_swap) {
+    journal_close(b->swap, !keep_swap);
+    text_free(b->text);
+    undo_free(b->undo);
+    b->swap = NULL;
+    b->text = NULL;
+    b->undo = NULL;
+}
+
+// Evict unmodified buffers not shown until all of them fit the budget
+static void buffer_evict(EditorState* state) {
+    if (!state->buffer_budget) return;
+    size_t total = text_memory(state->text);
+    for (int i = 0; i < state->num_buffers; i++) {
+        Buffer* b = &state->buffers[i];
+        if (i != state->current && b->text) total += text_memory(b->text);
+    }
+
+    while (total > state->buffer_budget) {
+        Buffer* victim = NULL;
+        for (int i = 0; i < state->num_buffers; i++) {
+            Buffer* b = &state->buffers[i];
+            if (i == state->current || !b->text || !b->filename ||
+                buffer_modified(b->text, b->saved_changes)) continue;
+            if (!victim || b->shown < victim->shown) victim = b;
+        }
+        if (!victim) break;
+        total -= text_memory(victim->text);
+        buffer_unload(victim, 0);
+    }
+}
+
+// Add filename to the list unless it is there already. Returns its index,
+// or -1 if out of memory.
+int buffer_add(EditorState* state, const char* filename, int recover) {
+    for (int i = 0; filename && i < state->num_buffers; i++) {
+        if (state->buffers[i].filename && strcmp(state->buffers[i].filename, filename) == 0) return i;
+    }
+
+    Buffer* buffers = realloc(state->buffers, (state->num_buffers + 1) * sizeof(Buffer));
+    if (!buffers) {
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in buffer_add");
+        return -1;
+    }
+    state->buffers = buffers;
+    Buffer* b = &buffers[state->num_buffers];
+    memset(b, 0, sizeof(Buffer));
+    b->filename = filename ? _strdup(filename) : NULL;
+    if (filename && !b->filename) {
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in buffer_add");
+        return -1;
+    }
+    b->recover = recover;
+    return state->num_buffers++;
+}
+
+// Show buffer index, loading its file if it is not in memory. Returns 0
+// and leaves a message if it cannot be shown.
+int buffer_switch(EditorState* state, int index) {
+    if (index < 0 || index >= state->num_buffers) return 0;
+    Buffer* b = &state->buffers[index];
+    if (index == state->current) {
+        snprintf(state->message, sizeof(state->message), "\"%s\" [%d/%d]",
+                 b->filename ? b->filename : "[No Name]", index + 1, state->num_buffers);
+        return 1;
+    }
+
+    // Before anything is shown, the editor's empty text goes to the first
+    // buffer loaded
+    TextBuffer* text = b->text;
+    UndoJournal* undo = b->undo;
+    int fresh = !text;
+    if (fresh && state->current < 0) {
+        text = state->text;
+        undo = state->undo;
+    } else if (fresh) {
+        text = text_create();
+        undo = undo_create(state->undo_limit);
+        if (!text || !undo) {
+            text_free(text);
+            undo_free(undo);
+            snprintf(state->message, sizeof(state->message), "Memory allocation failed in buffer_switch");
+            return 0;
+        }
+    }
+
+    // A save in flight belongs to the buffer being left
+    save_wait(state);
+    if (state->current >= 0) {
+        buffer_stash(state, &state->buffers[state->current]);
+    } else if (!fresh) {
+        text_free(state->text);
+        undo_free(state->undo);
+    }
+
+    state->current = index;
+    state->filename = b->filename;
+    state->text = text;
+    state->undo = undo;
+    state->swap = b->swap;
+    state->cursor_row = b->cursor_row;
+    state->cursor_col = b->cursor_col;
+    state->row_offset = b->row_offset;
+    state->col_offset = b->col_offset;
+    state->file_length = b->file_length;
+    state->file_mtime = b->file_mtime;
+    state->cache_index = b->cache_index;
+    state->saved_changes = b->saved_changes;
+    state->welcome_screen = 0;
+    b->text = NULL;
+    b->undo = NULL;
+    b->swap = NULL;
+    b->shown = ++shows;
+
+    snprintf(state->message, sizeof(state->message), "\"%s\" [%d/%d]",
+             b->filename ? b->filename : "[No Name]", index + 1, state->num_buffers);
+    if (fresh && b->filename) {
+        load_file(state, b->filename);
+        if (state->use_swap) swap_open(state, b->recover);
+        b->recover = 0;
+    }
+    if (b->following) follow_start(state);
+
+    // The file may have changed since the buffer was evicted
+    int rows = (int)text_line_count(state->text);
+    if (state->cursor_row >= rows) state->cursor_row = rows - 1;
+    int cols = line_end_col(state, state->cursor_row);
+    if (state->cursor_col > cols) state->cursor_col = cols;
+    mark_dirty(state, 0, INT_MAX);
+
+    buffer_evict(state);
+    return 1;
+}
+
+// Open filename in a buffer of its own (:e). A buffer with no file that is
+// still empty, as at startup, is replaced rather than kept.
+int buffer_edit(EditorState* state, const char* filename) {
+    int index = buffer_add(state, filename, 0);
+    if (index < 0) return 0;
+
+    int empty = state->current;
+    if (empty >= 0 && !state->buffers[empty].filename && text_size(state->text) == 0 &&
+        !buffer_modified(state->text, state->saved_changes) && index != empty) {
+        undo_clear(state->undo);
+        memmove(&state->buffers[empty], &state->buffers[empty + 1],
+                (state->num_buffers - empty - 1) * sizeof(Buffer));
+        state->num_buffers--;
+        state->current = -1;
+        if (index > empty) index--;
+    }
+    return buffer_switch(state, index);
+}
+
+// Show the buffer step places after the current one (:bn, :bp), wrapping
+// around the list
+void buffer_next(EditorState* state, int step) {
+    int n = state->num_buffers;
+    if (n == 0 || (n == 1 && state->current == 0)) {
+        snprintf(state->message, sizeof(state->message), "No other buffer");
+        return;
+    }
+    int from = state->current < 0 ? 0 : state->current;
+    buffer_switch(state, ((from + step) % n + n) % n);
+}
+
+// List the buffers in the mode line (:ls): % marks the one shown, + the
+// modified ones
+void buffer_list(EditorState* state) {
+    size_t length = 0;
+    state->message[0] = '\0';
+    for (int i = 0; i < state->num_buffers && length < sizeof(state->message); i++) {
+        Buffer* b = &state->buffers[i];
+        int shown = i == state->current;
+        int modified = shown ? buffer_modified(state->text, state->saved_changes)
+                             : buffer_modified(b->text, b->saved_changes);
+        int n = snprintf(state->message + length, sizeof(state->message) - length, "%s%d%s \"%s\"%s",
+                         i > 0 ? "  " : "", i + 1, shown ? "%" : "",
+                         b->filename ? b->filename : "[No Name]", modified ? " +" : "");
+        if (n < 0) break;
+        length += (size_t)n;
+    }
+    if (state->num_buffers == 0) snprintf(state->message, sizeof(state->message), "No buffers");
+}
+
+// Change the memory for all buffers, evicting down to it at once
+void buffer_set_budget(EditorState* state, size_t bytes) {
+    state->buffer_budget = bytes;
+    buffer_evict(state);
+}
+
+// Change the undo memory cap of every buffer, those loaded later included
+void buffer_set_undo_limit(EditorState* state, size_t bytes) {
+    state->undo_limit = bytes;
+    undo_set_limit(state->undo, bytes);
+    for (int i = 0; i < state->num_buffers; i++) {
+        if (i != state->current && state->buffers[i].undo) undo_set_limit(state->buffers[i].undo, bytes);
+    }
+}
+
+// Free every buffer on exit, deleting their swap files. With keep_modified
+// the swap files of modified buffers are flushed and kept instead, so their
+// edits can be recovered with -r.
+void buffer_free_all(EditorState* state, int keep_modified) {
+    follow_stop(state);
+    if (keep_modified && buffer_modified(state->text, state->saved_changes)) {
+        journal_close(state->swap, 0);
+        state->swap = NULL;
+    } else {
+        swap_close(state);
+    }
+    text_free(state->text);
+    undo_free(state->undo);
+    for (int i = 0; i < state->num_buffers; i++) {
+        Buffer* b = &state->buffers[i];
+        if (i != state->current) buffer_unload(b, keep_modified && buffer_modified(b->text, b->saved_changes));
+        free(b->filename);
+    }
+    free(state->buffers);
+    state->buffers = NULL;
+    state->num_buffers = 0;
+    state->current = -1;
+    state->text = NULL;
+    state->undo = NULL;
+    state->filename = NULL;
+}
@@ -0,0 +1,100 @@
+#include <clock.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+double clock_ms(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000.0 / (double)frequency.QuadPart;
+}
+
+size_t peak_rss_kb(void) {
+    return 0;
+}
+
+#else
+
+#include <sys/resource.h>
+#include <time.h>
+
+double clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+size_t peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss / 1024;
+#else
+    return (size_t)usage.ru_maxrss;
+#endif
+}
+
+#endif
+
+#if defined(TVI_COUNT_ALLOCS) && defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+
+// glibc exports its allocator under __libc_* names, so the program can
+// define malloc itself and count calls from every thread on the way through.
+// Only built with TVI_COUNT_ALLOCS, as the bench and check builds are: it
+// replaces the allocator of the whole program. Left out under the
+// sanitizers, which need to see the real calls.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static size_t allocs;
+static size_t bytes;
+
+static void count(size_t size) {
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    count(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    count(n * size);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    count(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+
+size_t alloc_count(void) {
+    return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+size_t alloc_bytes(void) {
+    return __atomic_load_n(&bytes, __ATOMIC_RELAXED);
+}
+
+#else
+
+size_t alloc_count(void) {
+    return 0;
+}
+
+size_t alloc_bytes(void) {
+    return 0;
+}
+
+#endif
@@ -1,122 +1,126 @@
 #include <tvi.h>
+#include <scan.h>
+
+// A document whose first line ends in "\r\n", as files saved on Windows
+// do, gets "\r\n" for the line breaks typed into it too, so that the file
+// keeps one kind of line end
+int crlf_document(EditorState* state) {
+    return text_line_count(state->text) > 1 &&
+           line_end_col(state, 0) < (int)text_line_length(state->text, 0);
+}
 
 // Insert a character at cursor position
 void insert_char(EditorState* state, char c) {
     if (state->welcome_screen) {
         // Clear welcome screen when first character is entered
         free_lines(state);
-        state->num_lines = 1;
-        state->lines = malloc(sizeof(Line));
-        if (!state->lines) {
-            fprintf(stderr, "Memory allocation failed for new line\n");
+        state->welcome_screen = 0;
+        state->cursor_row = 0;
+        state->cursor_col = 0;
+    }
+
+    size_t offset = text_offset(state->text, state->cursor_row, state->cursor_col);
+    if (!text_insert_char(state->text, state->cursor_row, state->cursor_col, c)) {
+        fprintf(stderr, "Memory allocation failed in insert_char\n");
+        return;
+    }
+    undo_insert(state->undo, offset, &c, 1);
+    swap_insert(state, offset, &c, 1);
+    mark_dirty(state, state->cursor_row, state->cursor_row);
+    state->cursor_col++;
+}
+
+// Insert a run of text at the cursor in one edit and move the cursor past
+// it. Used for pastes and bursts of typing; text uses '\n' line breaks,
+// which become "\r\n" in a document that uses those.
+void insert_text(EditorState* state, const char* text, size_t length) {
+    if (state->welcome_screen) {
+        free_lines(state);
+        state->welcome_screen = 0;
+        state->cursor_row = 0;
+        state->cursor_col = 0;
+    }
+    if (length == 0) return;
+
+    size_t lines = scan_count_lf(text, length);
+    char* converted = NULL;
+    if (lines > 0 && crlf_document(state)) {
+        converted = malloc(length + lines);
+        if (!converted) {
+            fprintf(stderr, "Memory allocation failed in insert_text\n");
             return;
         }
-        
-        state->lines[0].data = malloc(2);
-        if (!state->lines[0].data) {
-            fprintf(stderr, "Memory allocation failed for line data\n");
-            free(state->lines);
-            state->lines = NULL;
-            state->num_lines = 0;
-            return;
+        size_t n = 0;
+        for (size_t i = 0; i < length; i++) {
+            if (text[i] == '\n') converted[n++] = '\r';
+            converted[n++] = text[i];
         }
-        
-        state->lines[0].data[0] = c;
-        state->lines[0].data[1] = '\0';
-        state->lines[0].length = 1;
-        state->welcome_screen = 0;
-        state->cursor_col = 1;
-        
-        // Refresh screen after welcome screen transition
-        refresh_screen(state);
+        text = converted;
+        length = n;
+    }
+
+    size_t offset = text_offset(state->text, state->cursor_row, state->cursor_col);
+    if (!text_insert(state->text, offset, text, length)) {
+        fprintf(stderr, "Memory allocation failed in insert_text\n");
+        free(converted);
         return;
     }
-    
-    Line* line = &state->lines[state->cursor_row];
-    char* new_data = realloc(line->data, line->length + 2);
-    if (!new_data) {
-        fprintf(stderr, "Memory allocation failed in insert_char\n");
+    undo_insert(state->undo, offset, text, length);
+    swap_insert(state, offset, text, length);
+
+    if (lines == 0) {
+        mark_dirty(state, state->cursor_row, state->cursor_row);
+        state->cursor_col += (int)length;
         return;
     }
-    line->data = new_data;
-    
-    // Shift characters to make space
-    memmove(&line->data[state->cursor_col + 1], 
-           &line->data[state->cursor_col], 
-           line->length - state->cursor_col + 1);
-    
-    // Insert new character
-    line->data[state->cursor_col] = c;
-    line->length++;
-    state->cursor_col++;
-    
-    // Critical: Refresh screen after insertion
-    refresh_screen(state);
+
+    // Every row below moves down; the cursor ends after the last line break
+    mark_dirty(state, state->cursor_row, INT_MAX);
+    size_t last = length;
+    while (text[last - 1] != '\n') last--;
+    state->cursor_row += (int)lines;
+    state->cursor_col = (int)(length - last);
+    free(converted);
 }
 
 // Delete character at cursor position
 void delete_char(EditorState* state) {
-    if (state->welcome_screen || state->num_lines == 0) return;
-    
-    Line* line = &state->lines[state->cursor_row];
-    
+    if (state->welcome_screen) return;
+
     if (state->cursor_col > 0) {
-        // Delete character before cursor
-        memmove(&line->data[state->cursor_col - 1], 
-               &line->data[state->cursor_col], 
-               line->length - state->cursor_col + 1);
-        line->length--;
-        
-        // Only realloc if we're reducing the size significantly
-        if (line->length + 1 < (size_t)(line->length + 2)) {
-            char* new_data = realloc(line->data, line->length + 1);
-            if (new_data) {
-                line->data = new_data;
-            }
+        // Delete character before cursor, keeping it for undo
+        char c = 0;
+        int col = state->cursor_col - 1;
+        text_get_line(state->text, state->cursor_row, col, &c, 1);
+        size_t offset = text_offset(state->text, state->cursor_row, col);
+        if (!text_delete_char(state->text, state->cursor_row, state->cursor_col)) {
+            fprintf(stderr, "Memory allocation failed in delete_char\n");
+            return;
         }
-        
+        undo_delete(state->undo, offset, &c, 1);
+        swap_delete(state, offset, 1);
+        mark_dirty(state, state->cursor_row, state->cursor_row);
         state->cursor_col--;
     } else if (state->cursor_row > 0) {
-        // Merge with previous line
-        Line* prev_line = &state->lines[state->cursor_row - 1];
-        size_t new_length = prev_line->length + line->length;
-        
-        // Allocate space for merged line
-        char* new_data = realloc(prev_line->data, new_length + 1);
-        if (!new_data) {
+        // Merge with previous line by removing the newline that ends it,
+        // with its '\r' if it is a "\r\n"
+        int prev_length = line_end_col(state, state->cursor_row - 1);
+        size_t length = text_line_length(state->text, state->cursor_row - 1) - prev_length + 1;
+        size_t offset = text_offset(state->text, state->cursor_row, 0) - length;
+        if (!text_delete(state->text, offset, length)) {
             fprintf(stderr, "Memory allocation failed in delete_char\n");
             return;
         }
-        prev_line->data = new_data;
-        
-        // Append current line to previous line
-        strcat(prev_line->data, line->data);
-        prev_line->length = new_length;
-        
+        undo_delete(state->undo, offset, length == 2 ? "\r\n" : "\n", length);
+        swap_delete(state, offset, length);
+
         // Move cursor to end of previous line
-        state->cursor_col = prev_line->length;
         state->cursor_row--;
-        
-        // Remove current line
-        free(line->data);
-        state->num_lines--;
-        
-        // Shift remaining lines
-        if (state->cursor_row + 1 < state->num_lines) {
-            memmove(&state->lines[state->cursor_row + 1], 
-                   &state->lines[state->cursor_row + 2], 
-                   (state->num_lines - state->cursor_row - 1) * sizeof(Line));
-        }
-        
-        // Realloc lines array
-        Line* new_lines = realloc(state->lines, state->num_lines * sizeof(Line));
-        if (new_lines) {
-            state->lines = new_lines;
-        }
+        state->cursor_col = prev_length;
+
+        // Every row below moves up
+        mark_dirty(state, state->cursor_row, INT_MAX);
     }
-    
-    // Critical: Refresh screen after deletion
-    refresh_screen(state);
 }
 
 // Insert new line at cursor position
@@ -124,98 +128,76 @@ void insert_newline(EditorState* state) {
     if (state->welcome_screen) {
         // Clear welcome screen when first newline is entered
         free_lines(state);
-        state->num_lines = 1;
-        state->lines = malloc(sizeof(Line));
-        if (!state->lines) {
-            fprintf(stderr, "Memory allocation failed for new line\n");
-            return;
-        }
-        
-        state->lines[0].data = malloc(1);
-        if (!state->lines[0].data) {
-            fprintf(stderr, "Memory allocation failed for line data\n");
-            free(state->lines);
-            state->lines = NULL;
-            state->num_lines = 0;
-            return;
-        }
-        
-        state->lines[0].data[0] = '\0';
-        state->lines[0].length = 0;
         state->welcome_screen = 0;
     } else {
-        // Current line info
-        int current_row = state->cursor_row;
-        Line* current_line = &state->lines[current_row];
-        
-        // Create new line with content after cursor
-        Line new_line;
-        new_line.length = current_line->length - state->cursor_col;
-        new_line.data = malloc(new_line.length + 1);
-        if (!new_line.data) {
+        // Split the current line at the cursor
+        const char* line_break = crlf_document(state) ? "\r\n" : "\n";
+        size_t length = strlen(line_break);
+        size_t offset = text_offset(state->text, state->cursor_row, state->cursor_col);
+        if (!text_insert(state->text, offset, line_break, length)) {
             fprintf(stderr, "Memory allocation failed for new line\n");
             return;
         }
-        
-        strncpy(new_line.data, &current_line->data[state->cursor_col], new_line.length);
-        new_line.data[new_line.length] = '\0';
-        
-        // Truncate current line at cursor position
-        current_line->length = state->cursor_col;
-        char* truncated_data = realloc(current_line->data, current_line->length + 1);
-        if (truncated_data) {
-            current_line->data = truncated_data;
-        }
-        current_line->data[current_line->length] = '\0';
-        
-        // Insert new line into lines array
-        state->num_lines++;
-        Line* new_lines = realloc(state->lines, state->num_lines * sizeof(Line));
-        if (!new_lines) {
-            fprintf(stderr, "Memory allocation failed for lines array\n");
-            free(new_line.data);
-            state->num_lines--;
-            return;
-        }
-        state->lines = new_lines;
-        
-        // Shift lines to make space
-        memmove(&state->lines[current_row + 2], 
-               &state->lines[current_row + 1], 
-               (state->num_lines - current_row - 2) * sizeof(Line));
-        state->lines[current_row + 1] = new_line;
-        
+        undo_insert(state->undo, offset, line_break, length);
+        swap_insert(state, offset, line_break, length);
+
+        // Every row below moves down
+        mark_dirty(state, state->cursor_row, INT_MAX);
+
         // Move cursor to start of new line
         state->cursor_row++;
     }
-    
+
     state->cursor_col = 0;
-    
-    // Critical: Refresh screen after new line
-    refresh_screen(state);
+}
+
+// Move the cursor to a document offset after undo or redo; rows below may
+// have changed, so all of them are redrawn
+static void cursor_to_offset(EditorState* state, size_t offset) {
+    size_t row, col;
+    text_position(state->text, offset, &row, &col);
+    state->cursor_row = (int)row;
+    state->cursor_col = (int)col;
+    mark_dirty(state, 0, INT_MAX);
+}
+
+// Journal an edit made by undo or redo in the swap file
+static void swap_applied(int insert, size_t offset, const char* text, size_t length, void* ctx) {
+    if (insert) swap_insert(ctx, offset, text, length);
+    else swap_delete(ctx, offset, length);
+}
+
+// Revert the last change
+void undo_edit(EditorState* state) {
+    size_t offset;
+    if (state->welcome_screen) return;
+    if (!undo_undo(state->undo, state->text, &offset, swap_applied, state)) {
+        snprintf(state->message, sizeof(state->message), "Already at oldest change");
+        return;
+    }
+    cursor_to_offset(state, offset);
+}
+
+// Reapply the last reverted change
+void redo_edit(EditorState* state) {
+    size_t offset;
+    if (state->welcome_screen) return;
+    if (!undo_redo(state->undo, state->text, &offset, swap_applied, state)) {
+        snprintf(state->message, sizeof(state->message), "Already at newest change");
+        return;
+    }
+    cursor_to_offset(state, offset);
 }
 
 // Show welcome screen when no file is opened
 void show_welcome_screen(EditorState* state) {
     // Clear any existing lines
     free_lines(state);
-    
+
     // Welcome screen will be rendered in draw_lines
-    state->num_lines = 0;
     state->cursor_row = 0;
     state->cursor_col = 0;
+    state->row_offset = 0;
+    state->col_offset = 0;
     state->welcome_screen = 1;
-    
-    // Refresh to show welcome screen
-    refresh_screen(state);
 }
-
-// Helper function to free all lines
-// void free_lines(EditorState* state) {
-//     for (int i = 0; i < state->num_lines; i++) {
-//         free(state->lines[i].data);
-//     }
-//     free(state->lines);
-//     state->lines = NULL;
-//     state->num_lines = 0;
-// }
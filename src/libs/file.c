@@ -1,11 +1,35 @@
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // madvise
+#endif
 #include <tvi.h>
+#include <clock.h>
+#include <thread.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#endif
 
 // Initialize editor state
 void init_editor(EditorState* state) {
-    state->lines = NULL;
-    state->num_lines = 0;
+    state->text = text_create();
+    if (!state->text) {
+        fprintf(stderr, "Memory allocation failed for text buffer\n");
+        exit(1);
+    }
     state->cursor_row = 0;
     state->cursor_col = 0;
+    state->row_offset = 0;
+    state->col_offset = 0;
     state->screen_rows = 24;
     state->screen_cols = 80;
     state->filename = NULL;
@@ -13,87 +37,1023 @@ void init_editor(EditorState* state) {
     state->command[0] = '\0';
     state->show_numbers = 0; // Line numbers off by default
     state->welcome_screen = 0;
+    state->index_threads = 0;
+    state->dirty_from = 0;
+    state->dirty_to = INT_MAX;
+    state->show_stats = 0;
+    state->quit = 0;
+    state->fsync_on_save = 0;
+    state->message[0] = '\0';
+    state->save_job = NULL;
+    state->follow = NULL;
+    state->file_length = 0;
+    state->swap = NULL;
+    state->file_mtime = 0;
+    state->cache_index = 0;
+    state->saved_changes = 0;
+    state->buffers = NULL;
+    state->num_buffers = 0;
+    state->current = -1;
+    state->buffer_budget = BUFFER_DEFAULT_BUDGET;
+    state->use_swap = 0;
+    state->prompt = ':';
+    state->search[0] = '\0';
+    state->search_backward = 0;
+    state->show_matches = 0;
+    state->search_origin = 0;
+    state->page_budget = PAGE_DEFAULT_BUDGET;
+    state->undo_limit = UNDO_DEFAULT_LIMIT;
+    state->undo = undo_create(state->undo_limit);
+    if (!state->undo) {
+        fprintf(stderr, "Memory allocation failed for undo journal\n");
+        exit(1);
+    }
 }
 
-// Free allocated lines
+// Drop all text, leaving a single empty line
 void free_lines(EditorState* state) {
-    for (int i = 0; i < state->num_lines; i++) {
-        free(state->lines[i].data);
+    text_clear(state->text);
+    undo_clear(state->undo);
+}
+
+// 1 while there is background work for editor_poll to pick up: a file
+// being indexed or saved, add buffers waiting to be compressed, a file
+// being followed or edits waiting for the swap file. A loop waiting for
+// input should then wake up periodically.
+int editor_busy(EditorState* state) {
+    return text_index_progress(state->text) >= 0 || save_progress(state) >= 0 ||
+           text_pack_pending(state->text) || state->follow ||
+           (state->swap && journal_pending(state->swap));
+}
+
+// Take in the results of background work; called once per pass of the
+// editor loop, after handle_input
+void editor_poll(EditorState* state) {
+    // Pick up lines indexed in the background since the last pass
+    if (text_index_poll(state->text)) {
+        mark_dirty(state, 0, INT_MAX);
     }
-    free(state->lines);
-    state->lines = NULL;
-    state->num_lines = 0;
+
+    // Keep the line index of a large file once it is complete
+    index_cache_poll(state);
+
+    // Report a background save that has finished
+    save_poll(state);
+
+    // Take in compressed add buffers and drop cold ones
+    text_pack_poll(state->text);
+
+    // Take in text appended to a followed file
+    follow_poll(state);
+
+    // Write edits to the swap file once a batch is due
+    swap_poll(state);
+}
+
+// filename with suffix appended, for files kept next to it
+static char* sibling_path(const char* filename, const char* suffix) {
+    size_t length = strlen(filename) + strlen(suffix) + 1;
+    char* path = malloc(length);
+    if (path) snprintf(path, length, "%s%s", filename, suffix);
+    return path;
+}
+
+#ifdef _WIN32
+
+// Windows cannot replace a file while a view of it is mapped, so save_file
+// renames the original to '<name>.tvi-old' first. The aside copy is deleted
+// once the mapping is gone; ctx holds its path.
+static void unmap_file(char* data, size_t length, void* ctx) {
+    UnmapViewOfFile(data);
+    if (ctx) {
+        DeleteFileA((char*)ctx);
+        free(ctx);
+    }
+}
+
+// Map filename read-only; returns NULL if it cannot be mapped. own is
+// only checked on POSIX.
+static char* map_file(const char* filename, int own, size_t* length, void** ctx) {
+    (void)own;
+    HANDLE file = CreateFileA(filename, GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (ULONGLONG)size.QuadPart > SIZE_MAX) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) return NULL;
+
+    char* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data) return NULL;
+
+    *length = (size_t)size.QuadPart;
+    *ctx = sibling_path(filename, ".tvi-old");
+    return data;
+}
+
+// Take pages of a mapping out of the working set; they are read back from
+// the file when next touched
+static void evict_pages(char* data, size_t length, void* ctx) {
+    VirtualUnlock(data, length);
+}
+
+// The mapping is opened for sequential scans already
+static void read_ahead(char* data, size_t length) {
 }
 
-// Load file into editor
+#else
+
+static void unmap_file(char* data, size_t length, void* ctx) {
+    munmap(data, length);
+}
+
+// Map filename read-only; returns NULL if it cannot be mapped, or with own
+// if it belongs to another user
+static char* map_file(const char* filename, int own, size_t* length, void** ctx) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (own && st.st_uid != geteuid())) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    *length = st.st_size;
+    *ctx = NULL;
+    return data;
+}
+
+// Unmap pages of a mapping; they are read back from the file (or the page
+// cache) when next touched
+static void evict_pages(char* data, size_t length, void* ctx) {
+    madvise(data, length, MADV_DONTNEED);
+}
+
+// Start reading all of a mapping in, ahead of a scan through it
+static void read_ahead(char* data, size_t length) {
+    madvise(data, length, MADV_WILLNEED);
+}
+
+#endif
+
+// Read a whole stream into memory
+static char* read_stream(FILE* file, size_t* length) {
+    size_t capacity = 64 * 1024;
+    size_t used = 0;
+    char* data = malloc(capacity);
+    if (!data) return NULL;
+
+    size_t n;
+    while ((n = fread(data + used, 1, capacity - used, file)) > 0) {
+        used += n;
+        if (used == capacity) {
+            char* grown = realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+    }
+
+    *length = used;
+    return data;
+}
+
+static JournalBase file_base(const char* filename) {
+    JournalBase base = { 0, 0 };
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(filename, &st) == 0) {
+#else
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+#endif
+        base.size = (size_t)st.st_size;
+        base.mtime = (long long)st.st_mtime;
+    }
+    return base;
+}
+
+static int replace_file(const char* temp, const char* filename);
+
+// ---------------------------------------------------------------------------
+// Line index cache: the line starts of a large file, kept next to it as
+// '<name>.tvi-idx' once indexed so that the next load maps them instead of
+// scanning the file. The cache names the file by size, modification time
+// and a hash of bytes sampled across it; one that does not match is
+// ignored, and replaced once the file has been indexed again.
+
+typedef struct {
+    char magic[8];
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint64_t sample_hash;
+    uint64_t count;       // Line starts that follow, as size_t
+    uint32_t stride;
+    uint32_t word_size;   // sizeof(size_t) where it was written
+} IndexCacheHeader;
+
+static const char index_cache_magic[8] = { 'T', 'V', 'I', 'I', 'D', 'X', '1', 0 };
+
+// Smaller files are scanned about as fast as their cache would be read
+#define INDEX_CACHE_MIN ((size_t)64 << 20)
+
+#define INDEX_CACHE_SAMPLES 64
+#define INDEX_CACHE_SAMPLE_SIZE 4096
+
+// Offset of sample i of a file of length bytes; samples are whole pages
+// where the file allows
+static size_t sample_at(size_t length, size_t span, size_t i) {
+    if (i == INDEX_CACHE_SAMPLES - 1) return length - span;
+    size_t at = (length - span) / (INDEX_CACHE_SAMPLES - 1) * i;
+    return at - at % INDEX_CACHE_SAMPLE_SIZE;
+}
+
+// FNV-1a over evenly spaced samples, the first and last included: cheap
+// even for files too large to read, and enough to notice one rewritten in
+// place with the same size and time. The samples are read ahead together,
+// so that on a cold cache the reads overlap instead of queueing one by one.
+static uint64_t sample_hash(char* data, size_t length) {
+    uint64_t h = 14695981039346656037ull;
+    size_t span = length < INDEX_CACHE_SAMPLE_SIZE ? length : INDEX_CACHE_SAMPLE_SIZE;
+    for (size_t i = 0; i < INDEX_CACHE_SAMPLES; i++) {
+        size_t at = sample_at(length, span, i);
+        size_t page = at - at % INDEX_CACHE_SAMPLE_SIZE;
+        read_ahead(data + page, at + span - page);
+    }
+    for (size_t i = 0; i < INDEX_CACHE_SAMPLES; i++) {
+        size_t at = sample_at(length, span, i);
+        for (size_t k = 0; k < span; k++) {
+            h ^= (unsigned char)data[at + k];
+            h *= 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+// Load data with the line index cached for it, if there is a matching one.
+// A cache that belongs to another user is not trusted, and one that does
+// not fit data, e.g. damaged, is ignored (see text_load_indexed).
+static int load_cached_index(EditorState* state, const char* filename, char* data,
+                             size_t length, void* ctx) {
+    char* path = sibling_path(filename, ".tvi-idx");
+    size_t cache_length;
+    void* cache_ctx;
+    char* cache = path ? map_file(path, 1, &cache_length, &cache_ctx) : NULL;
+    free(path);
+    if (!cache) return 0;
+
+    IndexCacheHeader h;
+    int ok = cache_length >= sizeof(h);
+    if (ok) {
+        memcpy(&h, cache, sizeof(h));
+        ok = memcmp(h.magic, index_cache_magic, sizeof(h.magic)) == 0 &&
+             h.word_size == sizeof(size_t) && h.file_size == length &&
+             h.file_mtime == state->file_mtime &&
+             h.count == (cache_length - sizeof(h)) / sizeof(size_t) &&
+             h.sample_hash == sample_hash(data, length);
+    }
+    if (ok) {
+        read_ahead(cache, cache_length);
+        TextLineIndex index = { (size_t*)(cache + sizeof(h)), (size_t)h.count, h.stride,
+                                cache, cache_length, unmap_file, cache_ctx };
+        ok = text_load_indexed(state->text, data, length, unmap_file, ctx, &index);
+    }
+    if (!ok) unmap_file(cache, cache_length, cache_ctx);
+    return ok;
+}
+
+// Create a uniquely named temp file next to filename for its cache,
+// readable by the user only. It is created exclusively, which also does not
+// follow a link, so nothing planted under the name in a shared directory is
+// written through. Returns the file, with its path in *temp, or NULL.
+static FILE* index_cache_temp(const char* filename, char** temp) {
+    *temp = sibling_path(filename, ".tvi-idx.XXXXXX");
+    if (!*temp) return NULL;
+#ifdef _WIN32
+    int fd = _mktemp_s(*temp, strlen(*temp) + 1) == 0
+           ? _open(*temp, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE) : -1;
+    FILE* file = fd >= 0 ? _fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !file) _close(fd);
+#else
+    int fd = mkstemp(*temp); // O_CREAT | O_EXCL, mode 0600
+    FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !file) close(fd);
+#endif
+    if (fd >= 0 && !file) remove(*temp);
+    if (!file) {
+        free(*temp);
+        *temp = NULL;
+    }
+    return file;
+}
+
+// Once a file loaded without a matching cache is fully indexed, write the
+// cache for the next load. Skipped if the file has changed since it was
+// loaded, e.g. saved over or grown while followed.
+void index_cache_poll(EditorState* state) {
+    TextLineIndex index;
+    if (!state->cache_index || !text_line_index(state->text, &index)) return;
+    state->cache_index = 0;
+
+    JournalBase base = file_base(state->filename);
+    const TextChunk* original = &state->text->chunks[0];
+    if (base.size != original->length || base.size != state->file_length ||
+        base.mtime != state->file_mtime) return;
+
+    IndexCacheHeader h;
+    memcpy(h.magic, index_cache_magic, sizeof(h.magic));
+    h.file_size = original->length;
+    h.file_mtime = state->file_mtime;
+    h.sample_hash = sample_hash(original->data, original->length);
+    h.count = index.count;
+    h.stride = (uint32_t)index.stride;
+    h.word_size = sizeof(size_t);
+
+    char* path = sibling_path(state->filename, ".tvi-idx");
+    char* temp = NULL;
+    FILE* file = path ? index_cache_temp(state->filename, &temp) : NULL;
+    if (file) {
+        int ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+                 fwrite(index.starts, sizeof(size_t), index.count, file) == index.count;
+        if (fclose(file) != 0) ok = 0;
+        if (!ok || !replace_file(temp, path)) remove(temp);
+    }
+    free(path);
+    free(temp);
+}
+
+// Load file into editor. Regular files are memory-mapped and become the
+// piece table's original buffer, so untouched lines are read straight from
+// the mapping and never copied. Large files are line-indexed in the
+// background on index_threads workers, and files over page_budget open in
+// large-file mode (see text_set_paging). Files of INDEX_CACHE_MIN or more
+// take their line index from the cache when it matches (see
+// index_cache_poll).
 int load_file(EditorState* state, const char* filename) {
-    FILE* file = fopen(filename, "r");
+    size_t length;
+    void* ctx;
+    undo_clear(state->undo);
+    char* data = map_file(filename, 0, &length, &ctx);
+    state->file_length = 0;
+    state->file_mtime = file_base(filename).mtime;
+    state->cache_index = 0;
+    state->saved_changes = 0;
+
+    // Mapped files larger than the budget are paged rather than kept
+    // resident; what is read into the heap cannot be dropped and read back
+    int paged = data && state->page_budget && length > state->page_budget;
+    text_set_paging(state->text, paged ? state->page_budget : 0, evict_pages, NULL);
+    if (data) {
+        state->file_length = length;
+        if (length >= INDEX_CACHE_MIN) {
+            if (load_cached_index(state, filename, data, length, ctx)) return 1;
+            state->cache_index = 1;
+        }
+
+        // Indexing reads every page
+        read_ahead(data, length);
+        if (text_load_parallel(state->text, data, length, unmap_file, ctx,
+                               state->index_threads)) return 1;
+        unmap_file(data, length, ctx);
+        fprintf(stderr, "Memory allocation failed in load_file\n");
+        return 0;
+    }
+
+    // Empty files, pipes and devices cannot be mapped; read them instead
+    FILE* file = fopen(filename, "rb");
     if (!file) {
         // If file doesn't exist, create empty document
-        state->num_lines = 1;
-        state->lines = malloc(sizeof(Line));
-        state->lines[0].data = malloc(1);
-        state->lines[0].data[0] = '\0';
-        state->lines[0].length = 0;
+        text_clear(state->text);
         return 0;
     }
-    
-    // Count lines first
-    int line_count = 0;
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), file)) {
-        line_count++;
-    }
-    rewind(file);
-    
-    // Allocate lines array
-    free_lines(state);
-    state->lines = malloc(sizeof(Line) * line_count);
-    state->num_lines = line_count;
-    
-    // Read lines into array
-    for (int i = 0; i < line_count; i++) {
-        if (fgets(buffer, sizeof(buffer), file)) {
-            // Remove newline character
-            int len = strlen(buffer);
-            if (len > 0 && buffer[len - 1] == '\n') {
-                buffer[len - 1] = '\0';
-                len--;
-            }
-            
-            state->lines[i].data = _strdup(buffer);
-            state->lines[i].length = len;
-        } else {
-            // Handle read error
-            state->lines[i].data = malloc(1);
-            state->lines[i].data[0] = '\0';
-            state->lines[i].length = 0;
+
+    data = read_stream(file, &length);
+    fclose(file);
+    if (!data || !text_load_memory(state->text, data, length, NULL, NULL)) {
+        fprintf(stderr, "Memory allocation failed in load_file\n");
+        free(data);
+        return 0;
+    }
+    state->file_length = length;
+    return 1;
+}
+
+// Output for save_file. Pieces of the buffer are written straight from
+// where they live: on POSIX they are gathered into writev batches, on
+// Windows they go through a large stdio buffer.
+#ifdef _WIN32
+
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE* file;
+    TextSnapshot* snap;
+} SaveFile;
+
+// Create the temp file at path exclusively, so that nothing already there
+// is written through; one left by a save that crashed is removed first
+static int save_open(SaveFile* out, const char* path, const char* original) {
+    (void)original;
+    remove(path);
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+    out->file = fd >= 0 ? _fdopen(fd, "wb") : NULL;
+    if (!out->file) {
+        if (fd >= 0) _close(fd);
+        return 0;
+    }
+    setvbuf(out->file, NULL, _IOFBF, SAVE_BUFFER_SIZE);
+    return 1;
+}
+
+static int save_write(const char* data, size_t length, void* ctx) {
+    SaveFile* out = ctx;
+    if (fwrite(data, 1, length, out->file) != length) return 0;
+    text_snapshot_evict(out->snap, data, length); // Copied or written by now
+    return 1;
+}
+
+static int save_close(SaveFile* out, int sync) {
+    int ok = fflush(out->file) == 0;
+    if (ok && sync) ok = FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(out->file))) != 0;
+    if (fclose(out->file) != 0) ok = 0;
+    return ok;
+}
+
+#else
+
+#define SAVE_IOV_MAX 1024
+
+// Bytes copied at a time by a save in place
+#define SAVE_COPY_SIZE (1 << 20)
+
+// Bytes gathered before a write, so that in large-file mode the pages
+// written can be dropped before too many more are read in
+#define SAVE_BATCH_BYTES (16 << 20)
+
+typedef struct {
+    int fd;
+    struct iovec iov[SAVE_IOV_MAX];
+    int count;
+    size_t pending;       // Bytes in iov
+    TextSnapshot* snap;
+} SaveFile;
+
+// Create the temp file at path for a save over original: exclusively, so
+// that nothing already there is written through, and with the owner, group
+// and permissions of original before any text goes in. A new file gets the
+// usual 0666 less the umask. A temp file left by a save that crashed is
+// removed first.
+static int save_open(SaveFile* out, const char* path, const char* original) {
+    struct stat st;
+    int exists = stat(original, &st) == 0;
+    unlink(path);
+    out->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, exists ? 0600 : 0666);
+    out->count = 0;
+    out->pending = 0;
+    if (out->fd < 0) return 0;
+    if (exists) {
+        if (fchown(out->fd, st.st_uid, st.st_gid) != 0 &&
+            fchown(out->fd, (uid_t)-1, st.st_gid) != 0) {
+            // Only root may give a file away; it stays the user's
         }
+        fchmod(out->fd, st.st_mode & 07777);
     }
-    
-    fclose(file);
     return 1;
 }
 
-// Save file from editor
+// For a save in place: an unnamed scratch file in $TMPDIR that takes the
+// text first, since the text may be read from a mapping of the target
+static int save_open_scratch(SaveFile* out) {
+    const char* dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tvi-save-XXXXXX", dir && *dir ? dir : "/tmp");
+    out->fd = mkstemp(path);
+    out->count = 0;
+    out->pending = 0;
+    if (out->fd < 0) return 0;
+    unlink(path);
+    return 1;
+}
+
+// Write out the gathered pieces, resuming after short writes
+static int save_drain(SaveFile* out) {
+    struct iovec* iov = out->iov;
+    int count = out->count;
+    out->count = 0;
+    out->pending = 0;
+    while (count > 0) {
+        ssize_t n = writev(out->fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            text_snapshot_evict(out->snap, iov->iov_base, iov->iov_len);
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+static int save_write(const char* data, size_t length, void* ctx) {
+    SaveFile* out = ctx;
+    if ((out->count == SAVE_IOV_MAX || out->pending >= SAVE_BATCH_BYTES) && !save_drain(out)) return 0;
+    out->iov[out->count].iov_base = (void*)data;
+    out->iov[out->count].iov_len = length;
+    out->count++;
+    out->pending += length;
+    return 1;
+}
+
+static int save_close(SaveFile* out, int sync) {
+    int ok = save_drain(out);
+    if (ok && sync) ok = fsync(out->fd) == 0;
+    if (close(out->fd) != 0) ok = 0;
+    return ok;
+}
+
+// Copy the scratch file over path and close both. The file keeps its
+// inode, so its hard links, owner and permissions stay; unlike a rename
+// this is not atomic.
+static int save_copy_back(SaveFile* out, const char* path, int sync) {
+    char* data = malloc(SAVE_COPY_SIZE);
+    int fd = -1;
+    int ok = data && save_drain(out) && lseek(out->fd, 0, SEEK_SET) == 0 &&
+             (fd = open(path, O_WRONLY | O_TRUNC)) >= 0;
+    ssize_t n;
+    while (ok && (n = read(out->fd, data, SAVE_COPY_SIZE)) != 0) {
+        if (n < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        for (ssize_t done = 0; ok && done < n;) {
+            ssize_t w = write(fd, data + done, (size_t)(n - done));
+            if (w > 0) done += w;
+            else ok = w < 0 && errno == EINTR;
+        }
+    }
+    if (ok && sync) ok = fsync(fd) == 0;
+    int error = errno;
+    if (fd >= 0 && close(fd) != 0 && ok) {
+        ok = 0;
+        error = errno;
+    }
+    close(out->fd);
+    free(data);
+    errno = error;
+    return ok;
+}
+
+// Directory holding filename, as a new string
+static char* parent_dir(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    size_t length = !slash ? 1 : slash == filename ? 1 : (size_t)(slash - filename);
+    char* dir = malloc(length + 1);
+    if (dir) {
+        memcpy(dir, slash ? filename : ".", length);
+        dir[length] = '\0';
+    }
+    return dir;
+}
+
+// Make the rename itself durable by syncing the directory holding filename
+static void sync_parent(const char* filename) {
+    char* dir = parent_dir(filename);
+    int fd = open(dir ? dir : ".", O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+#endif
+
+// Move the saved temp file over the target
+static int replace_file(const char* temp, const char* filename) {
+#ifdef _WIN32
+    if (MoveFileExA(temp, filename, MOVEFILE_REPLACE_EXISTING)) return 1;
+
+    // The target is mapped by the buffer; move it aside (see unmap_file)
+    char* aside = sibling_path(filename, ".tvi-old");
+    int ok = aside &&
+             MoveFileExA(filename, aside, MOVEFILE_REPLACE_EXISTING) &&
+             MoveFileExA(temp, filename, 0);
+    free(aside);
+    return ok;
+#else
+    return rename(temp, filename) == 0;
+#endif
+}
+
+// Where a save writes: filename with symbolic links resolved, so that a
+// link stays a link and the file it points at is replaced
+static char* save_path(const char* filename) {
+#ifndef _WIN32
+    char* path = realpath(filename, NULL);
+    if (path) return path;
+#endif
+    return _strdup(filename);
+}
+
+// 1 if path must be written in place rather than replaced by a renamed
+// temp file: a rename would split it from its other hard links, and needs
+// a directory the user may write to
+static int save_in_place(const char* path) {
+#ifdef _WIN32
+    (void)path;
+    return 0;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    if (st.st_nlink > 1) return 1;
+    char* dir = parent_dir(path);
+    int in_place = dir && access(dir, W_OK) != 0;
+    free(dir);
+    return in_place;
+#endif
+}
+
+// A save: what to write, where, and how it went. Written by the thread that
+// runs it; done and written are shared with the editor under lock.
+struct SaveJob {
+    TextSnapshot* snap;
+    char* filename;
+    char* path;           // filename with links resolved
+    int in_place;         // Overwrite path rather than rename over it
+    int sync;
+    size_t swap_mark;     // End of the swap file when the save started
+    size_t changes;       // text->changes when the save started
+    Thread thread;
+    Mutex lock;
+    int done;
+    size_t written;
+    int ok;
+    int error;            // errno of the failure
+    double ms;
+};
+
+// Bytes written between progress updates
+#define SAVE_PROGRESS_STEP (4 << 20)
+
+typedef struct {
+    SaveFile out;
+    SaveJob* job;
+    size_t written;
+    size_t reported;
+} SaveTarget;
+
+static int write_span(const char* data, size_t length, void* ctx) {
+    SaveTarget* target = ctx;
+    if (!save_write(data, length, &target->out)) return 0;
+    target->written += length;
+    if (target->written - target->reported >= SAVE_PROGRESS_STEP) {
+        mutex_lock(&target->job->lock);
+        target->job->written = target->written;
+        mutex_unlock(&target->job->lock);
+        target->reported = target->written;
+    }
+    return 1;
+}
+
+// Write the job's snapshot to a temporary file that then replaces the
+// target, since the buffer may still be reading the old contents through a
+// mapping of it; a crash mid-save leaves the old file intact. With sync the
+// data and the rename are flushed to disk before returning.
+//
+// A save in place (see save_in_place) writes the snapshot to a scratch file
+// instead and copies that over the target. It runs on the editor thread,
+// which then loads the file again (see save_reload).
+static void run_save(SaveJob* job) {
+    double start = clock_ms();
+    char* temp = job->in_place ? NULL : sibling_path(job->path, ".tvi-tmp");
+    SaveTarget target = { { 0 }, job, 0, 0 };
+    target.out.snap = job->snap;
+
+#ifdef _WIN32
+    int ok = temp && save_open(&target.out, temp, job->path);
+#else
+    int ok = job->in_place ? save_open_scratch(&target.out)
+                           : temp && save_open(&target.out, temp, job->path);
+#endif
+    int error = ok ? 0 : errno;
+    if (ok) {
+        // Write text followed by the final newline
+        ok = text_snapshot_foreach(job->snap, write_span, &target) &&
+             write_span("\n", 1, &target);
+        if (!ok) error = errno;
+#ifndef _WIN32
+        if (job->in_place) {
+            if (!save_copy_back(&target.out, job->path, job->sync) && ok) {
+                ok = 0;
+                error = errno;
+            }
+        } else
+#endif
+        if (!save_close(&target.out, job->sync) && ok) {
+            ok = 0;
+            error = errno;
+        }
+        if (ok && temp && !replace_file(temp, job->path)) {
+            ok = 0;
+            error = errno;
+        }
+        if (!ok && temp) remove(temp);
+    }
+#ifndef _WIN32
+    if (ok && job->sync && temp) sync_parent(job->path);
+#endif
+    free(temp);
+
+    mutex_lock(&job->lock);
+    job->ok = ok;
+    job->error = error;
+    job->written = target.written;
+    job->ms = clock_ms() - start;
+    job->done = 1;
+    mutex_unlock(&job->lock);
+}
+
+static void save_thread(void* arg) {
+    run_save(arg);
+}
+
+static SaveJob* save_job_new(EditorState* state) {
+    SaveJob* job = calloc(1, sizeof(SaveJob));
+    if (!job) return NULL;
+    job->filename = _strdup(state->filename);
+    job->path = save_path(state->filename);
+    job->snap = text_snapshot(state->text);
+    if (!job->filename || !job->path || !job->snap) {
+        free(job->filename);
+        free(job->path);
+        text_snapshot_free(job->snap);
+        free(job);
+        return NULL;
+    }
+    job->sync = state->fsync_on_save;
+    job->swap_mark = state->swap ? journal_mark(state->swap) : 0;
+    job->changes = state->text->changes;
+    job->in_place = save_in_place(job->path);
+
+    // Overwriting the file changes what its mapping reads; the indexer must
+    // be done with it first
+    if (job->in_place) text_index_wait(state->text);
+    mutex_init(&job->lock);
+    return job;
+}
+
+// After a save in place the mapping the text reads the file's old contents
+// from holds the new ones. Load the file again: it reads back as the same
+// text, so the cursor and the undo history stay as they are.
+static void save_reload(EditorState* state) {
+    UndoJournal* undo = state->undo;
+    UndoJournal* scratch = undo_create(state->undo_limit);
+    if (scratch) state->undo = scratch;
+    load_file(state, state->filename);
+    if (scratch) {
+        undo_free(scratch);
+        state->undo = undo;
+    }
+    mark_dirty(state, 0, INT_MAX);
+}
+
+static void swap_failed(EditorState* state);
+
+// Report a finished job in the mode line and release it
+static int save_job_finish(EditorState* state, SaveJob* job) {
+    int ok = job->ok;
+    int reload = ok && job->in_place;
+    if (ok) {
+        double mb = job->written / 1048576.0;
+        snprintf(state->message, sizeof(state->message),
+                 "\"%s\" %.1f MB written in %.0f ms (%.0f MB/s)%s",
+                 job->filename, mb, job->ms, job->ms > 0 ? mb / (job->ms / 1000) : 0.0,
+                 job->sync ? ", synced" : "");
+        state->file_length = job->written;
+        state->saved_changes = job->changes;
+        follow_saved(state);
+        if (state->swap && !journal_rebase(state->swap, job->swap_mark, file_base(job->filename))) {
+            swap_failed(state);
+        }
+    } else {
+        snprintf(state->message, sizeof(state->message), "Cannot save %s: %s",
+                 job->filename, strerror(job->error));
+    }
+    text_snapshot_free(job->snap);
+    mutex_destroy(&job->lock);
+    free(job->filename);
+    free(job->path);
+    free(job);
+    if (reload) save_reload(state);
+    return ok;
+}
+
+static int check_filename(EditorState* state) {
+    if (state->filename) return 1;
+    // No filename specified - could add prompt here in future
+    snprintf(state->message, sizeof(state->message), "No file name");
+    return 0;
+}
+
+// Save file from editor and wait for it. Returns 1 on success; either way
+// the outcome is left in state->message.
 int save_file(EditorState* state) {
-    if (!state->filename) {
-        // No filename specified - could add prompt here in future
+    save_wait(state);
+    if (!check_filename(state)) return 0;
+
+    SaveJob* job = save_job_new(state);
+    if (!job) {
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in save_file");
         return 0;
     }
-    
-    FILE* file = fopen(state->filename, "w");
-    if (!file) {
+    run_save(job);
+    return save_job_finish(state, job);
+}
+
+// Start saving in the background and return at once. The writer works
+// from a snapshot, so editing can go on; save_poll reports the outcome.
+// Falls back to a blocking save if no thread can be started; a save in
+// place always blocks (see run_save).
+int save_file_async(EditorState* state) {
+    save_wait(state);
+    if (!check_filename(state)) return 0;
+
+    SaveJob* job = save_job_new(state);
+    if (!job) {
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in save_file");
         return 0;
     }
-    
-    // Write lines to file
-    for (int i = 0; i < state->num_lines; i++) {
-        fputs(state->lines[i].data, file);
-        fputc('\n', file); // Add newline after each line
+    if (job->in_place || !thread_create(&job->thread, save_thread, job)) {
+        run_save(job);
+        return save_job_finish(state, job);
     }
-    
-    fclose(file);
+    state->save_job = job;
+    return 1;
+}
+
+// Pick up a finished background save. Returns 1 if one finished.
+int save_poll(EditorState* state) {
+    SaveJob* job = state->save_job;
+    if (!job) return 0;
+
+    mutex_lock(&job->lock);
+    int done = job->done;
+    mutex_unlock(&job->lock);
+    if (!done) return 0;
+
+    thread_join(job->thread);
+    state->save_job = NULL;
+    save_job_finish(state, job);
     return 1;
 }
-    
\ No newline at end of file
+
+// Block until the background save, if any, has finished. Returns 0 if it
+// failed.
+int save_wait(EditorState* state) {
+    SaveJob* job = state->save_job;
+    if (!job) return 1;
+
+    thread_join(job->thread);
+    state->save_job = NULL;
+    return save_job_finish(state, job);
+}
+
+// Change the large-file budget. A file open in large-file mode is trimmed
+// to it at once; otherwise it applies from the next load.
+void set_page_budget(EditorState* state, size_t bytes) {
+    state->page_budget = bytes;
+    if (state->text->pager) text_set_paging(state->text, bytes, evict_pages, NULL);
+}
+
+// Percentage written by the background save, or -1 if none is running
+int save_progress(EditorState* state) {
+    SaveJob* job = state->save_job;
+    if (!job) return -1;
+
+    mutex_lock(&job->lock);
+    size_t written = job->written;
+    mutex_unlock(&job->lock);
+    size_t total = job->snap->length + 1;
+    return (int)(written * 100 / total);
+}
+
+// ---------------------------------------------------------------------------
+// Swap file: edits not yet saved, journaled next to the file as
+// '<name>.tvi-swp' so that they survive the editor dying (see journal.h)
+
+// Stop journaling after a write to the swap file failed; its edits so far
+// are still recoverable from it
+static void swap_failed(EditorState* state) {
+    snprintf(state->message, sizeof(state->message),
+             "Cannot write swap file: %s; edits are no longer recorded", strerror(errno));
+    journal_close(state->swap, 0);
+    state->swap = NULL;
+}
+
+// Cut the document back to the first size bytes of its file, which are in
+// it as loaded, less a final newline
+static void cut_document(EditorState* state, size_t size) {
+    size_t length = text_size(state->text);
+    if (size > length) return;
+    char last = 0;
+    if (size > 0) text_read(state->text, size - 1, &last, 1);
+    size_t keep = size - (last == '\n');
+    text_delete(state->text, keep, length - keep);
+}
+
+// Start the swap file of the file just loaded. With recover, the edits in
+// one left behind are replayed onto the document first and journaling goes
+// on in it; otherwise an existing one is left alone and nothing is
+// journaled. Returns 0 if there is no swap file afterwards.
+int swap_open(EditorState* state, int recover) {
+    if (!state->filename || state->swap) return state->swap != NULL;
+    char* path = sibling_path(state->filename, ".tvi-swp");
+    if (!path) return 0;
+
+    JournalBase base = file_base(state->filename);
+    if (recover) {
+        JournalBase from;
+        size_t edits;
+        if (!journal_base(path, &from)) {
+            snprintf(state->message, sizeof(state->message), "No swap file for %s", state->filename);
+        } else {
+            // A file followed since has grown past the journal's start: the
+            // edits apply to its first from.size bytes, and what was taken
+            // in after them is part of the journal
+            if (from.size < base.size) cut_document(state, from.size);
+            state->swap = journal_recover(path, state->filename, state->text, &from, &edits);
+            mark_dirty(state, 0, INT_MAX);
+            if (!state->swap) {
+                snprintf(state->message, sizeof(state->message),
+                         "Cannot recover %s: stopped after %zu edits", path, edits);
+            } else {
+                snprintf(state->message, sizeof(state->message),
+                         "Recovered %zu edit%s from %s%s; :w keeps them", edits, edits == 1 ? "" : "s",
+                         path, from.size > base.size || (from.size == base.size && from.mtime != base.mtime) ?
+                         " (the file has changed since)" : "");
+            }
+            free(path);
+            return state->swap != NULL;
+        }
+    }
+
+    state->swap = journal_create(path, base);
+    if (!state->swap && errno == EEXIST) {
+        snprintf(state->message, sizeof(state->message),
+                 "Swap file %s exists: tvi -r %s recovers it", path, state->filename);
+    }
+    free(path);
+    return state->swap != NULL;
+}
+
+// Write journaled edits once the batch is due
+void swap_poll(EditorState* state) {
+    if (state->swap && !journal_poll(state->swap)) swap_failed(state);
+}
+
+// Write journaled edits at once, as when the buffer is left
+void swap_flush(EditorState* state) {
+    if (state->swap && !journal_flush(state->swap)) swap_failed(state);
+}
+
+// Delete the swap file on a normal exit
+void swap_close(EditorState* state) {
+    journal_close(state->swap, 1);
+    state->swap = NULL;
+}
+
+void swap_insert(EditorState* state, size_t offset, const char* text, size_t length) {
+    if (state->swap && !journal_insert(state->swap, offset, text, length)) swap_failed(state);
+}
+
+void swap_delete(EditorState* state, size_t offset, size_t length) {
+    if (state->swap && !journal_delete(state->swap, offset, length)) swap_failed(state);
+}
+
+void swap_adopt(EditorState* state, size_t offset, size_t file_offset, size_t length) {
+    if (state->swap && !journal_adopt(state->swap, offset, file_offset, length)) swap_failed(state);
+}
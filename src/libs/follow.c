@@ -0,0 +1,272 @@
+#include <tvi.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Follow mode, as with tail -f: the file being edited is watched for bytes
+// appended to it. Only those are read, from where the last read stopped,
+// and they are inserted at the end of the document, so they land in the add
+// buffers and the line index grows by just their lines; nothing loaded
+// before is read again. On Linux inotify says when the file has changed;
+// elsewhere its size is checked on every poll.
+//
+// A trailing newline of the file is not part of the text (see
+// text_load_memory), so the last newline read is held back until more text
+// follows it.
+
+// Bytes read per call, and at most per poll so that the screen keeps
+// updating while a burst is taken in
+#define FOLLOW_READ_SIZE (4 << 20)
+#define FOLLOW_POLL_MAX (64 << 20)
+
+struct Follow {
+    int fd;               // The file, open for reading
+    int watch;            // inotify instance, -1 if sizes are polled
+    size_t offset;        // Bytes of the file taken in so far
+    int pending_lf;       // The file ends in a newline not yet in the document
+    int behind;           // More was there than one poll takes in
+    char* buffer;
+};
+
+#ifdef _WIN32
+
+static int file_open(const char* filename) {
+    return _open(filename, _O_RDONLY | _O_BINARY);
+}
+
+static int file_close(int fd) {
+    return _close(fd);
+}
+
+static int file_size(int fd, size_t* size) {
+    struct _stat64 st;
+    if (_fstat64(fd, &st) != 0) return 0;
+    *size = (size_t)st.st_size;
+    return 1;
+}
+
+static long file_read(int fd, char* dst, size_t length, size_t offset) {
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return -1;
+    return _read(fd, dst, (unsigned)length);
+}
+
+// Windows keeps a file that is open from being replaced
+static int file_replaced(int fd, const char* filename) {
+    return 0;
+}
+
+#else
+
+static int file_open(const char* filename) {
+    return open(filename, O_RDONLY);
+}
+
+static int file_close(int fd) {
+    return close(fd);
+}
+
+static int file_size(int fd, size_t* size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    *size = (size_t)st.st_size;
+    return 1;
+}
+
+static long file_read(int fd, char* dst, size_t length, size_t offset) {
+    ssize_t n;
+    do {
+        n = pread(fd, dst, length, (off_t)offset);
+    } while (n < 0 && errno == EINTR);
+    return (long)n;
+}
+
+// 1 if filename no longer names the open file, e.g. after log rotation or a
+// save, which writes a new file over it
+static int file_replaced(int fd, const char* filename) {
+    struct stat open_st, path_st;
+    if (fstat(fd, &open_st) != 0 || stat(filename, &path_st) != 0) return 1;
+    return open_st.st_dev != path_st.st_dev || open_st.st_ino != path_st.st_ino;
+}
+
+#endif
+
+// Drain pending change notifications; returns 1 if the file may have grown
+// or been replaced. Without inotify, always 1.
+static int follow_changed(Follow* f) {
+#ifdef __linux__
+    if (f->watch < 0) return 1;
+    char events[4096];
+    int changed = 0;
+    while (read(f->watch, events, sizeof(events)) > 0) changed = 1;
+    return changed;
+#else
+    return 1;
+#endif
+}
+
+static void follow_close(Follow* f) {
+#ifdef __linux__
+    if (f->watch >= 0) close(f->watch);
+#endif
+    file_close(f->fd);
+}
+
+// Open and watch filename, to be taken in from offset. pending_lf says
+// whether the document is owed a newline before the next bytes.
+static int follow_open(Follow* f, const char* filename, size_t offset, int pending_lf) {
+    f->fd = file_open(filename);
+    if (f->fd < 0) return 0;
+    f->watch = -1;
+#ifdef __linux__
+    f->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->watch >= 0 &&
+        inotify_add_watch(f->watch, filename,
+                          IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0) {
+        close(f->watch);
+        f->watch = -1;
+    }
+#endif
+    f->offset = offset;
+    f->pending_lf = pending_lf;
+    f->behind = 1; // Catch up with anything written meanwhile
+    return 1;
+}
+
+// Start following the current file from the end of what was loaded.
+// Returns 0 and leaves a message if it cannot be opened.
+int follow_start(EditorState* state) {
+    if (state->follow) return 1;
+    if (!state->filename) {
+        snprintf(state->message, sizeof(state->message), "No file name");
+        return 0;
+    }
+
+    Follow* f = calloc(1, sizeof(Follow));
+    if (f) f->buffer = malloc(FOLLOW_READ_SIZE);
+    if (!f || !f->buffer) {
+        if (f) free(f->buffer);
+        free(f);
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in follow_start");
+        return 0;
+    }
+    if (!follow_open(f, state->filename, state->file_length, 0)) {
+        snprintf(state->message, sizeof(state->message), "Cannot follow %s: %s",
+                 state->filename, strerror(errno));
+        free(f->buffer);
+        free(f);
+        return 0;
+    }
+
+    // The newline ending the file was left out of the document
+    char last = 0;
+    if (f->offset > 0 && file_read(f->fd, &last, 1, f->offset - 1) == 1) {
+        f->pending_lf = last == '\n';
+    }
+    state->follow = f;
+    snprintf(state->message, sizeof(state->message), "Following \"%s\"", state->filename);
+    return 1;
+}
+
+void follow_stop(EditorState* state) {
+    Follow* f = state->follow;
+    if (!f) return;
+    follow_close(f);
+    free(f->buffer);
+    free(f);
+    state->follow = NULL;
+}
+
+// Go on following a file just saved over the one being followed. The file
+// holds the document and a final newline, state->file_length bytes in all.
+void follow_saved(EditorState* state) {
+    Follow* f = state->follow;
+    if (!f) return;
+    follow_close(f);
+    if (!follow_open(f, state->filename, state->file_length, 1)) follow_stop(state);
+}
+
+// 1 while following and more has been written than taken in, so the caller
+// should poll again soon
+int follow_pending(EditorState* state) {
+    return state->follow && state->follow->behind;
+}
+
+// Append bytes read from the file at f->offset to the document. The swap
+// file records where they came from rather than the bytes themselves.
+static int follow_append(EditorState* state, Follow* f, const char* data, size_t length) {
+    TextBuffer* text = state->text;
+    if (f->pending_lf) {
+        if (!text_insert(text, text_size(text), "\n", 1)) return 0;
+        swap_insert(state, text_size(text) - 1, "\n", 1);
+    }
+    f->pending_lf = data[length - 1] == '\n';
+    size_t end = text_size(text);
+    if (!text_insert(text, end, data, length - f->pending_lf)) return 0;
+    swap_adopt(state, end, f->offset, length - f->pending_lf);
+    return 1;
+}
+
+// Take in whatever was appended to the file since the last poll. Returns 1
+// if the document grew. A cursor on the last line in normal mode moves to
+// the new last line, so the view keeps showing the end of the file. A file
+// replaced under its name, as by log rotation, is followed from the start
+// of the new one; a truncated one from its start.
+int follow_poll(EditorState* state) {
+    Follow* f = state->follow;
+    if (!f || state->save_job || (!follow_changed(f) && !f->behind)) return 0;
+
+    size_t size;
+    if (file_replaced(f->fd, state->filename)) {
+        follow_close(f);
+        if (!follow_open(f, state->filename, 0, text_size(state->text) > 0)) {
+            follow_stop(state);
+            snprintf(state->message, sizeof(state->message),
+                     "\"%s\" is gone; no longer following", state->filename);
+            return 0;
+        }
+    }
+    if (!file_size(f->fd, &size)) return 0;
+    if (size < f->offset) {
+        f->offset = 0;
+        f->pending_lf = text_size(state->text) > 0;
+    }
+
+    // Text taken in from the file leaves an unmodified buffer unmodified
+    int unmodified = state->text->changes == state->saved_changes;
+    size_t last_row = text_line_count(state->text) - 1;
+    size_t taken = 0;
+    while (f->offset < size && taken < FOLLOW_POLL_MAX) {
+        size_t want = size - f->offset < FOLLOW_READ_SIZE ? size - f->offset : FOLLOW_READ_SIZE;
+        long n = file_read(f->fd, f->buffer, want, f->offset);
+        if (n <= 0) break;
+        int ok = follow_append(state, f, f->buffer, (size_t)n);
+        if (unmodified) state->saved_changes = state->text->changes;
+        if (!ok) {
+            follow_stop(state);
+            snprintf(state->message, sizeof(state->message), "Memory allocation failed in follow_poll");
+            return taken > 0;
+        }
+        f->offset += (size_t)n;
+        taken += (size_t)n;
+    }
+    f->behind = f->offset < size;
+    state->file_length = f->offset;
+    if (taken == 0) return 0;
+
+    mark_dirty(state, (int)last_row, INT_MAX);
+    if (state->mode == 0 && (size_t)state->cursor_row == last_row) {
+        state->cursor_row = (int)(text_line_count(state->text) - 1);
+        state->cursor_col = 0;
+    }
+    return 1;
+}
@@ -1,54 +1,47 @@
 #include <tvi.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 
-static HANDLE hStdIn;
-static DWORD originalConsoleMode;
+// Most key events handled before the screen is rendered again
+#define INPUT_BATCH_MAX 65536
 
-/**
- * Initialize console input system with raw mode configuration
- * Disables line buffering and input echo for proper editor behavior
- */
-void init_input() {
-    // Get standard input handle
-    hStdIn = GetStdHandle(STD_INPUT_HANDLE);
-    if (hStdIn == INVALID_HANDLE_VALUE) {
-        fprintf(stderr, "Error: Failed to get input handle (error %lu)\n", GetLastError());
-        exit(1);
-    }
-
-    // Save original console mode for later restoration
-    if (!GetConsoleMode(hStdIn, &originalConsoleMode)) {
-        fprintf(stderr, "Error: Failed to get console mode (error %lu)\n", GetLastError());
-        exit(1);
-    }
+// Text typed or pasted since the last flush_batch, inserted as one edit
+static char* batch;
+static size_t batch_len;
+static size_t batch_cap;
+static int batch_cr;          // Last byte appended was a '\r'
 
-    // Configure optimal input mode for editor
-    DWORD rawMode = originalConsoleMode;
-    rawMode &= ~ENABLE_ECHO_INPUT;          // Disable input echoing
-    rawMode &= ~ENABLE_LINE_INPUT;          // Disable line buffering
-    rawMode |= ENABLE_PROCESSED_INPUT;      // Enable basic input processing
-    rawMode |= ENABLE_VIRTUAL_TERMINAL_INPUT; // Enable VT100 support
-
-    // Apply input mode with fallback compatibility
-    if (!SetConsoleMode(hStdIn, rawMode)) {
-        fprintf(stderr, "Warning: Primary input mode failed (error %lu), trying fallback\n", GetLastError());
-        
-        // Fallback mode for older systems
-        rawMode = ENABLE_PROCESSED_INPUT;
-        rawMode &= ~ENABLE_ECHO_INPUT;
-        rawMode &= ~ENABLE_LINE_INPUT;
-        
-        if (!SetConsoleMode(hStdIn, rawMode)) {
-            fprintf(stderr, "Error: Failed to set fallback input mode (error %lu)\n", GetLastError());
-            exit(1);
-        }
-    }
-}
+// Normal-mode keys typed so far: a count, then the start of a sequence
+#define NORMAL_COUNT_MAX 1000000000L
+#define NORMAL_KEYS_MAX 4
+static long normal_count;     // 0 if none was typed
+static char normal_keys[NORMAL_KEYS_MAX];
+static int normal_len;
 
 /**
- * Restore original console input mode before program exit
+ * Parse the value of a numeric :set option
+ * @param state Editor state structure, for the message if it is invalid
+ * @param cmd Command string, ending in the value
+ * @param name Length of the command before the value, up to its '='
+ * @param max Largest value allowed
+ * @param value Receives the value
+ * @return 1 if the value is a whole number up to max, 0 otherwise
  */
-void restore_input_mode() {
-    SetConsoleMode(hStdIn, originalConsoleMode);
+static int set_value(EditorState* state, const char* cmd, size_t name, unsigned long max,
+                     unsigned long* value) {
+    const char* text = cmd + name;
+    char* end = (char*)text;
+    errno = 0;
+    // Digits only: strtoul would also take blanks and a sign, and negate
+    // a negative value into a huge one
+    if (isdigit((unsigned char)*text)) *value = strtoul(text, &end, 10);
+    if (end == text || *end || errno == ERANGE || *value > max) {
+        snprintf(state->message, sizeof(state->message), "Invalid value for %.*s: %.100s",
+                 (int)(name - 5), cmd + 4, text);
+        return 0;
+    }
+    return 1;
 }
 
 /**
@@ -61,13 +54,78 @@ int process_command(EditorState* state, const char* cmd) {
     if (strcmp(cmd, "q") == 0) {
         return 1; // Quit without saving
     } else if (strcmp(cmd, "w") == 0) {
-        save_file(state); // Save current file
+        save_file_async(state); // Save current file in the background
     } else if (strcmp(cmd, "wq") == 0) {
-        if (save_file(state)) return 1; // Save and quit
+        if (save_file(state)) return 1; // Save and quit, after any save in flight
     } else if (strcmp(cmd, "set number") == 0) {
         state->show_numbers = 1; // Enable line numbers
     } else if (strcmp(cmd, "set nonumber") == 0) {
         state->show_numbers = 0; // Disable line numbers
+    } else if (strcmp(cmd, "set stats") == 0) {
+        state->show_stats = 1; // Show render statistics
+    } else if (strcmp(cmd, "set nostats") == 0) {
+        state->show_stats = 0; // Hide render statistics
+    } else if (strcmp(cmd, "set fsync") == 0) {
+        state->fsync_on_save = 1; // Flush saves to disk
+    } else if (strcmp(cmd, "set nofsync") == 0) {
+        state->fsync_on_save = 0; // Leave flushing to the OS
+    } else if (strcmp(cmd, "set intern") == 0) {
+        if (!text_set_intern(state->text, 1)) { // Share repeated inserted lines
+            snprintf(state->message, sizeof(state->message), "Not enough memory for interning");
+        }
+    } else if (strcmp(cmd, "set nointern") == 0) {
+        text_set_intern(state->text, 0); // Store every inserted line separately
+    } else if (strcmp(cmd, "set compress") == 0) {
+        if (!text_set_compress(state->text, 1)) { // Compress add buffers going cold
+            snprintf(state->message, sizeof(state->message), "Cannot start compression");
+        }
+    } else if (strcmp(cmd, "set nocompress") == 0) {
+        if (!text_set_compress(state->text, 0)) { // Keep everything inflated
+            snprintf(state->message, sizeof(state->message), "Not enough memory to inflate");
+        }
+    } else if (strcmp(cmd, "follow") == 0) {
+        follow_start(state); // Take in text appended to the file as it arrives
+    } else if (strcmp(cmd, "nofollow") == 0) {
+        follow_stop(state); // Stop watching the file
+    } else if (strncmp(cmd, "e ", 2) == 0 && cmd[2]) {
+        buffer_edit(state, cmd + 2); // Open a file in a buffer of its own
+    } else if (strcmp(cmd, "e") == 0) {
+        snprintf(state->message, sizeof(state->message), "No file name");
+    } else if (strcmp(cmd, "bn") == 0) {
+        buffer_next(state, 1); // Show the next buffer
+    } else if (strcmp(cmd, "bp") == 0) {
+        buffer_next(state, -1); // Show the previous buffer
+    } else if (strcmp(cmd, "ls") == 0) {
+        buffer_list(state); // List the buffers in the mode line
+    } else if (strcmp(cmd, "noh") == 0) {
+        state->show_matches = 0; // Stop highlighting search matches
+        mark_dirty(state, 0, INT_MAX);
+    } else if (strcmp(cmd, "redraw") == 0) {
+        invalidate_screen(state); // Resend every cell on the next frame
+    } else if (strncmp(cmd, "set threads=", 12) == 0) {
+        unsigned long n;
+        if (set_value(state, cmd, 12, INT_MAX, &n)) {
+            state->index_threads = (int)n; // Workers for indexing and :s
+        }
+    } else if (strncmp(cmd, "set undomem=", 12) == 0) {
+        unsigned long mb;
+        if (set_value(state, cmd, 12, SIZE_MAX >> 20, &mb)) {
+            buffer_set_undo_limit(state, (size_t)mb << 20); // Undo memory cap in MB
+        }
+    } else if (strncmp(cmd, "set pagemem=", 12) == 0) {
+        unsigned long mb;
+        if (set_value(state, cmd, 12, SIZE_MAX >> 20, &mb)) {
+            set_page_budget(state, (size_t)mb << 20); // Large-file memory in MB
+        }
+    } else if (strncmp(cmd, "set buffermem=", 14) == 0) {
+        unsigned long mb;
+        if (set_value(state, cmd, 14, SIZE_MAX >> 20, &mb)) {
+            buffer_set_budget(state, (size_t)mb << 20); // Memory for all buffers in MB
+        }
+    } else if (cmd[0] >= '0' && cmd[0] <= '9' && strspn(cmd, "0123456789") == strlen(cmd)) {
+        motion_goto_line(state, (size_t)strtoull(cmd, NULL, 10)); // Jump to line N
+    } else if (substitute_command(state, cmd)) {
+        // [range]s/pattern/replacement/[g], run on the workers
     }
     
     // Reset command state
@@ -77,170 +135,361 @@ int process_command(EditorState* state, const char* cmd) {
 }
 
 /**
- * Move cursor up with boundary checking
+ * Move cursor up one line
  * @param state Editor state structure
  */
 void move_cursor_up(EditorState* state) {
-    if (state->welcome_screen || state->cursor_row <= 0) return;
-    
-    state->cursor_row--;
-    // Adjust column if new row is shorter than current column position
-    if (state->cursor_col > state->lines[state->cursor_row].length) {
-        state->cursor_col = state->lines[state->cursor_row].length;
-    }
+    motion_lines(state, -1);
 }
 
 /**
- * Move cursor down with boundary checking
+ * Move cursor down one line
  * @param state Editor state structure
  */
 void move_cursor_down(EditorState* state) {
-    if (state->welcome_screen || state->cursor_row >= state->num_lines - 1) return;
-    
-    state->cursor_row++;
-    // Adjust column if new row is shorter than current column position
-    if (state->cursor_col > state->lines[state->cursor_row].length) {
-        state->cursor_col = state->lines[state->cursor_row].length;
-    }
+    motion_lines(state, 1);
 }
 
 /**
- * Move cursor left with boundary checking and line wrapping
+ * Move cursor left, wrapping to the end of the previous line
  * @param state Editor state structure
  */
 void move_cursor_left(EditorState* state) {
-    if (state->welcome_screen) return;
-    
-    if (state->cursor_col > 0) {
-        state->cursor_col--;
-    } else if (state->cursor_row > 0) {
-        // Wrap to end of previous line
-        state->cursor_row--;
-        state->cursor_col = state->lines[state->cursor_row].length;
-    }
+    motion_chars(state, -1);
 }
 
 /**
- * Move cursor right with boundary checking and line wrapping
+ * Move cursor right, wrapping to the start of the next line
  * @param state Editor state structure
  */
 void move_cursor_right(EditorState* state) {
-    if (state->welcome_screen) return;
-    
-    if (state->cursor_col < state->lines[state->cursor_row].length) {
-        state->cursor_col++;
-    } else if (state->cursor_row < state->num_lines - 1) {
-        // Wrap to start of next line
-        state->cursor_row++;
-        state->cursor_col = 0;
-    }
+    motion_chars(state, 1);
+}
+
+// Normal-mode commands. count is the number typed before the keys, 0 if
+// none; motions take it as the distance, the others leave it.
+typedef void (*NormalFn)(EditorState* state, long count);
+
+static long count_or_one(long count) {
+    return count > 0 ? count : 1;
+}
+
+static void normal_left(EditorState* state, long count) {
+    motion_chars(state, -count_or_one(count));
+}
+
+static void normal_down(EditorState* state, long count) {
+    motion_lines(state, count_or_one(count));
+}
+
+static void normal_up(EditorState* state, long count) {
+    motion_lines(state, -count_or_one(count));
+}
+
+static void normal_right(EditorState* state, long count) {
+    motion_chars(state, count_or_one(count));
+}
+
+static void normal_line_start(EditorState* state, long count) {
+    motion_line_start(state);
+}
+
+static void normal_line_end(EditorState* state, long count) {
+    motion_line_end(state, count_or_one(count));
+}
+
+static void normal_word(EditorState* state, long count) {
+    motion_word(state, 'w', count_or_one(count));
+}
+
+static void normal_word_back(EditorState* state, long count) {
+    motion_word(state, 'b', count_or_one(count));
+}
+
+static void normal_word_end(EditorState* state, long count) {
+    motion_word(state, 'e', count_or_one(count));
+}
+
+static void normal_last_line(EditorState* state, long count) {
+    motion_goto_line(state, count > 0 ? (size_t)count : SIZE_MAX);
+}
+
+static void normal_first_line(EditorState* state, long count) {
+    motion_goto_line(state, count_or_one(count));
+}
+
+static void normal_insert(EditorState* state, long count) {
+    state->mode = 1;  // Enter insert mode
+}
+
+static void normal_command(EditorState* state, long count) {
+    state->mode = 2;  // Enter command mode
+    state->prompt = ':';
+    state->command[0] = '\0';
+}
+
+static void normal_search(EditorState* state, long count) {
+    search_begin(state, '/');  // Search down
+}
+
+static void normal_search_back(EditorState* state, long count) {
+    search_begin(state, '?');  // Search up
+}
+
+static void normal_next(EditorState* state, long count) {
+    search_next(state, 0);  // Repeat search
+}
+
+static void normal_prev(EditorState* state, long count) {
+    search_next(state, 1);  // Repeat search the other way
+}
+
+static void normal_delete(EditorState* state, long count) {
+    delete_char(state);  // Delete character
+}
+
+static void normal_undo(EditorState* state, long count) {
+    undo_edit(state);  // Undo last change
+}
+
+static void normal_redo(EditorState* state, long count) {
+    redo_edit(state);  // Redo last undone change
+}
+
+// Arrow keys stand for h, j, k and l, and Ctrl with a letter for its
+// control character
+static const struct {
+    const char* keys;
+    NormalFn run;
+} normal_table[] = {
+    { "h", normal_left },
+    { "j", normal_down },
+    { "k", normal_up },
+    { "l", normal_right },
+    { "0", normal_line_start },
+    { "$", normal_line_end },
+    { "w", normal_word },
+    { "b", normal_word_back },
+    { "e", normal_word_end },
+    { "G", normal_last_line },
+    { "gg", normal_first_line },
+    { "i", normal_insert },
+    { ":", normal_command },
+    { "/", normal_search },
+    { "?", normal_search_back },
+    { "n", normal_next },
+    { "N", normal_prev },
+    { "x", normal_delete },
+    { "u", normal_undo },
+    { "\x12", normal_redo }
+};
+
+#define NORMAL_TABLE_SIZE (sizeof(normal_table) / sizeof(normal_table[0]))
+
+/**
+ * Forget a partly typed count or key sequence
+ */
+static void normal_reset(void) {
+    normal_count = 0;
+    normal_len = 0;
 }
 
 /**
- * Main input handling function - processes all user input events
+ * Add a key to the normal-mode command being typed, and run the command
+ * once it is complete
  * @param state Editor state structure
+ * @param key Key event
  */
-void handle_input(EditorState* state) {
-    INPUT_RECORD inputRecord;
-    DWORD eventsRead;
-    KEY_EVENT_RECORD keyEvent;
-    DWORD waitResult;
-
-    // Wait indefinitely for input event
-    waitResult = WaitForSingleObject(hStdIn, INFINITE);
-    if (waitResult != WAIT_OBJECT_0) {
-        return;
+static void normal_key(EditorState* state, const KeyEvent* key) {
+    char c;
+    switch (key->key) {
+        case KEY_CHAR: c = key->ch; break;
+        case KEY_UP: c = 'k'; break;
+        case KEY_DOWN: c = 'j'; break;
+        case KEY_LEFT: c = 'h'; break;
+        case KEY_RIGHT: c = 'l'; break;
+        case KEY_CTRL: c = (char)(key->ch - 'a' + 1); break;
+        default: return;
     }
 
-    // Read input event from console
-    if (!ReadConsoleInput(hStdIn, &inputRecord, 1, &eventsRead) || eventsRead == 0) {
-        fprintf(stderr, "Input read error: %lu\n", GetLastError());
+    // Digits make up the count; 0 only after another digit
+    if (normal_len == 0 && c >= '0' && c <= '9' && (c != '0' || normal_count > 0)) {
+        normal_count = normal_count * 10 + (c - '0');
+        if (normal_count > NORMAL_COUNT_MAX) normal_count = NORMAL_COUNT_MAX;
         return;
     }
 
-    // Process only key down events
-    if (inputRecord.EventType != KEY_EVENT || !inputRecord.Event.KeyEvent.bKeyDown) {
-        return;
+    normal_keys[normal_len++] = c;
+    int prefix = 0;
+    for (size_t i = 0; i < NORMAL_TABLE_SIZE; i++) {
+        const char* keys = normal_table[i].keys;
+        if (strncmp(keys, normal_keys, normal_len) != 0) continue;
+        if (keys[normal_len] == '\0') {
+            long count = normal_count;
+            normal_reset();
+            normal_table[i].run(state, count);
+            return;
+        }
+        prefix = 1;
     }
 
-    keyEvent = inputRecord.Event.KeyEvent;
+    // Wait for the rest of a sequence; drop keys that start none
+    if (!prefix || normal_len == NORMAL_KEYS_MAX) normal_reset();
+}
+
+/**
+ * Queue text for insertion at the cursor. Line breaks are normalized to
+ * '\n': terminals send Enter and pasted newlines as '\r' or "\r\n".
+ * @param text Text to append
+ * @param length Number of bytes in text
+ */
+static void batch_append(const char* text, size_t length) {
+    if (batch_len + length > batch_cap) {
+        size_t cap = batch_cap ? batch_cap * 2 : 4096;
+        while (cap < batch_len + length) cap *= 2;
+        char* grown = realloc(batch, cap);
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed in batch_append\n");
+            return;
+        }
+        batch = grown;
+        batch_cap = cap;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        if (c == '\n' && batch_cr) {
+            batch_cr = 0;
+            continue;
+        }
+        batch_cr = c == '\r';
+        batch[batch_len++] = batch_cr ? '\n' : c;
+    }
+}
+
+/**
+ * Insert the queued text as a single edit
+ * @param state Editor state structure
+ */
+static void flush_batch(EditorState* state) {
+    if (batch_len > 0) insert_text(state, batch, batch_len);
+    batch_len = 0;
+    batch_cr = 0;
+}
 
-    // Debug: Uncomment to show key codes
-    // printf("Key: %c (VK: %d)\n", keyEvent.uChar.AsciiChar, keyEvent.wVirtualKeyCode);
+/**
+ * Whether a key only adds text at the cursor and can join the batch
+ * @param state Editor state structure
+ * @param key Key event
+ */
+static int is_text_key(EditorState* state, const KeyEvent* key) {
+    if (key->key == KEY_PASTE) return state->mode != 2;
+    return state->mode == 1 && (key->key == KEY_CHAR || key->key == KEY_ENTER);
+}
 
+/**
+ * Apply one key event to the editor
+ * @param state Editor state structure
+ * @param key Key event
+ */
+static void handle_key(EditorState* state, const KeyEvent* key) {
     // Handle welcome screen - any key enters editor
     if (state->welcome_screen) {
         free_lines(state);
-        state->num_lines = 1;
-        state->lines = malloc(sizeof(Line));
-        state->lines[0].data = calloc(1, 1);
-        state->lines[0].length = 0;
         state->welcome_screen = 0;
         state->cursor_row = 0;
         state->cursor_col = 0;
         return;
     }
 
+    // Typing and pasting only queue text; anything else sees it in place
+    if (is_text_key(state, key)) {
+        if (key->key == KEY_PASTE) batch_append(key->text, key->length);
+        else if (key->key == KEY_ENTER) batch_append("\n", 1);
+        else batch_append(&key->ch, 1);
+        return;
+    }
+    flush_batch(state);
+
+    // An insert session, backspaces included, is one undo unit
+    if (state->mode != 1 || key->key != KEY_BACKSPACE) undo_break(state->undo);
+
     // Escape key returns to normal mode from any state
-    if (keyEvent.wVirtualKeyCode == VK_ESCAPE) {
+    if (key->key == KEY_ESCAPE) {
+        normal_reset();
+        if (state->mode == 2 && state->prompt != ':') {
+            search_cancel(state);
+            return;
+        }
         state->mode = 0;
         state->command[0] = '\0';
         return;
     }
 
+    char c = key->key == KEY_CHAR ? key->ch : 0;
+
     // Process input based on current editor mode
     switch (state->mode) {
         case 0:  // Normal mode
-            if (keyEvent.wVirtualKeyCode == VK_UP || keyEvent.uChar.AsciiChar == 'k') {
-                move_cursor_up(state);
-            } else if (keyEvent.wVirtualKeyCode == VK_DOWN || keyEvent.uChar.AsciiChar == 'j') {
-                move_cursor_down(state);
-            } else if (keyEvent.wVirtualKeyCode == VK_LEFT || keyEvent.uChar.AsciiChar == 'h') {
-                move_cursor_left(state);
-            } else if (keyEvent.wVirtualKeyCode == VK_RIGHT || keyEvent.uChar.AsciiChar == 'l') {
-                move_cursor_right(state);
-            } else if (keyEvent.uChar.AsciiChar == 'i') {
-                state->mode = 1;  // Enter insert mode
-            } else if (keyEvent.uChar.AsciiChar == ':') {
-                state->mode = 2;  // Enter command mode
-                state->command[0] = '\0';
-            } else if (keyEvent.uChar.AsciiChar == 'x') {
-                delete_char(state);  // Delete character
-            }
+            normal_key(state, key);  // Counts and key sequences, see normal_table
             break;
             
         case 1:  // Insert mode
-            if (keyEvent.wVirtualKeyCode == VK_BACK) {
+            if (key->key == KEY_BACKSPACE) {
                 delete_char(state);  // Backspace
-            } else if (keyEvent.wVirtualKeyCode == VK_RETURN) {
-                insert_newline(state);  // Enter key
-            } else if (keyEvent.uChar.AsciiChar >= 32 && keyEvent.uChar.AsciiChar <= 126) {
-                insert_char(state, keyEvent.uChar.AsciiChar);  // Printable characters
             }
             break;
             
         case 2:  // Command mode
-            if (keyEvent.wVirtualKeyCode == VK_BACK) {
+            if (key->key == KEY_BACKSPACE) {
                 // Handle backspace in command
                 size_t cmdLen = strlen(state->command);
                 if (cmdLen > 0) state->command[cmdLen - 1] = '\0';
-            } else if (keyEvent.wVirtualKeyCode == VK_RETURN) {
-                // Execute command
-                if (process_command(state, state->command)) {
-                    cleanup_screen();
-                    free_lines(state);
-                    if (state->filename) free(state->filename);
-                    restore_input_mode();
-                    exit(0);
+            } else if (key->key == KEY_ENTER) {
+                // Execute command or search
+                if (state->prompt != ':') {
+                    search_finish(state);
+                } else if (process_command(state, state->command)) {
+                    state->quit = 1;
                 }
-            } else if (keyEvent.uChar.AsciiChar >= 32 && keyEvent.uChar.AsciiChar <= 126) {
-                // Add character to command buffer
+                break;
+            } else if (c || key->key == KEY_PASTE) {
+                // Add printable characters to command buffer
+                const char* text = key->key == KEY_PASTE ? key->text : &c;
+                size_t length = key->key == KEY_PASTE ? key->length : 1;
                 size_t cmdLen = strlen(state->command);
-                if (cmdLen < 255) {
-                    state->command[cmdLen] = keyEvent.uChar.AsciiChar;
-                    state->command[cmdLen + 1] = '\0';
+                for (size_t i = 0; i < length && cmdLen < 255; i++) {
+                    if (text[i] >= 32 && text[i] <= 126) state->command[cmdLen++] = text[i];
                 }
+                state->command[cmdLen] = '\0';
             }
+            if (state->prompt != ':') search_update(state);  // Follow the pattern
             break;
     }
 }
+
+/**
+ * Main input handling function - waits for input, then handles every
+ * event already queued so a burst of keys or a paste costs one render
+ * @param state Editor state structure
+ */
+void handle_input(EditorState* state) {
+    KeyEvent key;
+
+    // Wait for a key; wake up periodically while there is background work,
+    // so the screen can follow its progress
+    int timeout = editor_busy(state) ? 50 : -1;
+    if (screen_read_key(&key, timeout) <= 0) {
+        return;
+    }
+
+    // A status message lasts until the next key
+    state->message[0] = '\0';
+
+    int events = 0;
+    do {
+        handle_key(state, &key);
+    } while (!state->quit && ++events < INPUT_BATCH_MAX && screen_read_key(&key, 0) > 0);
+
+    flush_batch(state);
+}
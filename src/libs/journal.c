@@ -0,0 +1,430 @@
+#include <journal.h>
+#include <clock.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// File layout: a header, then batches. A batch is its payload length and
+// checksum (two uint32_t) followed by records, each a kind byte and varint
+// fields:
+//
+//   JOURNAL_INSERT  offset length bytes
+//   JOURNAL_DELETE  offset length
+//   JOURNAL_ADOPT   offset length file_offset
+//
+// Integers are stored in the byte order of the machine that wrote them; a
+// journal is read back where it was written.
+
+enum {
+    JOURNAL_INSERT = 1,
+    JOURNAL_DELETE,
+    JOURNAL_ADOPT
+};
+
+static const char journal_magic[8] = { 'T', 'V', 'I', 'S', 'W', 'A', 'P', '1' };
+
+typedef struct {
+    char magic[8];
+    uint64_t base_size;
+    int64_t base_mtime;
+} JournalHeader;
+
+#define FRAME_SIZE (2 * sizeof(uint32_t))
+
+struct Journal {
+    FILE* file;
+    char* path;
+    size_t end;           // Bytes written to the file
+    char* batch;          // Frame space, then records not yet written
+    size_t used;          // Bytes in batch, including the frame
+    size_t capacity;
+    size_t ops;           // Edits in the batch
+    double first;         // When the first of them was recorded
+    int run_open;         // Typing not yet turned into a record
+    size_t run_offset;    // Where it starts
+    char* run;            // What it inserted
+    size_t run_length;
+    size_t run_capacity;
+};
+
+// FNV-1a, enough to tell a torn batch from a whole one
+static uint32_t checksum(const char* data, size_t length) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int grow(char** data, size_t* capacity, size_t need) {
+    if (need <= *capacity) return 1;
+    size_t cap = *capacity ? *capacity * 2 : 4096;
+    while (cap < need) cap *= 2;
+    char* grown = realloc(*data, cap);
+    if (!grown) return 0;
+    *data = grown;
+    *capacity = cap;
+    return 1;
+}
+
+static int put_varint(Journal* j, uint64_t v) {
+    if (!grow(&j->batch, &j->capacity, j->used + 10)) return 0;
+    while (v >= 0x80) {
+        j->batch[j->used++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    j->batch[j->used++] = (char)v;
+    return 1;
+}
+
+// Read a varint from [*p, end); returns 0 if it runs past end
+static int get_varint(const char** p, const char* end, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char c = (unsigned char)*(*p)++;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 1;
+    }
+    return 0;
+}
+
+static int put_record(Journal* j, int kind, size_t offset, size_t length) {
+    if (!grow(&j->batch, &j->capacity, j->used + 1)) return 0;
+    j->batch[j->used++] = (char)kind;
+    return put_varint(j, offset) && put_varint(j, length);
+}
+
+// Turn pending typing into an insert record
+static int close_run(Journal* j) {
+    if (!j->run_open) return 1;
+    j->run_open = 0;
+    if (j->run_length == 0) return 1;
+    if (!put_record(j, JOURNAL_INSERT, j->run_offset, j->run_length) ||
+        !grow(&j->batch, &j->capacity, j->used + j->run_length)) return 0;
+    memcpy(j->batch + j->used, j->run, j->run_length);
+    j->used += j->run_length;
+    return 1;
+}
+
+static int write_all(FILE* file, const void* data, size_t length) {
+    return fwrite(data, 1, length, file) == length && fflush(file) == 0;
+}
+
+int journal_flush(Journal* j) {
+    if (!close_run(j)) return 0;
+    if (j->used == FRAME_SIZE) return 1;
+
+    uint32_t frame[2];
+    frame[0] = (uint32_t)(j->used - FRAME_SIZE);
+    frame[1] = checksum(j->batch + FRAME_SIZE, j->used - FRAME_SIZE);
+    memcpy(j->batch, frame, FRAME_SIZE);
+    int ok = write_all(j->file, j->batch, j->used);
+    if (ok) j->end += j->used;
+    j->used = FRAME_SIZE;
+    j->ops = 0;
+    return ok;
+}
+
+// Count an edit, writing the batch once it is full
+static int counted(Journal* j) {
+    if (j->ops++ == 0) j->first = clock_ms();
+    size_t bytes = j->used + (j->run_open ? j->run_length : 0);
+    if (j->ops >= JOURNAL_GROUP_OPS || bytes >= JOURNAL_GROUP_BYTES) return journal_flush(j);
+    return 1;
+}
+
+static Journal* journal_new(const char* path) {
+    Journal* j = calloc(1, sizeof(Journal));
+    if (j) j->path = malloc(strlen(path) + 1);
+    if (j && j->path && grow(&j->batch, &j->capacity, FRAME_SIZE)) {
+        strcpy(j->path, path);
+        j->used = FRAME_SIZE;
+        return j;
+    }
+    if (j) {
+        free(j->path);
+        free(j);
+    }
+    return NULL;
+}
+
+// Create path for writing, failing if it exists. A journal holds the text
+// being edited, so only the user may read it.
+static FILE* create_private(const char* path) {
+#ifdef _WIN32
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+    FILE* file = fd >= 0 ? _fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !file) _close(fd);
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !file) close(fd);
+#endif
+    return file;
+}
+
+static void journal_release(Journal* j) {
+    if (j->file) fclose(j->file);
+    free(j->path);
+    free(j->batch);
+    free(j->run);
+    free(j);
+}
+
+Journal* journal_create(const char* path, JournalBase base) {
+    Journal* j = journal_new(path);
+    if (!j) return NULL;
+
+    j->file = create_private(path);
+    JournalHeader h;
+    memcpy(h.magic, journal_magic, sizeof(h.magic));
+    h.base_size = base.size;
+    h.base_mtime = base.mtime;
+    if (!j->file || !write_all(j->file, &h, sizeof(h))) {
+        int error = errno;
+        if (j->file) remove(path);
+        journal_release(j);
+        errno = error;
+        return NULL;
+    }
+    j->end = sizeof(h);
+    return j;
+}
+
+void journal_close(Journal* j, int remove_file) {
+    if (!j) return;
+    if (!remove_file && j->file) journal_flush(j);
+    if (j->file) fclose(j->file);
+    j->file = NULL;
+    if (remove_file) remove(j->path);
+    journal_release(j);
+}
+
+int journal_insert(Journal* j, size_t offset, const char* text, size_t length) {
+    if (length == 0) return 1;
+
+    // Typing on where the last insert ended extends it
+    if (!j->run_open || offset != j->run_offset + j->run_length) {
+        if (!close_run(j)) return 0;
+        j->run_open = 1;
+        j->run_offset = offset;
+        j->run_length = 0;
+    }
+    if (!grow(&j->run, &j->run_capacity, j->run_length + length)) return 0;
+    memcpy(j->run + j->run_length, text, length);
+    j->run_length += length;
+    return counted(j);
+}
+
+int journal_delete(Journal* j, size_t offset, size_t length) {
+    if (length == 0) return 1;
+
+    // Backspacing over just-typed text shortens it instead
+    if (j->run_open && length <= j->run_length &&
+        offset + length == j->run_offset + j->run_length) {
+        j->run_length -= length;
+        return counted(j);
+    }
+    if (!close_run(j) || !put_record(j, JOURNAL_DELETE, offset, length)) return 0;
+    return counted(j);
+}
+
+int journal_adopt(Journal* j, size_t offset, size_t file_offset, size_t length) {
+    if (length == 0) return 1;
+    if (!close_run(j) || !put_record(j, JOURNAL_ADOPT, offset, length) ||
+        !put_varint(j, file_offset)) return 0;
+    return counted(j);
+}
+
+int journal_poll(Journal* j) {
+    if (j->ops == 0 || clock_ms() - j->first < JOURNAL_GROUP_MS) return 1;
+    return journal_flush(j);
+}
+
+int journal_pending(Journal* j) {
+    return j->ops > 0;
+}
+
+size_t journal_mark(Journal* j) {
+    journal_flush(j);
+    return j->end;
+}
+
+// Replace the journal's file with header h and body, then append to it
+static int rewrite(Journal* j, const JournalHeader* h, const char* body, size_t length) {
+    size_t size = strlen(j->path) + 5;
+    char* temp = malloc(size);
+    if (!temp) return 0;
+    snprintf(temp, size, "%s.new", j->path);
+
+    remove(temp); // Left by a rewrite that was cut short
+    FILE* file = create_private(temp);
+    int ok = file && write_all(file, h, sizeof(*h)) && (length == 0 || write_all(file, body, length));
+    if (file && fclose(file) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(j->path); // rename does not replace on Windows
+#endif
+    if (ok) ok = rename(temp, j->path) == 0;
+    if (!ok) remove(temp);
+    free(temp);
+    if (!ok) return 0;
+
+    if (j->file) fclose(j->file);
+    j->file = fopen(j->path, "ab");
+    j->end = sizeof(*h) + length;
+    return j->file != NULL;
+}
+
+static int seek_to(FILE* file, size_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+// Read the journal's file from offset to its end
+static char* read_from(const char* path, size_t offset, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    char* data = NULL;
+    size_t used = 0, capacity = 0;
+    if (seek_to(file, offset) == 0) {
+        for (;;) {
+            if (!grow(&data, &capacity, used + 65536)) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            size_t n = fread(data + used, 1, capacity - used, file);
+            used += n;
+            if (n == 0) break;
+        }
+    }
+    fclose(file);
+    *length = used;
+    return data;
+}
+
+int journal_rebase(Journal* j, size_t mark, JournalBase base) {
+    if (!journal_flush(j)) return 0;
+
+    size_t length = 0;
+    char* tail = mark < j->end ? read_from(j->path, mark, &length) : NULL;
+    if (mark < j->end && !tail) return 0;
+
+    JournalHeader h;
+    memcpy(h.magic, journal_magic, sizeof(h.magic));
+    h.base_size = base.size;
+    h.base_mtime = base.mtime;
+    int ok = rewrite(j, &h, tail, length);
+    free(tail);
+    return ok;
+}
+
+// Insert bytes [file_offset, file_offset + length) of source at offset
+static int adopt(TextBuffer* buf, FILE* source, size_t offset, size_t file_offset, size_t length) {
+    char chunk[65536];
+    if (!source || seek_to(source, file_offset) != 0) return 0;
+    while (length > 0) {
+        size_t want = length < sizeof(chunk) ? length : sizeof(chunk);
+        if (fread(chunk, 1, want, source) != want) return 0;
+        if (!text_insert(buf, offset, chunk, want)) return 0;
+        offset += want;
+        length -= want;
+    }
+    return 1;
+}
+
+// Apply the records of one batch; returns 0 if one is malformed or fails
+static int replay(TextBuffer* buf, FILE* source, const char* p, const char* end, size_t* edits) {
+    while (p < end) {
+        int kind = (unsigned char)*p++;
+        uint64_t offset, length, file_offset;
+        if (!get_varint(&p, end, &offset) || !get_varint(&p, end, &length)) return 0;
+        if (offset > text_size(buf)) return 0;
+
+        int ok;
+        if (kind == JOURNAL_INSERT) {
+            if (length > (uint64_t)(end - p)) return 0;
+            ok = text_insert(buf, offset, p, length);
+            p += length;
+        } else if (kind == JOURNAL_DELETE) {
+            ok = text_delete(buf, offset, length);
+        } else if (kind == JOURNAL_ADOPT) {
+            ok = get_varint(&p, end, &file_offset) &&
+                 adopt(buf, source, offset, file_offset, length);
+        } else {
+            ok = 0;
+        }
+        if (!ok) return 0;
+        (*edits)++;
+    }
+    return 1;
+}
+
+int journal_base(const char* path, JournalBase* base) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    JournalHeader h;
+    int ok = fread(&h, 1, sizeof(h), file) == sizeof(h) &&
+             memcmp(h.magic, journal_magic, sizeof(journal_magic)) == 0;
+    fclose(file);
+    if (ok) {
+        base->size = (size_t)h.base_size;
+        base->mtime = h.base_mtime;
+    }
+    return ok;
+}
+
+Journal* journal_recover(const char* path, const char* filename, TextBuffer* buf,
+                         JournalBase* base, size_t* edits) {
+    *edits = 0;
+    size_t length;
+    char* data = read_from(path, 0, &length);
+    JournalHeader h;
+    if (!data || length < sizeof(h) || memcmp(data, journal_magic, sizeof(journal_magic)) != 0) {
+        free(data);
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(&h, data, sizeof(h));
+    base->size = (size_t)h.base_size;
+    base->mtime = h.base_mtime;
+
+    // Whole batches only: a torn one at the end ends the journal
+    FILE* source = fopen(filename, "rb");
+    size_t at = sizeof(h);
+    int ok = 1;
+    while (ok && length - at >= FRAME_SIZE) {
+        uint32_t frame[2];
+        memcpy(frame, data + at, FRAME_SIZE);
+        if (frame[0] > length - at - FRAME_SIZE ||
+            checksum(data + at + FRAME_SIZE, frame[0]) != frame[1]) break;
+        const char* p = data + at + FRAME_SIZE;
+        ok = replay(buf, source, p, p + frame[0], edits);
+        at += FRAME_SIZE + frame[0];
+    }
+    if (source) fclose(source);
+
+    Journal* j = ok ? journal_new(path) : NULL;
+    if (j && !rewrite(j, &h, data + sizeof(h), at - sizeof(h))) {
+        journal_release(j);
+        j = NULL;
+    }
+    free(data);
+    if (!ok) errno = EINVAL;
+    return j;
+}
@@ -0,0 +1,121 @@
+#include <lz.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 14
+
+size_t lz_bound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+static uint32_t read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write the part of a count that does not fit its nibble
+static char* put_length(char* out, size_t n) {
+    while (n >= 255) {
+        *out++ = (char)255;
+        n -= 255;
+    }
+    *out++ = (char)n;
+    return out;
+}
+
+static char* put_sequence(char* out, const char* literals, size_t literal_len,
+                          size_t offset, size_t match_len) {
+    size_t m = match_len ? match_len - MIN_MATCH : 0;
+    *out++ = (char)(((literal_len < 15 ? literal_len : 15) << 4) | (m < 15 ? m : 15));
+    if (literal_len >= 15) out = put_length(out, literal_len - 15);
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+    if (!match_len) return out;
+
+    *out++ = (char)(offset & 0xFF);
+    *out++ = (char)(offset >> 8);
+    if (m >= 15) out = put_length(out, m - 15);
+    return out;
+}
+
+size_t lz_compress(const char* src, size_t length, char* dst) {
+    // Positions + 1 of the last occurrence of each hashed 4-byte sequence
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    char* out = dst;
+    size_t anchor = 0;    // Start of the pending literals
+    size_t i = 0;
+    while (length >= MIN_MATCH && i <= length - MIN_MATCH) {
+        uint32_t v = read32(src + i);
+        uint32_t h = hash4(v);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)(i + 1);
+        if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET || read32(src + candidate - 1) != v) {
+            i++;
+            continue;
+        }
+
+        size_t from = candidate - 1;
+        size_t match = MIN_MATCH;
+        while (i + match < length && src[from + match] == src[i + match]) match++;
+        out = put_sequence(out, src + anchor, i - anchor, i - from, match);
+        i += match;
+        anchor = i;
+    }
+    out = put_sequence(out, src + anchor, length - anchor, 0, 0);
+    return (size_t)(out - dst);
+}
+
+// Read the rest of a count whose nibble was 15
+static int get_length(const unsigned char** in, const unsigned char* end, size_t* n) {
+    unsigned char b;
+    do {
+        if (*in >= end) return 0;
+        b = *(*in)++;
+        *n += b;
+    } while (b == 255);
+    return 1;
+}
+
+int lz_decompress(const char* src, size_t packed, char* dst, size_t length) {
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* end = in + packed;
+    size_t out = 0;
+
+    while (in < end) {
+        unsigned token = *in++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(&in, end, &literal_len)) return 0;
+        if (literal_len > (size_t)(end - in) || literal_len > length - out) return 0;
+        memcpy(dst + out, in, literal_len);
+        in += literal_len;
+        out += literal_len;
+        if (in == end) break;
+
+        if (end - in < 2) return 0;
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(&in, end, &match)) return 0;
+        match += MIN_MATCH;
+        if (offset == 0 || offset > out || match > length - out) return 0;
+
+        // Copies may overlap their own output
+        const char* from = dst + out - offset;
+        if (offset >= match) {
+            memcpy(dst + out, from, match);
+        } else {
+            for (size_t k = 0; k < match; k++) dst[out + k] = from[k];
+        }
+        out += match;
+    }
+    return out == length;
+}
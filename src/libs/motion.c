@@ -0,0 +1,203 @@
+#include <tvi.h>
+#include <ctype.h>
+
+// Cursor motions with a count. Each one works out its target at once
+// rather than taking count single steps: line motions and jumps go
+// straight to the row through the line index, character motions do
+// arithmetic on the document offset, and word motions make one pass over
+// the bytes between the cursor and the target.
+
+// Bytes read at a time by the word motions
+#define MOTION_WINDOW 4096
+
+// The cursor row, clamped to the document
+static size_t cursor_row(EditorState* state) {
+    size_t rows = text_line_count(state->text);
+    return (size_t)state->cursor_row < rows ? (size_t)state->cursor_row : rows - 1;
+}
+
+// Move the cursor to a document offset
+static void cursor_to(EditorState* state, size_t offset) {
+    size_t row, col;
+    text_position(state->text, offset, &row, &col);
+    state->cursor_row = (int)row;
+    state->cursor_col = (int)col;
+}
+
+// Column after the last character of row: its length, less a '\r' that
+// ends it. Files saved on Windows end their lines in "\r\n"; the '\r' is
+// kept in the text, so that they are saved as they were, but the cursor
+// does not go onto it.
+int line_end_col(EditorState* state, size_t row) {
+    size_t length = text_line_length(state->text, row);
+    char c = 0;
+    if (length > 0 && text_get_line(state->text, row, length - 1, &c, 1) == 1 && c == '\r') length--;
+    return (int)length;
+}
+
+// Keep the column within the cursor's line
+static void clamp_col(EditorState* state) {
+    int length = line_end_col(state, state->cursor_row);
+    if (state->cursor_col > length) state->cursor_col = length;
+}
+
+// j and k: count lines down (count > 0) or up, stopping at either end
+void motion_lines(EditorState* state, long count) {
+    if (state->welcome_screen) return;
+    size_t row = cursor_row(state);
+    size_t last = text_line_count(state->text) - 1;
+    if (count < 0) row = (size_t)-count < row ? row + count : 0;
+    else row = (size_t)count < last - row ? row + count : last;
+    state->cursor_row = (int)row;
+    clamp_col(state);
+}
+
+// h and l: count characters left (count < 0) or right. A line break is one
+// step, so moving off either end of a line wraps to the next one; the '\r'
+// of a "\r\n" is stepped over with its '\n'.
+void motion_chars(EditorState* state, long count) {
+    if (state->welcome_screen) return;
+    size_t offset = text_offset(state->text, cursor_row(state), state->cursor_col);
+    size_t size = text_size(state->text);
+    if (count < 0) offset = (size_t)-count < offset ? offset + count : 0;
+    else offset = (size_t)count < size - offset ? offset + count : size;
+
+    // Between the '\r' and the '\n', or after the '\r' that ends the last line
+    char pair[2] = { 0, '\n' };
+    size_t n = offset > 0 ? text_read(state->text, offset - 1, pair, 2) : 0;
+    if (n > 0 && pair[0] == '\r' && pair[1] == '\n') {
+        offset = count > 0 && n == 2 ? offset + 1 : offset - 1;
+    }
+    cursor_to(state, offset);
+}
+
+// Column of the first non-blank byte of row, or 0 if there is none
+static int first_non_blank(EditorState* state, size_t row) {
+    size_t length = text_line_length(state->text, row);
+    char window[256];
+    for (size_t col = 0; col < length; col += sizeof(window)) {
+        size_t n = text_get_line(state->text, row, col, window, sizeof(window));
+        for (size_t i = 0; i < n; i++) {
+            if (window[i] != ' ' && window[i] != '\t') return (int)(col + i);
+        }
+        if (n == 0) break;
+    }
+    return 0;
+}
+
+// G, gg and :N: go to line (1-based, clamped to the document) on its first
+// non-blank character
+void motion_goto_line(EditorState* state, size_t line) {
+    if (state->welcome_screen) return;
+    size_t rows = text_line_count(state->text);
+    size_t row = line == 0 ? 0 : line > rows ? rows - 1 : line - 1;
+    state->cursor_row = (int)row;
+    state->cursor_col = first_non_blank(state, row);
+}
+
+// 0 and $: the start of the cursor's line, or the end of the line count - 1
+// lines below it
+void motion_line_start(EditorState* state) {
+    if (state->welcome_screen) return;
+    state->cursor_col = 0;
+}
+
+void motion_line_end(EditorState* state, long count) {
+    if (state->welcome_screen) return;
+    if (count > 1) motion_lines(state, count - 1);
+    state->cursor_col = line_end_col(state, cursor_row(state));
+}
+
+// ---------------------------------------------------------------------------
+// Word motions. A word is a run of letters, digits and underscores, or a
+// run of other non-blank characters; an empty line also counts as one for
+// w and b.
+
+typedef struct {
+    TextBuffer* text;
+    size_t size;
+    size_t start;         // Document offset of window[0]
+    size_t length;        // Bytes in window
+    char window[MOTION_WINDOW];
+} WordReader;
+
+// The byte at offset, refilling the window around it when it falls outside;
+// the window is placed so that walking in either direction stays inside it
+static char byte_at(WordReader* r, size_t offset) {
+    if (offset < r->start || offset >= r->start + r->length) {
+        size_t from = offset < r->start && offset >= MOTION_WINDOW - 1 ? offset - (MOTION_WINDOW - 1)
+                    : offset < r->start ? 0 : offset;
+        r->start = from;
+        r->length = text_read(r->text, from, r->window, MOTION_WINDOW);
+    }
+    return r->window[offset - r->start];
+}
+
+// 0: blank, 1: word character, 2: other
+static int word_class(WordReader* r, size_t offset) {
+    unsigned char c = (unsigned char)byte_at(r, offset);
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return 0;
+    return isalnum(c) || c == '_' ? 1 : 2;
+}
+
+// offset is the start of an empty line
+static int empty_line(WordReader* r, size_t offset) {
+    return byte_at(r, offset) == '\n' && (offset == 0 || byte_at(r, offset - 1) == '\n');
+}
+
+static size_t word_forward(WordReader* r, size_t p, long count) {
+    while (count-- > 0 && p < r->size) {
+        size_t from = p;
+        int c = word_class(r, p);
+        if (c) {
+            while (p < r->size && word_class(r, p) == c) p++;
+        }
+        while (p < r->size && word_class(r, p) == 0 && !(p > from && empty_line(r, p))) p++;
+    }
+    return p;
+}
+
+static size_t word_end(WordReader* r, size_t p, long count) {
+    while (count-- > 0 && p + 1 < r->size) {
+        p++;
+        while (p + 1 < r->size && word_class(r, p) == 0) p++;
+        int c = word_class(r, p);
+        while (p + 1 < r->size && word_class(r, p + 1) == c) p++;
+    }
+    return p;
+}
+
+static size_t word_backward(WordReader* r, size_t p, long count) {
+    while (count-- > 0 && p > 0) {
+        p--;
+        while (p > 0 && word_class(r, p) == 0 && !empty_line(r, p)) p--;
+        int c = word_class(r, p);
+        if (c) {
+            while (p > 0 && word_class(r, p - 1) == c) p--;
+        }
+    }
+    return p;
+}
+
+// w, b and e: count words forward to their starts, back to their starts,
+// or forward to their ends
+void motion_word(EditorState* state, char kind, long count) {
+    if (state->welcome_screen) return;
+    WordReader* r = malloc(sizeof(WordReader));
+    if (!r) {
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in motion_word");
+        return;
+    }
+    r->text = state->text;
+    r->size = text_size(state->text);
+    r->start = 0;
+    r->length = 0;
+
+    size_t p = text_offset(state->text, cursor_row(state), state->cursor_col);
+    if (p > r->size) p = r->size;
+    if (kind == 'w') p = word_forward(r, p, count);
+    else if (kind == 'e') p = word_end(r, p, count);
+    else p = word_backward(r, p, count);
+    free(r);
+    cursor_to(state, p);
+}
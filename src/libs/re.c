@@ -0,0 +1,323 @@
+#include <re.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A pattern compiles to a flat list of atoms, each with a quantifier; x\+
+// becomes x followed by x*. Without groups or alternation, matching is a
+// simple backtracking walk down that list, which is quickest for the
+// patterns people type. Patterns like a*a*a*b can make it take time
+// exponential in the number of stars, so the walk is given a budget of
+// steps; a line that uses it up is searched again without backtracking,
+// keeping every place in the list a match could have reached so far (a
+// Pike VM) in order of preference, so that it finds the same match. That
+// takes time bounded by the line length times the number of atoms.
+
+enum {
+    ATOM_CHAR,
+    ATOM_ANY,
+    ATOM_CLASS
+};
+
+enum {
+    QUANT_ONE,
+    QUANT_STAR,           // *
+    QUANT_QUEST           // \?
+};
+
+typedef struct {
+    unsigned char type;
+    unsigned char quant;
+    unsigned char ch;                 // ATOM_CHAR
+    unsigned char set[32];            // ATOM_CLASS: bit per byte value
+} Atom;
+
+struct Regex {
+    Atom* atoms;
+    int count;
+    int bol;              // Anchored at the start of the line
+    int eol;              // Anchored at the end of the line
+};
+
+#define NO_MATCH ((size_t)-1)
+#define OVER_BUDGET ((size_t)-2)
+
+// Backtracking steps allowed per byte and atom before the Pike VM takes over
+#define RE_STEPS_PER_CELL 4
+
+static void set_add(Atom* a, unsigned char c) {
+    a->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+static unsigned char escaped(char c) {
+    return c == 't' ? '\t' : (unsigned char)c;
+}
+
+// Parse the class starting after '['; returns the position after ']'
+static const char* parse_class(const char* p, Atom* a) {
+    int negate = *p == '^';
+    if (negate) p++;
+
+    // A ']' right after the opening bracket is literal
+    int first = 1;
+    while (*p && (*p != ']' || first)) {
+        unsigned char lo = (unsigned char)*p++;
+        if (lo == '\\' && *p) lo = escaped(*p++);
+        unsigned char hi = lo;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            hi = (unsigned char)p[1];
+            p += 2;
+            if (hi == '\\' && *p) hi = escaped(*p++);
+        }
+        for (unsigned c = lo; c <= hi; c++) set_add(a, (unsigned char)c);
+        first = 0;
+    }
+    if (*p != ']') return NULL;
+
+    if (negate) {
+        for (int i = 0; i < 32; i++) a->set[i] = (unsigned char)~a->set[i];
+    }
+    return p + 1;
+}
+
+Regex* re_compile(const char* pattern, const char** error) {
+    Regex* re = calloc(1, sizeof(Regex));
+    size_t length = strlen(pattern);
+    if (re) re->atoms = calloc(length + 1, sizeof(Atom));
+    if (!re || !re->atoms) {
+        *error = "Out of memory";
+        re_free(re);
+        return NULL;
+    }
+
+    const char* p = pattern;
+    if (*p == '^') {
+        re->bol = 1;
+        p++;
+    }
+    while (*p) {
+        // Quantifiers apply to the atom before them
+        int quant = QUANT_ONE;
+        int plus = p[0] == '\\' && p[1] == '+';
+        if (*p == '*' || plus) quant = QUANT_STAR;
+        else if (p[0] == '\\' && p[1] == '?') quant = QUANT_QUEST;
+        if (quant != QUANT_ONE) {
+            if (re->count == 0 || re->atoms[re->count - 1].quant != QUANT_ONE) {
+                *error = "Nothing to repeat";
+                re_free(re);
+                return NULL;
+            }
+            // One, then any number more; the pattern text has room for both
+            if (plus) {
+                re->atoms[re->count] = re->atoms[re->count - 1];
+                re->count++;
+            }
+            re->atoms[re->count - 1].quant = (unsigned char)quant;
+            p += *p == '*' ? 1 : 2;
+            continue;
+        }
+
+        if (p[0] == '$' && p[1] == '\0') {
+            re->eol = 1;
+            break;
+        }
+
+        Atom* a = &re->atoms[re->count++];
+        if (*p == '.') {
+            a->type = ATOM_ANY;
+            p++;
+        } else if (*p == '[') {
+            a->type = ATOM_CLASS;
+            p = parse_class(p + 1, a);
+            if (!p) {
+                *error = "Missing ]";
+                re_free(re);
+                return NULL;
+            }
+        } else if (*p == '\\') {
+            if (!p[1]) {
+                *error = "Trailing \\";
+                re_free(re);
+                return NULL;
+            }
+            a->type = ATOM_CHAR;
+            a->ch = escaped(p[1]);
+            p += 2;
+        } else {
+            a->type = ATOM_CHAR;
+            a->ch = (unsigned char)*p++;
+        }
+    }
+    return re;
+}
+
+void re_free(Regex* re) {
+    if (!re) return;
+    free(re->atoms);
+    free(re);
+}
+
+static int atom_matches(const Atom* a, unsigned char c) {
+    switch (a->type) {
+        case ATOM_CHAR: return c == a->ch;
+        case ATOM_ANY: return 1;
+        default: return (a->set[c >> 3] >> (c & 7)) & 1;
+    }
+}
+
+// Match atoms[i..] at line[pos]; returns the end of the match, NO_MATCH,
+// or OVER_BUDGET once *steps runs out
+static size_t match_here(const Regex* re, int i, const char* line, size_t length, size_t pos,
+                         size_t* steps) {
+    for (; i < re->count; i++) {
+        if ((*steps)-- == 0) return OVER_BUDGET;
+        const Atom* a = &re->atoms[i];
+        if (a->quant == QUANT_ONE) {
+            if (pos >= length || !atom_matches(a, (unsigned char)line[pos])) return NO_MATCH;
+            pos++;
+            continue;
+        }
+
+        // Take as many as possible, then give them back one at a time
+        size_t max = a->quant == QUANT_QUEST ? 1 : length - pos;
+        size_t n = 0;
+        while (n < max && pos + n < length && atom_matches(a, (unsigned char)line[pos + n])) n++;
+        for (;;) {
+            size_t end = match_here(re, i + 1, line, length, pos + n, steps);
+            if (end != NO_MATCH) return end;
+            if (n == 0) return NO_MATCH;
+            n--;
+        }
+    }
+    if (re->eol && pos != length) return NO_MATCH;
+    return pos;
+}
+
+// The leftmost match by backtracking; returns -1 if it ran over budget
+static int backtrack_search(const Regex* re, const char* line, size_t length, size_t from,
+                            size_t steps, size_t* start, size_t* end) {
+    if (re->bol) {
+        size_t e = from == 0 ? match_here(re, 0, line, length, 0, &steps) : NO_MATCH;
+        if (e == OVER_BUDGET) return -1;
+        if (e == NO_MATCH) return 0;
+        *start = 0;
+        *end = e;
+        return 1;
+    }
+
+    // A leading literal that must be there: jump between its occurrences
+    const Atom* first = re->count > 0 ? &re->atoms[0] : NULL;
+    int literal = first && first->type == ATOM_CHAR && first->quant == QUANT_ONE;
+
+    for (size_t pos = from; pos <= length; pos++) {
+        if (literal) {
+            if (pos == length) return 0; // An empty rest (line may be NULL)
+            const char* hit = memchr(line + pos, first->ch, length - pos);
+            if (!hit) return 0;
+            pos = hit - line;
+        }
+        size_t e = match_here(re, 0, line, length, pos, &steps);
+        if (e == OVER_BUDGET) return -1;
+        if (e != NO_MATCH) {
+            *start = pos;
+            *end = e;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A thread: a place in the atom list that a match begun at start has
+// reached. State count is past the last atom: a match.
+typedef struct {
+    int state;
+    size_t start;
+} Thread;
+
+// Add the thread at state to list, with the states it reaches without
+// reading a byte after it. A state already in the list is taken by a
+// thread preferred to this one. A quantified atom prefers taking one
+// more byte to moving on, so its thread goes first.
+static void add_thread(const Regex* re, Thread* list, int* n, unsigned char* on,
+                       int state, size_t start) {
+    if (on[state]) return;
+    on[state] = 1;
+    list[(*n)++] = (Thread){ state, start };
+    if (state < re->count && re->atoms[state].quant != QUANT_ONE) {
+        add_thread(re, list, n, on, state + 1, start);
+    }
+}
+
+// The leftmost match found by running every thread at once
+static int pike_search(const Regex* re, const char* line, size_t length, size_t from,
+                       size_t* start, size_t* end) {
+    if (re->bol && from != 0) return 0;
+
+    // A leading literal that must be there: jump between its occurrences
+    const Atom* first = re->count > 0 ? &re->atoms[0] : NULL;
+    int literal = !re->bol && first && first->type == ATOM_CHAR && first->quant == QUANT_ONE;
+
+    int states = re->count + 1;
+    Thread lists[2][states];
+    unsigned char on[states];
+    Thread* current = lists[0];
+    Thread* next = lists[1];
+    int found = 0;
+
+    // Threads at pos, most preferred first; a match begun further left is
+    // preferred, so a new one is added last
+    memset(on, 0, (size_t)states);
+    int n = 0;
+    size_t pos = from;
+    for (;;) {
+        if (!found && (!re->bol || pos == 0)) {
+            if (literal && n == 0) {
+                const char* hit = pos < length ? memchr(line + pos, first->ch, length - pos) : NULL;
+                if (!hit) break;
+                pos = (size_t)(hit - line);
+            }
+            add_thread(re, current, &n, on, 0, pos);
+        }
+        if (n == 0) break;
+
+        // Step every thread over line[pos]. A match ends the threads
+        // less preferred than the one that found it.
+        memset(on, 0, (size_t)states);
+        int next_n = 0;
+        for (int t = 0; t < n; t++) {
+            const Thread* th = &current[t];
+            if (th->state == re->count) {
+                if (re->eol && pos != length) continue;
+                found = 1;
+                *start = th->start;
+                *end = pos;
+                break;
+            }
+            const Atom* a = &re->atoms[th->state];
+            if (pos < length && atom_matches(a, (unsigned char)line[pos])) {
+                add_thread(re, next, &next_n, on, a->quant == QUANT_STAR ? th->state : th->state + 1,
+                           th->start);
+            }
+        }
+        if (pos >= length) break;
+        Thread* swap = current;
+        current = next;
+        next = swap;
+        n = next_n;
+        pos++;
+    }
+    return found;
+}
+
+int re_search(const Regex* re, const char* line, size_t length, size_t from,
+              size_t* start, size_t* end) {
+    size_t steps = RE_STEPS_PER_CELL * (length - from + 1) * (size_t)(re->count + 1);
+    int found = backtrack_search(re, line, length, from, steps, start, end);
+    return found >= 0 ? found : pike_search(re, line, length, from, start, end);
+}
+
+int re_search_with(const Regex* re, int matcher, const char* line, size_t length, size_t from,
+                   size_t* start, size_t* end) {
+    if (matcher == RE_PIKE) return pike_search(re, line, length, from, start, end);
+    return backtrack_search(re, line, length, from, SIZE_MAX, start, end);
+}
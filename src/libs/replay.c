@@ -0,0 +1,210 @@
+#include <tvi.h>
+#include <clock.h>
+#include <ctype.h>
+
+// Headless replay: keys come from a script instead of the terminal and
+// frames go to an in-memory grid. Each key is delivered on its own, after
+// the frame for the previous one, as if typed by hand; the time from key
+// to finished frame is its latency.
+//
+// Script format: every character is a key, except line breaks, which are
+// ignored so scripts can be wrapped. Special keys are written <Esc>, <CR>
+// (or <Enter>), <BS>, <Up>, <Down>, <Left>, <Right>, Ctrl with a letter
+// <C-x>, and '<' itself <lt>.
+//
+// The report's allocation counts stay 0 unless tvi is built with
+// TVI_COUNT_ALLOCS, e.g. make CFLAGS="-O2 -DTVI_COUNT_ALLOCS" (see clock.c).
+
+#define REPLAY_ROWS 24
+#define REPLAY_COLS 80
+
+static KeyEvent* keys;
+static size_t key_count;
+static size_t next_key;
+static long frame_cells;      // Cells changed over all frames
+
+static const struct {
+    const char* name;
+    int key;
+    char ch;
+} key_names[] = {
+    { "esc", KEY_ESCAPE, 0 },
+    { "cr", KEY_ENTER, 0 },
+    { "enter", KEY_ENTER, 0 },
+    { "bs", KEY_BACKSPACE, 0 },
+    { "up", KEY_UP, 0 },
+    { "down", KEY_DOWN, 0 },
+    { "left", KEY_LEFT, 0 },
+    { "right", KEY_RIGHT, 0 },
+    { "lt", KEY_CHAR, '<' }
+};
+
+static int replay_init(void) {
+    return 1;
+}
+
+static void replay_cleanup(void) {
+    free(keys);
+    keys = NULL;
+    key_count = next_key = 0;
+}
+
+static int replay_get_size(int* rows, int* cols) {
+    *rows = REPLAY_ROWS;
+    *cols = REPLAY_COLS;
+    return 1;
+}
+
+static void replay_flush(const Cell* back, Cell* front, int rows, int cols,
+                         int cursor_row, int cursor_col, FlushStats* stats) {
+    (void)cursor_row;
+    (void)cursor_col;
+    stats->cells = 0;
+    for (int i = 0; i < rows * cols; i++) {
+        if (back[i].ch != front[i].ch || back[i].attr != front[i].attr) {
+            front[i] = back[i];
+            stats->cells++;
+        }
+    }
+    stats->bytes = stats->cells * sizeof(Cell);
+    frame_cells += stats->cells;
+}
+
+// One key per call, never more than one per frame
+static int replay_read_key(KeyEvent* event, int timeout_ms) {
+    if (timeout_ms == 0 || next_key >= key_count) return 0;
+    *event = keys[next_key++];
+    return 1;
+}
+
+static const TermBackend replay_term = {
+    "replay",
+    replay_init,
+    replay_cleanup,
+    replay_get_size,
+    replay_flush,
+    replay_read_key
+};
+
+// Decode the special key name at script[0] ('<'); returns its length or 0
+static size_t parse_key_name(const char* script, size_t length, KeyEvent* event) {
+    if (length >= 5 && (script[1] == 'C' || script[1] == 'c') && script[2] == '-' &&
+        isalpha((unsigned char)script[3]) && script[4] == '>') {
+        event->key = KEY_CTRL;
+        event->ch = (char)tolower((unsigned char)script[3]);
+        return 5;
+    }
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        size_t n = strlen(key_names[i].name);
+        if (n + 2 > length || script[n + 1] != '>') continue;
+
+        size_t j = 0;
+        while (j < n && tolower((unsigned char)script[j + 1]) == key_names[i].name[j]) j++;
+        if (j < n) continue;
+
+        event->key = key_names[i].key;
+        event->ch = key_names[i].ch;
+        return n + 2;
+    }
+    return 0;
+}
+
+// Load a key script and make replay the screen backend
+int replay_open(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: cannot open key script %s\n", path);
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* script = malloc(length > 0 ? length : 1);
+    keys = malloc((length > 0 ? length : 1) * sizeof(KeyEvent));
+    if (!script || !keys || fread(script, 1, length, file) != (size_t)length) {
+        fprintf(stderr, "Error: cannot read key script %s\n", path);
+        fclose(file);
+        free(script);
+        free(keys);
+        keys = NULL;
+        return 0;
+    }
+    fclose(file);
+
+    key_count = next_key = 0;
+    for (long i = 0; i < length;) {
+        KeyEvent event = { KEY_CHAR, script[i], NULL, 0 };
+        size_t used = script[i] == '<' ? parse_key_name(script + i, length - i, &event) : 0;
+        if (used == 0) {
+            used = 1;
+            if (script[i] == '\n' || script[i] == '\r') {
+                i++;
+                continue;
+            }
+        }
+        keys[key_count++] = event;
+        i += used;
+    }
+    free(script);
+
+    screen_set_backend(&replay_term);
+    return 1;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Feed the loaded script through the editor, then print a JSON report.
+// Returns the process exit code.
+int replay_run(EditorState* state, double load_ms) {
+    double* latency = malloc((key_count > 0 ? key_count : 1) * sizeof(double));
+    if (!latency) {
+        fprintf(stderr, "Memory allocation failed for replay\n");
+        return 1;
+    }
+
+    double start = clock_ms();
+    refresh_screen(state);
+    double first_frame_ms = clock_ms() - start;
+
+    size_t allocs_before = alloc_count();
+    size_t bytes_before = alloc_bytes();
+    long cells_before = frame_cells;
+    double render_ms = 0;
+    size_t handled = 0;
+
+    // Same steps as the interactive loop in main, timed
+    while (!state->quit && next_key < key_count) {
+        double t0 = clock_ms();
+        handle_input(state);
+        editor_poll(state);
+        double t1 = clock_ms();
+        refresh_screen(state);
+        double t2 = clock_ms();
+
+        latency[handled++] = t2 - t0;
+        render_ms += t2 - t1;
+    }
+    save_wait(state);
+    double total_ms = clock_ms() - start;
+
+    qsort(latency, handled, sizeof(double), compare_double);
+    double p50 = handled ? latency[handled / 2] : 0;
+    double p99 = handled ? latency[handled * 99 / 100] : 0;
+    double max = handled ? latency[handled - 1] : 0;
+
+    printf("{\"keys\": %zu, \"load_ms\": %.3f, \"first_frame_ms\": %.3f, "
+           "\"total_ms\": %.3f, \"render_ms\": %.3f, "
+           "\"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+           "\"cells\": %ld, \"allocs\": %zu, \"alloc_bytes\": %zu, \"peak_rss_kb\": %zu}\n",
+           handled, load_ms, first_frame_ms, total_ms, render_ms,
+           p50 * 1000, p99 * 1000, max * 1000,
+           frame_cells - cells_before, alloc_count() - allocs_before,
+           alloc_bytes() - bytes_before, peak_rss_kb());
+
+    free(latency);
+    return 0;
+}
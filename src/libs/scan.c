@@ -0,0 +1,322 @@
+#include <scan.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SCAN_AVX2
+static int ctz64(uint64_t x) {
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+}
+static int top_bit(uint32_t x) {
+    unsigned long i;
+    _BitScanReverse(&i, x);
+    return (int)i;
+}
+#else
+#define SCAN_AVX2 __attribute__((target("avx2")))
+static int ctz64(uint64_t x) {
+    return __builtin_ctzll(x);
+}
+static int top_bit(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+#endif
+
+// Bytes handled per step of the vector loops
+#define BLOCK 64
+
+static int reserve(size_t** starts, size_t* count, size_t* cap, size_t extra) {
+    if (*count + extra <= *cap) return 1;
+
+    size_t new_cap = *cap ? *cap * 2 : 1024;
+    while (new_cap < *count + extra) new_cap *= 2;
+    size_t* grown = realloc(*starts, new_cap * sizeof(size_t));
+    if (!grown) return 0;
+    *starts = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+// Scalar tail and fallback
+static size_t count_scalar(const char* data, size_t length) {
+    size_t n = 0;
+    const char* end = data + length;
+    while ((data = memchr(data, '\n', end - data)) != NULL) {
+        n++;
+        data++;
+    }
+    return n;
+}
+
+static int index_scalar(const char* data, size_t length, size_t base,
+                        size_t** starts, size_t* count, size_t* cap) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] != '\n') continue;
+        if (!reserve(starts, count, cap, 1)) return 0;
+        (*starts)[(*count)++] = base + i + 1;
+    }
+    return 1;
+}
+
+// Candidates for a match start are data[0, last]; callers guarantee
+// length >= pat_len >= 1
+static size_t find_scalar(const char* data, size_t from, size_t last,
+                        const char* pat, size_t pat_len) {
+    const char* p = data + from;
+    const char* end = data + last + 1;
+    while (p < end && (p = memchr(p, pat[0], end - p)) != NULL) {
+        if (memcmp(p, pat, pat_len) == 0) return (p - data);
+        p++;
+    }
+    return SCAN_NONE;
+}
+
+// Like find_scalar, the last match starting in data[0, end)
+static size_t rfind_scalar(const char* data, size_t end, const char* pat, size_t pat_len) {
+    while (end > 0) {
+        end--;
+        if (data[end] == pat[0] && memcmp(data + end, pat, pat_len) == 0) return end;
+    }
+    return SCAN_NONE;
+}
+
+// Record the newlines flagged in a 64-byte block mask
+static int index_mask(uint64_t mask, size_t at, size_t** starts, size_t* count, size_t* cap) {
+    if (!reserve(starts, count, cap, BLOCK)) return 0;
+    size_t* out = *starts + *count;
+    while (mask) {
+        *out++ = at + ctz64(mask) + 1;
+        mask &= mask - 1;
+    }
+    *count = out - *starts;
+    return 1;
+}
+
+#ifdef SCAN_X86
+
+static int has_avx2(void) {
+#if defined(_MSC_VER)
+    static volatile int cached = -1;
+    if (cached < 0) {
+        int info[4];
+        int avx2 = 0;
+        __cpuid(info, 1);
+        // AVX2 also needs the OS to save YMM state (OSXSAVE + XCR0)
+        if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] >> 5) & 1;
+        }
+        cached = avx2;
+    }
+    return cached;
+#else
+    // libgcc fills in the CPU model before main runs
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static size_t count_sse2(const char* data, size_t length) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t total = 0;
+    size_t i = 0;
+
+    while (i + 16 <= length) {
+        // Byte counters overflow after 255 steps; fold them into total
+        __m128i acc = zero;
+        size_t steps = (length - i) / 16;
+        if (steps > 255) steps = 255;
+        for (size_t s = 0; s < steps; s++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        total += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+    return total + count_scalar(data + i, length - i);
+}
+
+static int index_sse2(const char* data, size_t length, size_t base,
+                      size_t** starts, size_t* count, size_t* cap) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + BLOCK <= length; i += BLOCK) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), nl);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 16)), nl);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 32)), nl);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 48)), nl);
+        if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) continue;
+
+        uint64_t mask = (uint64_t)(unsigned)_mm_movemask_epi8(a) |
+                        (uint64_t)(unsigned)_mm_movemask_epi8(b) << 16 |
+                        (uint64_t)(unsigned)_mm_movemask_epi8(c) << 32 |
+                        (uint64_t)(unsigned)_mm_movemask_epi8(d) << 48;
+        if (!index_mask(mask, base + i, starts, count, cap)) return 0;
+    }
+    return index_scalar(data + i, length - i, base + i, starts, count, cap);
+}
+
+SCAN_AVX2 static size_t count_avx2(const char* data, size_t length) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t total = 0;
+    size_t i = 0;
+
+    while (i + 32 <= length) {
+        __m256i acc = zero;
+        size_t steps = (length - i) / 32;
+        if (steps > 255) steps = 255;
+        for (size_t s = 0; s < steps; s++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        total += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+                 (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+    }
+    return total + count_scalar(data + i, length - i);
+}
+
+SCAN_AVX2 static int index_avx2(const char* data, size_t length, size_t base,
+                                size_t** starts, size_t* count, size_t* cap) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + BLOCK <= length; i += BLOCK) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), nl);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 32)), nl);
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) continue;
+
+        uint64_t mask = (uint64_t)(unsigned)_mm256_movemask_epi8(a) |
+                        (uint64_t)(unsigned)_mm256_movemask_epi8(b) << 32;
+        if (!index_mask(mask, base + i, starts, count, cap)) return 0;
+    }
+    return index_scalar(data + i, length - i, base + i, starts, count, cap);
+}
+
+static size_t find_sse2(const char* data, size_t length, const char* pat, size_t pat_len) {
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[pat_len - 1]);
+    size_t candidates = length - pat_len + 1;
+    size_t i = 0;
+
+    for (; i + 16 <= candidates; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + pat_len - 1)), last);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask) {
+            size_t at = i + ctz64(mask);
+            if (memcmp(data + at, pat, pat_len) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(data, i, candidates - 1, pat, pat_len);
+}
+
+static size_t rfind_sse2(const char* data, size_t length, const char* pat, size_t pat_len) {
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[pat_len - 1]);
+    size_t end = length - pat_len + 1;
+
+    for (; end >= 16; end -= 16) {
+        size_t i = end - 16;
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + pat_len - 1)), last);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask) {
+            int bit = top_bit(mask);
+            if (memcmp(data + i + bit, pat, pat_len) == 0) return (i + bit);
+            mask &= ~(1u << bit);
+        }
+    }
+    return rfind_scalar(data, end, pat, pat_len);
+}
+
+SCAN_AVX2 static size_t find_avx2(const char* data, size_t length, const char* pat, size_t pat_len) {
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[pat_len - 1]);
+    size_t candidates = length - pat_len + 1;
+    size_t i = 0;
+
+    for (; i + 32 <= candidates; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + pat_len - 1)), last);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask) {
+            size_t at = i + ctz64(mask);
+            if (memcmp(data + at, pat, pat_len) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(data, i, candidates - 1, pat, pat_len);
+}
+
+SCAN_AVX2 static size_t rfind_avx2(const char* data, size_t length, const char* pat, size_t pat_len) {
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[pat_len - 1]);
+    size_t end = length - pat_len + 1;
+
+    for (; end >= 32; end -= 32) {
+        size_t i = end - 32;
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + pat_len - 1)), last);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask) {
+            int bit = top_bit(mask);
+            if (memcmp(data + i + bit, pat, pat_len) == 0) return (i + bit);
+            mask &= ~(1u << bit);
+        }
+    }
+    return rfind_scalar(data, end, pat, pat_len);
+}
+
+#endif // SCAN_X86
+
+size_t scan_count_lf(const char* data, size_t length) {
+#ifdef SCAN_X86
+    if (has_avx2()) return count_avx2(data, length);
+    return count_sse2(data, length);
+#else
+    return count_scalar(data, length);
+#endif
+}
+
+int scan_index_lf(const char* data, size_t length, size_t base,
+                  size_t** starts, size_t* count, size_t* cap) {
+#ifdef SCAN_X86
+    if (has_avx2()) return index_avx2(data, length, base, starts, count, cap);
+    return index_sse2(data, length, base, starts, count, cap);
+#else
+    return index_scalar(data, length, base, starts, count, cap);
+#endif
+}
+
+size_t scan_find(const char* data, size_t length, const char* pat, size_t pat_len) {
+    if (pat_len == 0 || pat_len > length) return SCAN_NONE;
+#ifdef SCAN_X86
+    if (has_avx2()) return find_avx2(data, length, pat, pat_len);
+    return find_sse2(data, length, pat, pat_len);
+#else
+    return find_scalar(data, 0, length - pat_len, pat, pat_len);
+#endif
+}
+
+size_t scan_rfind(const char* data, size_t length, const char* pat, size_t pat_len) {
+    if (pat_len == 0 || pat_len > length) return SCAN_NONE;
+#ifdef SCAN_X86
+    if (has_avx2()) return rfind_avx2(data, length, pat, pat_len);
+    return rfind_sse2(data, length, pat, pat_len);
+#else
+    return rfind_scalar(data, length - pat_len + 1, pat, pat_len);
+#endif
+}
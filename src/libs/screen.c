@@ -1,124 +1,190 @@
 #include <tvi.h>
+#include <scan.h>
 
-static HANDLE hStdOut;
-static CHAR_INFO* buffer;
-static COORD buffer_size;
-static SMALL_RECT write_region;
+#ifdef _WIN32
+static const TermBackend* term = &win32_term;
+#else
+static const TermBackend* term = &posix_term;
+#endif
 
-#define FOREGROUND_YELLOW (FOREGROUND_RED | FOREGROUND_GREEN)
+static Cell* buffer;          // Frame being drawn
+static Cell* front;           // Frame the terminal is showing
+static int grid_rows;
+static int grid_cols;
+static FlushStats last_flush; // What the last flush sent to the terminal
+
+// View settings of the last frame; a change means every row is stale
+static int last_row_offset = -1;
+static int last_col_offset = -1;
+static int last_show_numbers = -1;
+static int last_welcome = -1;
+
+// Use another backend (e.g. headless replay); call before init_screen
+void screen_set_backend(const TermBackend* backend) {
+    term = backend;
+}
 
 // initial
 void init_screen(EditorState* state) {
-    hStdOut = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (hStdOut == INVALID_HANDLE_VALUE) {
-        fprintf(stderr, "Error getting output handle\n");
+    if (!term->init()) {
         exit(1);
     }
 
     update_terminal_size(state);
-    
-    buffer_size.X = state->screen_cols;
-    buffer_size.Y = state->screen_rows;
-    buffer = malloc(buffer_size.X * buffer_size.Y * sizeof(CHAR_INFO));
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed for buffer\n");
-        exit(1);
-    }
-    
-    // write
-    write_region.Left = 0;
-    write_region.Top = 0;
-    write_region.Right = buffer_size.X - 1;
-    write_region.Bottom = buffer_size.Y - 1;
-
-    // hide cursor
-    CONSOLE_CURSOR_INFO cursor_info = {0};
-    cursor_info.dwSize = 1;
-    cursor_info.bVisible = 0;
-    SetConsoleCursorInfo(hStdOut, &cursor_info);
-    
-    SetConsoleOutputCP(CP_UTF8);
 }
 
 // cls
 void cleanup_screen() {
-    CONSOLE_CURSOR_INFO cursor_info = {0};
-    cursor_info.dwSize = 1;
-    cursor_info.bVisible = 1;
-    SetConsoleCursorInfo(hStdOut, &cursor_info);
+    term->cleanup();
     
     free(buffer);
-    
-    SetConsoleOutputCP(CP_OEMCP);
+    free(front);
+    buffer = front = NULL;
+    grid_rows = grid_cols = 0;
 }
 
 // update
 void update_terminal_size(EditorState* state) {
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    if (GetConsoleScreenBufferInfo(hStdOut, &csbi)) {
-        state->screen_cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-        state->screen_rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-        
-        if (buffer_size.X != state->screen_cols || buffer_size.Y != state->screen_rows) {
-            buffer_size.X = state->screen_cols;
-            buffer_size.Y = state->screen_rows;
-            buffer = realloc(buffer, buffer_size.X * buffer_size.Y * sizeof(CHAR_INFO));
-            
-            write_region.Right = buffer_size.X - 1;
-            write_region.Bottom = buffer_size.Y - 1;
+    int rows, cols;
+    if (!term->get_size(&rows, &cols)) {
+        rows = 24;
+        cols = 80;
+    }
+    state->screen_rows = rows;
+    state->screen_cols = cols;
+    
+    if (grid_rows != rows || grid_cols != cols) {
+        grid_rows = rows;
+        grid_cols = cols;
+        size_t cells = (size_t)rows * cols;
+        buffer = realloc(buffer, cells * sizeof(Cell));
+        front = realloc(front, cells * sizeof(Cell));
+        if (!buffer || !front) {
+            fprintf(stderr, "Memory allocation failed for buffer\n");
+            exit(1);
         }
+        
+        // Nothing on the terminal can be trusted after a resize
+        invalidate_screen(state);
     }
 }
 
-void clear_buffer(WORD attr) {
-    for (int y = 0; y < buffer_size.Y; y++) {
-        for (int x = 0; x < buffer_size.X; x++) {
-            buffer[y * buffer_size.X + x].Char.AsciiChar = ' ';
-            buffer[y * buffer_size.X + x].Attributes = attr;
-        }
+// Forget what the terminal shows so the next frame is sent in full
+void invalidate_screen(EditorState* state) {
+    for (size_t i = 0; i < (size_t)grid_rows * grid_cols; i++) {
+        front[i].ch = 0;
+        front[i].attr = 0xFF;
+    }
+    mark_dirty(state, 0, INT_MAX);
+}
+
+void clear_buffer(unsigned char attr) {
+    for (int y = 0; y < grid_rows; y++) {
+        clear_row(y, attr);
+    }
+}
+
+void clear_row(int y, unsigned char attr) {
+    for (int x = 0; x < grid_cols; x++) {
+        buffer[y * grid_cols + x].ch = ' ';
+        buffer[y * grid_cols + x].attr = attr;
+    }
+}
+
+// Record that file rows [from, to] changed and must be redrawn
+void mark_dirty(EditorState* state, int from, int to) {
+    if (state->dirty_from > state->dirty_to) {
+        state->dirty_from = from;
+        state->dirty_to = to;
+        return;
     }
+    if (from < state->dirty_from) state->dirty_from = from;
+    if (to > state->dirty_to) state->dirty_to = to;
 }
 
 // char
-void buffer_putchar(int x, int y, char c, WORD attr) {
-    if (x >= 0 && x < buffer_size.X && y >= 0 && y < buffer_size.Y) {
-        buffer[y * buffer_size.X + x].Char.AsciiChar = c;
-        buffer[y * buffer_size.X + x].Attributes = attr;
+void buffer_putchar(int x, int y, char c, unsigned char attr) {
+    if (x >= 0 && x < grid_cols && y >= 0 && y < grid_rows) {
+        buffer[y * grid_cols + x].ch = c;
+        buffer[y * grid_cols + x].attr = attr;
     }
 }
 
 // string
-void buffer_puts(int x, int y, const char* str, WORD attr) {
+void buffer_puts(int x, int y, const char* str, unsigned char attr) {
     int i = 0;
-    while (str[i] && x + i < buffer_size.X) {
+    while (str[i] && x + i < grid_cols) {
         buffer_putchar(x + i, y, str[i], attr);
         i++;
     }
 }
 
-// refresh
-void flush_buffer() {
-    COORD buffer_coord = {0, 0};
-    WriteConsoleOutputA(hStdOut, buffer, buffer_size, buffer_coord, &write_region);
+// refresh: the backend sends only the cells that differ from what the
+// terminal shows
+void flush_buffer(EditorState* state) {
+    int cursor_row = state->cursor_row - state->row_offset;
+    int cursor_col = state->cursor_col - state->col_offset + (state->show_numbers ? 7 : 0);
+    if (state->welcome_screen) cursor_row = cursor_col = 0;
+    term->flush(buffer, front, grid_rows, grid_cols, cursor_row, cursor_col, &last_flush);
 }
 
-void get_terminal_size(EditorState* state) {
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    if (GetConsoleScreenBufferInfo(hStdOut, &csbi)) {
-        state->screen_cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-        state->screen_rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-    } else {
-        state->screen_cols = 80;
-        state->screen_rows = 24;
-    }
+FlushStats screen_flush_stats() {
+    return last_flush;
+}
+
+int screen_read_key(KeyEvent* event, int timeout_ms) {
+    return term->read_key(event, timeout_ms);
 }
 
 
 void draw_border(EditorState* state) {}
 
+// Adjust the viewport so the cursor stays on screen
+void scroll_to_cursor(EditorState* state) {
+    int text_rows = state->screen_rows - 1;  // last row is the mode line
+    int text_cols = state->screen_cols - (state->show_numbers ? 7 : 0);
+    if (text_rows < 1) text_rows = 1;
+    if (text_cols < 1) text_cols = 1;
+
+    if (state->cursor_row < state->row_offset) {
+        state->row_offset = state->cursor_row;
+    } else if (state->cursor_row >= state->row_offset + text_rows) {
+        state->row_offset = state->cursor_row - text_rows + 1;
+    }
+
+    if (state->cursor_col < state->col_offset) {
+        state->col_offset = state->cursor_col;
+    } else if (state->cursor_col >= state->col_offset + text_cols) {
+        state->col_offset = state->cursor_col - text_cols + 1;
+    }
+}
+
+// Mark the visible cells of row that are part of a match of pat. The row
+// is read from a little left of the viewport so that matches starting
+// off screen are caught too.
+static void highlight_matches(EditorState* state, int line_num, int display_row, int x,
+                              int max_col, const char* pat) {
+    size_t pat_len = strlen(pat);
+    size_t start = (size_t)state->col_offset >= pat_len - 1 ? state->col_offset - (pat_len - 1) : 0;
+    size_t lead = state->col_offset - start;
+    char line_text[max_col + TEXT_FIND_MAX];
+    size_t length = text_get_line(state->text, line_num, start, line_text, lead + max_col);
+
+    size_t pos = 0;
+    while (pos < length) {
+        size_t at = scan_find(line_text + pos, length - pos, pat, pat_len);
+        if (at == SCAN_NONE) break;
+        at += pos;
+        for (size_t i = at; i < at + pat_len; i++) {
+            if (i >= lead) buffer[display_row * grid_cols + x + (int)(i - lead)].attr = ATTR_MATCH;
+        }
+        pos = at + pat_len;
+    }
+}
+
 void draw_lines(EditorState* state) {
-    WORD text_attr = FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_RED;  // 白色文本
-    WORD mode_attr = FOREGROUND_YELLOW;
+    unsigned char text_attr = ATTR_TEXT;  // 白色文本
+    unsigned char mode_attr = ATTR_MODE;
     
     // welcome
     if (state->welcome_screen) {
@@ -133,62 +199,112 @@ void draw_lines(EditorState* state) {
         return;
     }
 
-    int display_row = 0; 
-    for (int line_num = 0; line_num < state->num_lines && display_row < state->screen_rows; line_num++) {
+    int max_col = state->screen_cols - (state->show_numbers ? 7 : 0);  // 调整最大列数（无边界时）
+    if (max_col < 0) max_col = 0;
+    char line_text[max_col + 1];
+    int num_lines = (int)text_line_count(state->text);
+    const char* pattern = search_pattern(state);
+
+    // Only the rows in the viewport are read from the buffer, so the cost of
+    // a frame depends on the screen size, not the file size. Of those, only
+    // rows marked dirty since the last frame are redrawn.
+    for (int display_row = 0; display_row < state->screen_rows - 1; display_row++) {
+        int line_num = state->row_offset + display_row;
+        if (line_num < state->dirty_from || line_num > state->dirty_to) continue;
+        clear_row(display_row, ATTR_BLANK);
+        if (line_num >= num_lines) continue;
         int col = 0;
         
         // line number
         if (state->show_numbers) {
-            char num_str[12];
+            char num_str[16];
             snprintf(num_str, sizeof(num_str), "%6d ", line_num + 1);
             buffer_puts(col, display_row, num_str, mode_attr);
             col += 7;
         }
         
-        int max_col = state->screen_cols - (state->show_numbers ? 7 : 0);  // 调整最大列数（无边界时）
-        if (state->lines[line_num].length <= max_col) {
-            buffer_puts(col, display_row, state->lines[line_num].data, text_attr);
-        } else {
-            for (int i = 0; i < max_col; i++) {
-                buffer_putchar(col + i, display_row, state->lines[line_num].data[i], text_attr);
-            }
+        // A '\r' never reaches the terminal: the one ending a "\r\n" line is
+        // not drawn, any other shows as '?'
+        size_t length = text_get_line(state->text, line_num, state->col_offset, line_text, max_col);
+        size_t end = (size_t)line_end_col(state, line_num);
+        for (size_t i = 0; i < length; i++) {
+            char c = line_text[i];
+            if (c == '\r' && state->col_offset + i >= end) break;
+            buffer_putchar(col + (int)i, display_row, c == '\r' ? '?' : c, text_attr);
         }
-        
-        display_row++;
+        if (pattern && length > 0) highlight_matches(state, line_num, display_row, col, max_col, pattern);
     }
 
     // mode info
     const char* mode_str;
+    char cmd_str[256];        // Outlives the switch: mode_str may point here
     switch (state->mode) {
         case 0: mode_str = "NORMAL MODE"; break;
         case 1: mode_str = "INSERT MODE"; break;
-        case 2: 
-            char cmd_str[256];
+        case 2: ;
+            const char* prompt_str = state->prompt == '/' ? "SEARCH: /" :
+                                     state->prompt == '?' ? "SEARCH: ?" : "COMMAND: ";
             size_t max_cmd_len = sizeof(cmd_str) - 10;
             if (strlen(state->command) > max_cmd_len) {
                 char truncated[max_cmd_len + 1];
                 strncpy(truncated, state->command, max_cmd_len);
                 truncated[max_cmd_len] = '\0';
-                snprintf(cmd_str, sizeof(cmd_str), "COMMAND: %s", truncated);
+                snprintf(cmd_str, sizeof(cmd_str), "%s%s", prompt_str, truncated);
             } else {
-                snprintf(cmd_str, sizeof(cmd_str), "COMMAND: %s", state->command);
+                snprintf(cmd_str, sizeof(cmd_str), "%s%s", prompt_str, state->command);
             }
             mode_str = cmd_str;
             break;
         default: mode_str = "";
     }
+    clear_row(state->screen_rows - 1, ATTR_BLANK);
     buffer_puts(0, state->screen_rows - 1, mode_str, mode_attr); // mode
+    if (state->message[0] && state->mode != 2) {
+        buffer_puts((int)strlen(mode_str) + 2, state->screen_rows - 1, state->message, mode_attr);
+    }
+
+    // background indexing and saving, or following the file
+    int progress = text_index_progress(state->text);
+    int saving = save_progress(state);
+    if (progress >= 0 || saving >= 0) {
+        char index_str[32];
+        if (progress >= 0) snprintf(index_str, sizeof(index_str), "indexing %d%%", progress);
+        else snprintf(index_str, sizeof(index_str), "saving %d%%", saving);
+        buffer_puts(state->screen_cols - (int)strlen(index_str) - 1, state->screen_rows - 1, index_str, mode_attr);
+    } else if (state->follow) {
+        const char* follow_str = follow_pending(state) ? "following..." : "following";
+        buffer_puts(state->screen_cols - (int)strlen(follow_str) - 1, state->screen_rows - 1, follow_str, mode_attr);
+    }
 
-    int cursor_col = state->cursor_col + (state->show_numbers ? 7 : 0);
-    COORD coord = { (SHORT)cursor_col, (SHORT)state->cursor_row };
-    SetConsoleCursorPosition(hStdOut, coord);
+    // render statistics of the previous frame
+    if (state->show_stats) {
+        char stats_str[64];
+        snprintf(stats_str, sizeof(stats_str), "cells %d bytes %zu", last_flush.cells, last_flush.bytes);
+        buffer_puts(state->screen_cols - (int)strlen(stats_str) - 16, state->screen_rows - 1, stats_str, mode_attr);
+    }
 }
 
 void refresh_screen(EditorState* state) {
-    clear_buffer(0);
+    update_terminal_size(state);
+    scroll_to_cursor(state);
+    
+    // Scrolling or changing the layout invalidates every row
+    if (state->row_offset != last_row_offset || state->col_offset != last_col_offset ||
+        state->show_numbers != last_show_numbers || state->welcome_screen != last_welcome) {
+        mark_dirty(state, 0, INT_MAX);
+        last_row_offset = state->row_offset;
+        last_col_offset = state->col_offset;
+        last_show_numbers = state->show_numbers;
+        last_welcome = state->welcome_screen;
+    }
+    if (state->welcome_screen) clear_buffer(ATTR_BLANK);
     
     draw_border(state);
     draw_lines(state);
     
-    flush_buffer();
+    flush_buffer(state);
+    
+    // Everything is on screen now
+    state->dirty_from = 1;
+    state->dirty_to = 0;
 }
@@ -0,0 +1,111 @@
+#include <tvi.h>
+#include <stdint.h>
+
+// Search in normal mode. / and ? open a prompt on the mode line; while the
+// pattern is typed the cursor previews the match from where the prompt was
+// opened, Enter keeps it and Esc goes back. n and N repeat the last search.
+// Searches wrap around the end of the buffer.
+
+// Move the cursor to a document offset
+static void cursor_to(EditorState* state, size_t offset) {
+    size_t row, col;
+    text_position(state->text, offset, &row, &col);
+    state->cursor_row = (int)row;
+    state->cursor_col = (int)col;
+}
+
+// Find pat from the cursor offset origin, wrapping around once.
+// Forward matches start after origin, backward ones before it.
+static int find(EditorState* state, const char* pat, size_t origin, int backward,
+                size_t* at, int* wrapped) {
+    size_t length = strlen(pat);
+    *wrapped = 0;
+    if (!backward) {
+        if (text_find(state->text, pat, length, origin + 1, SIZE_MAX, 0, at)) return 1;
+        *wrapped = 1;
+        return text_find(state->text, pat, length, 0, origin + 1, 0, at);
+    }
+    if (text_find(state->text, pat, length, 0, origin, 1, at)) return 1;
+    *wrapped = 1;
+    return text_find(state->text, pat, length, origin, SIZE_MAX, 1, at);
+}
+
+// The pattern to highlight on screen: the one being typed, else the last
+// search while highlighting is on; NULL for none
+const char* search_pattern(EditorState* state) {
+    if (state->mode == 2 && state->prompt != ':') return state->command[0] ? state->command : NULL;
+    return state->show_matches && state->search[0] ? state->search : NULL;
+}
+
+// Open the search prompt; prompt is '/' to search down or '?' to search up
+void search_begin(EditorState* state, char prompt) {
+    state->mode = 2;
+    state->prompt = prompt;
+    state->command[0] = '\0';
+    state->search_origin = text_offset(state->text, state->cursor_row, state->cursor_col);
+    mark_dirty(state, 0, INT_MAX);
+}
+
+// Preview the match for the pattern typed so far
+void search_update(EditorState* state) {
+    size_t at;
+    int wrapped;
+    if (state->command[0] &&
+        find(state, state->command, state->search_origin, state->prompt == '?', &at, &wrapped)) {
+        cursor_to(state, at);
+    } else {
+        cursor_to(state, state->search_origin);
+    }
+    mark_dirty(state, 0, INT_MAX);
+}
+
+// Leave the prompt and put the cursor back where it was
+void search_cancel(EditorState* state) {
+    cursor_to(state, state->search_origin);
+    state->mode = 0;
+    state->prompt = ':';
+    state->command[0] = '\0';
+    mark_dirty(state, 0, INT_MAX);
+}
+
+// Enter in the prompt: search for the typed pattern, or an empty one
+// repeats the last search in the prompt's direction
+void search_finish(EditorState* state) {
+    if (state->command[0]) {
+        snprintf(state->search, sizeof(state->search), "%s", state->command);
+    }
+    state->search_backward = state->prompt == '?';
+    search_cancel(state);
+    if (!state->search[0]) return;
+
+    state->show_matches = 1;
+    search_next(state, 0);
+}
+
+// n and N: the next match of the last search, in its direction or with
+// reverse in the other one
+void search_next(EditorState* state, int reverse) {
+    if (!state->search[0]) {
+        snprintf(state->message, sizeof(state->message), "No previous search pattern");
+        return;
+    }
+
+    int backward = state->search_backward != reverse;
+    size_t origin = text_offset(state->text, state->cursor_row, state->cursor_col);
+    size_t at;
+    int wrapped;
+    if (!find(state, state->search, origin, backward, &at, &wrapped)) {
+        snprintf(state->message, sizeof(state->message), "Pattern not found: %.200s", state->search);
+        return;
+    }
+    cursor_to(state, at);
+    if (wrapped) {
+        snprintf(state->message, sizeof(state->message), backward
+                 ? "search hit TOP, continuing at BOTTOM"
+                 : "search hit BOTTOM, continuing at TOP");
+    }
+    if (!state->show_matches) {
+        state->show_matches = 1;
+        mark_dirty(state, 0, INT_MAX);
+    }
+}
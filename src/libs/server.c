@@ -0,0 +1,457 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // struct ucred
+#endif
+#include <tvi.h>
+#include <errno.h>
+
+// Server mode. `tvi --server` keeps one editor running with its buffers,
+// line indexes and caches in memory, and `tvi --client file` attaches a
+// terminal to it over a Unix socket, so a file the server knows opens
+// without being loaded again. One client is attached at a time; :q
+// detaches it and the server keeps running until it is sent stop (or
+// SIGTERM or SIGINT). Between clients the server goes on with background
+// work: indexing, writing index caches, saves, compression and follow.
+//
+// Protocol. The client connects to the socket and sends one request line:
+//
+//     tvi1 open ROWS COLS PATH\n   show PATH, adding it to the buffer list,
+//                                  and attach a terminal of ROWS x COLS
+//     tvi1 attach ROWS COLS\n      attach to the buffer last shown
+//     tvi1 ls\n                    list the buffers
+//     tvi1 stop\n                  shut the server down
+//
+// The server answers "ok\n" or "error MESSAGE\n"; after an error it closes
+// the connection. After ok:
+// - ls sends one line per buffer, "N PATH", with " %" after N for the
+//   buffer shown and " +" at the end for a modified one, then closes.
+// - stop closes, and the server exits. The swap files of clean buffers are
+//   deleted; those of modified buffers are flushed and kept for tvi -r.
+//   SIGTERM and SIGINT do the same.
+// - open and attach turn the connection into the terminal: the client
+//   relays the bytes its terminal sends, unchanged, and writes what it
+//   receives to its terminal, which it keeps in raw mode. Size changes go
+//   in-band as CSI 8 ; ROWS ; COLS t. When the editor detaches, the server
+//   restores the screen and closes the connection; the client exits when
+//   it sees end of file, and detaches by closing its end.
+//
+// Only the user who started the server may use it. The default socket
+// lives in a directory that must be the user's own and closed to others:
+// $XDG_RUNTIME_DIR, else /tmp/tvi-UID, created with mode 0700. Whatever
+// the path, the server drops connections from other users and the client
+// refuses a server run by another user, by the peer's credentials.
+
+#ifdef _WIN32
+
+int server_socket_path(char* path, size_t size) {
+    snprintf(path, size, "tvi.sock");
+    return 1;
+}
+
+int server_run(EditorState* state, const char* socket_path) {
+    (void)state;
+    (void)socket_path;
+    fprintf(stderr, "Error: server mode needs Unix sockets\n");
+    return 1;
+}
+
+int client_run(const char* socket_path, const char* filename) {
+    (void)socket_path;
+    (void)filename;
+    fprintf(stderr, "Error: server mode needs Unix sockets\n");
+    return 1;
+}
+
+#else
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Longest request line, and how long a peer may take to send or answer it
+#define SERVER_LINE_MAX 8192
+#define SERVER_LINE_MS 5000
+
+static volatile sig_atomic_t stopping;
+static volatile sig_atomic_t client_resized;
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static void on_client_resize(int sig) {
+    (void)sig;
+    client_resized = 1;
+}
+
+// 1 if dir is a directory, not a link to one, that belongs to the user and
+// that no one else may enter
+static int private_dir(const char* dir) {
+    struct stat st;
+    return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+           (st.st_mode & 077) == 0;
+}
+
+// Socket to use if none is given: in $XDG_RUNTIME_DIR, else in /tmp/tvi-UID,
+// which is created if missing. Returns 0 with a message if the directory is
+// not private to the user.
+int server_socket_path(char* path, size_t size) {
+    char dir[4096];
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) {
+        snprintf(dir, sizeof(dir), "%s", runtime);
+    } else {
+        snprintf(dir, sizeof(dir), "/tmp/tvi-%ld", (long)getuid());
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: cannot create %s: %s\n", dir, strerror(errno));
+            return 0;
+        }
+    }
+    if (!private_dir(dir)) {
+        fprintf(stderr, "Error: %s is not a directory private to you; give a socket with -S\n", dir);
+        return 0;
+    }
+    snprintf(path, size, "%s/tvi.sock", dir);
+    return 1;
+}
+
+// 1 if the process at the other end of the connection runs as the user
+static int peer_is_user(int fd) {
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0 && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+static int socket_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+static int socket_connect(const char* path) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Listen on path, replacing a socket left by a server that is gone. Only
+// the user may connect.
+static int socket_listen(const char* path) {
+    int other = socket_connect(path);
+    if (other >= 0) {
+        close(other);
+        fprintf(stderr, "Error: a tvi server is already running on %s\n", path);
+        return -1;
+    }
+    unlink(path);
+
+    struct sockaddr_un addr;
+    int fd = socket_address(&addr, path) ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+    if (fd >= 0) {
+        mode_t mask = umask(077);
+        int ok = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(fd, 8) == 0;
+        umask(mask);
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) fprintf(stderr, "Error: cannot listen on %s: %s\n", path, strerror(errno));
+    else fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        data += n;
+        length -= (size_t)n;
+    }
+    return 1;
+}
+
+// Read one line, without its '\n', a byte at a time so that nothing after
+// it is taken from the socket. Returns 0 on end of file, an error, an
+// overlong line or a peer silent for SERVER_LINE_MS.
+static int read_line(int fd, char* line, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, SERVER_LINE_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return 0;
+        char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        if (c == '\n') break;
+        if (length + 1 >= size) return 0;
+        line[length++] = c;
+    }
+    line[length] = '\0';
+    return 1;
+}
+
+static void reply_error(int fd, const char* message) {
+    char line[512];
+    int n = snprintf(line, sizeof(line), "error %s\n", message);
+    write_all(fd, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+static void reply_list(EditorState* state, int fd) {
+    write_all(fd, "ok\n", 3);
+    for (int i = 0; i < state->num_buffers; i++) {
+        Buffer* b = &state->buffers[i];
+        int shown = i == state->current;
+        TextBuffer* text = shown ? state->text : b->text;
+        size_t saved = shown ? state->saved_changes : b->saved_changes;
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%d%s ", i + 1, shown ? " %" : "");
+        const char* name = b->filename ? b->filename : "[No Name]";
+        const char* end = text && text->changes != saved ? " +\n" : "\n";
+        if (!write_all(fd, line, (size_t)n) || !write_all(fd, name, strlen(name)) ||
+            !write_all(fd, end, strlen(end))) return;
+    }
+}
+
+// Run the editor on the client's connection until it detaches or goes away
+static void server_attach(EditorState* state, int fd, int rows, int cols) {
+    posix_term_attach(fd, fd, rows, cols);
+    init_screen(state);
+    state->quit = 0;
+    state->mode = 0;
+    state->command[0] = '\0';
+    while (!state->quit && !stopping && !posix_term_closed()) {
+        refresh_screen(state);
+        handle_input(state);
+        editor_poll(state);
+    }
+    cleanup_screen();
+    posix_term_attach(-1, -1, 0, 0);
+    state->quit = 0;
+}
+
+// Serve one request. Returns 1 if it asked the server to stop.
+static int server_request(EditorState* state, int fd) {
+    char line[SERVER_LINE_MAX];
+    if (!read_line(fd, line, sizeof(line))) return 0;
+
+    int rows, cols, used = 0;
+    if (strcmp(line, "tvi1 ls") == 0) {
+        reply_list(state, fd);
+    } else if (strcmp(line, "tvi1 stop") == 0) {
+        write_all(fd, "ok\n", 3);
+        return 1;
+    } else if ((sscanf(line, "tvi1 open %d %d %n", &rows, &cols, &used) == 2 && used > 0 && line[used]) ||
+               (sscanf(line, "tvi1 attach %d %d%n", &rows, &cols, &used) == 2 && !line[used])) {
+        if (rows <= 0 || cols <= 0) {
+            reply_error(fd, "bad terminal size");
+        } else if (strncmp(line, "tvi1 open", 9) == 0 && !buffer_edit(state, line + used)) {
+            reply_error(fd, state->message);
+        } else {
+            write_all(fd, "ok\n", 3);
+            server_attach(state, fd, rows, cols);
+        }
+    } else {
+        reply_error(fd, "unknown request");
+    }
+    return 0;
+}
+
+// Serve clients on socket_path until stopped. Returns the exit status.
+int server_run(EditorState* state, const char* socket_path) {
+    int listen_fd = socket_listen(socket_path);
+    if (listen_fd < 0) return 1;
+
+    // A client that goes away mid-write must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    fprintf(stderr, "tvi server listening on %s\n", socket_path);
+
+    while (!stopping) {
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, editor_busy(state) ? 50 : -1);
+        editor_poll(state);
+        if (ready <= 0) continue;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (!peer_is_user(fd)) reply_error(fd, "permission denied");
+        else if (server_request(state, fd)) stopping = 1;
+        close(fd);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Client: a relay between the terminal and the server
+
+static struct termios client_termios;
+
+static int client_size(int* rows, int* cols) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0) return 0;
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+    return 1;
+}
+
+static int client_raw(void) {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &client_termios) != 0) {
+        fprintf(stderr, "Error: standard input is not a terminal\n");
+        return 0;
+    }
+    struct termios raw = client_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        fprintf(stderr, "Error: cannot set raw terminal mode\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Relay bytes between the terminal and the server until either side ends
+static void client_relay(int fd) {
+    char data[65536];
+    for (;;) {
+        if (client_resized) {
+            client_resized = 0;
+            int rows, cols;
+            if (client_size(&rows, &cols)) {
+                char report[32];
+                int n = snprintf(report, sizeof(report), "\x1b[8;%d;%dt", rows, cols);
+                if (!write_all(fd, report, (size_t)n)) return;
+            }
+        }
+
+        struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (pfd[1].revents) {
+            ssize_t n = read(fd, data, sizeof(data));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0 || !write_all(STDOUT_FILENO, data, (size_t)n)) return;
+        }
+        if (pfd[0].revents) {
+            ssize_t n = read(STDIN_FILENO, data, sizeof(data));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0 || !write_all(fd, data, (size_t)n)) return;
+        }
+    }
+}
+
+// Absolute form of filename, so the server finds it whatever its directory
+static char* absolute_path(const char* filename) {
+    char* path = realpath(filename, NULL);
+    if (path || filename[0] == '/') return path ? path : _strdup(filename);
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) return NULL;
+    path = malloc(strlen(cwd) + strlen(filename) + 2);
+    if (path) sprintf(path, "%s/%s", cwd, filename);
+    return path;
+}
+
+// Attach the terminal to the server, showing filename if given. Returns
+// the exit status.
+int client_run(const char* socket_path, const char* filename) {
+    int fd = socket_connect(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: no tvi server on %s (start one with tvi --server): %s\n",
+                socket_path, strerror(errno));
+        return 1;
+    }
+    if (!peer_is_user(fd)) {
+        fprintf(stderr, "Error: the tvi server on %s is run by another user\n", socket_path);
+        close(fd);
+        return 1;
+    }
+
+    int rows, cols;
+    if (!client_size(&rows, &cols)) {
+        rows = 24;
+        cols = 80;
+    }
+    char* path = filename ? absolute_path(filename) : NULL;
+    char* request = malloc(SERVER_LINE_MAX);
+    if (!request || (filename && !path)) {
+        fprintf(stderr, "Memory allocation failed in client_run\n");
+        return 1;
+    }
+    int n = path ? snprintf(request, SERVER_LINE_MAX, "tvi1 open %d %d %s\n", rows, cols, path)
+                 : snprintf(request, SERVER_LINE_MAX, "tvi1 attach %d %d\n", rows, cols);
+    free(path);
+
+    signal(SIGPIPE, SIG_IGN);
+    int ok = n > 0 && n < SERVER_LINE_MAX && write_all(fd, request, (size_t)n) &&
+             read_line(fd, request, SERVER_LINE_MAX);
+    if (!ok || strcmp(request, "ok") != 0) {
+        if (!ok) fprintf(stderr, "Error: no answer from the tvi server on %s; another client may be attached\n",
+                         socket_path);
+        else fprintf(stderr, "Error: %s\n", strncmp(request, "error ", 6) == 0 ? request + 6 : request);
+        free(request);
+        close(fd);
+        return 1;
+    }
+    free(request);
+
+    if (!client_raw()) {
+        close(fd);
+        return 1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_client_resize;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+
+    client_relay(fd);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &client_termios);
+    close(fd);
+    return 0;
+}
+
+#endif
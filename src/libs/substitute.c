@@ -0,0 +1,405 @@
+#include <tvi.h>
+#include <re.h>
+#include <thread.h>
+#include <ctype.h>
+
+// :[range]s/pattern/replacement/[g]
+//
+// The range is empty (the cursor line), % (every line), or one or two
+// addresses separated by a comma, each a line number, . or $. In the
+// replacement & stands for the match, \r for a line break and \t for a tab;
+// a backslash makes anything else literal. Without g only the first match
+// of each line is replaced. The '\r' of a line ending in "\r\n" is not
+// matched, so $ finds the end of the line before it, and in a document of
+// such lines (see crlf_document) a line break is put in as "\r\n".
+//
+// The range is cut into line-aligned parts of about equal size, one per
+// worker. A worker reads its part straight from the pieces and writes each
+// run of changed lines into its own arena as one edit. Nothing is shared
+// while they run: the buffer is only read, and the edits are applied on
+// this thread once every worker is done, from the end of the document
+// back, so the offsets of the edits still to come stay valid.
+
+// Smallest part worth a thread of its own
+#define SUBST_MIN_PART (1024 * 1024)
+#define SUBST_MAX_THREADS 64
+
+// Replace old_length bytes at offset with length bytes of the arena
+typedef struct {
+    size_t offset;
+    size_t old_length;
+    size_t text;
+    size_t length;
+} SubstEdit;
+
+typedef struct {
+    TextBuffer* buf;
+    const Regex* re;
+    const char* replacement;
+    int global;
+    int crlf;             // Line breaks are written "\r\n"
+    size_t begin;         // Byte range of the part: whole lines
+    size_t end;
+    int last;             // The part ends the document
+
+    char* line;           // Line split across pieces, copied together
+    size_t line_len;
+    size_t line_cap;
+    size_t line_offset;   // Document offset of the next line
+
+    char* arena;          // Replacement text of all edits
+    size_t arena_len;
+    size_t arena_cap;
+    SubstEdit* edits;
+    size_t num_edits;
+    size_t edit_cap;
+    size_t substitutions;
+    size_t lines;         // Lines changed
+    int failed;           // An allocation failed
+} SubstPart;
+
+static int grow(char** data, size_t* cap, size_t need) {
+    if (need <= *cap) return 1;
+    size_t new_cap = *cap ? *cap * 2 : 4096;
+    while (new_cap < need) new_cap *= 2;
+    char* grown = realloc(*data, new_cap);
+    if (!grown) return 0;
+    *data = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+static void arena_put(SubstPart* part, const char* text, size_t length) {
+    if (!grow(&part->arena, &part->arena_cap, part->arena_len + length)) {
+        part->failed = 1;
+        return;
+    }
+    if (length) memcpy(part->arena + part->arena_len, text, length); // text may be NULL
+    part->arena_len += length;
+}
+
+// Append the replacement for the match text[0, length)
+static void put_replacement(SubstPart* part, const char* match, size_t length) {
+    for (const char* r = part->replacement; *r; r++) {
+        if (*r == '&') {
+            arena_put(part, match, length);
+        } else if (r[0] == '\\' && r[1]) {
+            r++;
+            if (*r == 'r' && part->crlf) {
+                arena_put(part, "\r\n", 2);
+                continue;
+            }
+            char c = *r == 'r' ? '\n' : *r == 't' ? '\t' : *r;
+            arena_put(part, &c, 1);
+        } else {
+            arena_put(part, r, 1);
+        }
+    }
+}
+
+// Substitute within one line at document offset offset. A changed line
+// right after a changed line extends its edit over the '\n' between them.
+// A '\r' that ends the line is left out of the matching and kept.
+static void process_line(SubstPart* part, const char* line, size_t length, size_t offset) {
+    size_t match_length = length > 0 && line[length - 1] == '\r' ? length - 1 : length;
+    SubstEdit* prev = part->num_edits ? &part->edits[part->num_edits - 1] : NULL;
+    int merge = prev && prev->offset + prev->old_length + 1 == offset;
+    size_t mark = part->arena_len;
+    if (merge) arena_put(part, "\n", 1);
+
+    size_t copied = 0;
+    size_t pos = 0;
+    size_t count = 0;
+    size_t start, end;
+    while (pos <= match_length && re_search(part->re, line, match_length, pos, &start, &end)) {
+        // No empty match right where the last one ended
+        if (start == end && count > 0 && start == copied) {
+            pos = start + 1;
+            continue;
+        }
+        arena_put(part, line + copied, start - copied);
+        put_replacement(part, line + start, end - start);
+        copied = end;
+        count++;
+        if (!part->global) break;
+        pos = end > start ? end : start + 1;
+    }
+    if (count == 0) {
+        part->arena_len = mark;
+        return;
+    }
+    arena_put(part, line + copied, length - copied);
+
+    if (merge) {
+        prev->old_length += 1 + length;
+        prev->length = part->arena_len - prev->text;
+    } else {
+        if (part->num_edits == part->edit_cap) {
+            size_t cap = part->edit_cap ? part->edit_cap * 2 : 256;
+            SubstEdit* edits = realloc(part->edits, cap * sizeof(SubstEdit));
+            if (!edits) {
+                part->failed = 1;
+                return;
+            }
+            part->edits = edits;
+            part->edit_cap = cap;
+        }
+        SubstEdit edit = { offset, length, mark, part->arena_len - mark };
+        part->edits[part->num_edits++] = edit;
+    }
+    part->substitutions += count;
+    part->lines++;
+}
+
+// Split the bytes of the part into lines. Lines inside a piece are used in
+// place; only a line that crosses into the next piece is copied.
+static int part_span(const char* data, size_t length, void* ctx) {
+    SubstPart* part = ctx;
+    while (length > 0 && !part->failed) {
+        const char* nl = memchr(data, '\n', length);
+        size_t n = nl ? (size_t)(nl - data) : length;
+        if (!nl || part->line_len > 0) {
+            if (!grow(&part->line, &part->line_cap, part->line_len + n)) {
+                part->failed = 1;
+                break;
+            }
+            memcpy(part->line + part->line_len, data, n);
+            part->line_len += n;
+            if (!nl) break;
+            process_line(part, part->line, part->line_len, part->line_offset);
+            part->line_offset += part->line_len + 1;
+            part->line_len = 0;
+        } else {
+            process_line(part, data, n, part->line_offset);
+            part->line_offset += n + 1;
+        }
+        data += n + 1;
+        length -= n + 1;
+    }
+    return !part->failed;
+}
+
+static void part_run(void* arg) {
+    SubstPart* part = arg;
+    part->line_offset = part->begin;
+    text_foreach(part->buf, part->begin, part->end - part->begin, part_span, part);
+
+    // The last line of the document has no '\n' after it
+    if (part->last && !part->failed) {
+        process_line(part, part->line, part->line_len, part->line_offset);
+    }
+}
+
+static void part_free(SubstPart* part) {
+    free(part->line);
+    free(part->arena);
+    free(part->edits);
+}
+
+// Parse one address at *p; returns 0 if there is none
+static int parse_address(EditorState* state, const char** p, int* row) {
+    if (**p == '.') {
+        *row = state->cursor_row;
+        (*p)++;
+        return 1;
+    }
+    if (**p == '$') {
+        *row = (int)text_line_count(state->text) - 1;
+        (*p)++;
+        return 1;
+    }
+    if (isdigit((unsigned char)**p)) {
+        *row = (int)strtol(*p, (char**)p, 10) - 1;
+        return 1;
+    }
+    return 0;
+}
+
+// Copy the text up to the next unescaped delim into dst. A backslash
+// before delim is dropped, any other stays for the pattern or replacement.
+static const char* parse_field(const char* p, char delim, char* dst, size_t size) {
+    size_t n = 0;
+    while (*p && *p != delim) {
+        if (p[0] == '\\' && p[1] == delim) p++;
+        else if (p[0] == '\\' && p[1] && n + 1 < size) dst[n++] = *p++;
+        if (n + 1 < size) dst[n++] = *p;
+        p++;
+    }
+    dst[n] = '\0';
+    return p;
+}
+
+// Apply the workers' edits, last first, recording them for undo
+static int commit_edits(EditorState* state, SubstPart* parts, int num_parts, int record) {
+    char* old = NULL;
+    size_t old_cap = 0;
+    int ok = 1;
+
+    for (int i = num_parts - 1; i >= 0 && ok; i--) {
+        SubstPart* part = &parts[i];
+        for (size_t k = part->num_edits; k-- > 0 && ok;) {
+            SubstEdit* e = &part->edits[k];
+            if (record) {
+                ok = grow(&old, &old_cap, e->old_length);
+                if (!ok) break;
+                text_read(state->text, e->offset, old, e->old_length);
+            }
+            ok = text_delete(state->text, e->offset, e->old_length) &&
+                 text_insert(state->text, e->offset, part->arena + e->text, e->length);
+            if (ok && record) {
+                undo_delete(state->undo, e->offset, old, e->old_length);
+                undo_insert(state->undo, e->offset, part->arena + e->text, e->length);
+            }
+            if (ok) {
+                swap_delete(state, e->offset, e->old_length);
+                swap_insert(state, e->offset, part->arena + e->text, e->length);
+            }
+        }
+    }
+    free(old);
+    return ok;
+}
+
+// Run :[range]s/pattern/replacement/[g]. Returns 0 if cmd is not a
+// substitute command, so the caller can try others.
+int substitute_command(EditorState* state, const char* cmd) {
+    const char* p = cmd;
+    int first = state->cursor_row;
+    int last = state->cursor_row;
+    if (*p == '%') {
+        first = 0;
+        last = (int)text_line_count(state->text) - 1;
+        p++;
+    } else if (parse_address(state, &p, &first)) {
+        last = first;
+        if (*p == ',' && (p++, !parse_address(state, &p, &last))) return 0;
+    }
+    if (p[0] != 's' || !p[1] || isalnum((unsigned char)p[1]) || isspace((unsigned char)p[1])) {
+        return 0;
+    }
+
+    char delim = p[1];
+    char pattern[256];
+    char replacement[256];
+    p = parse_field(p + 2, delim, pattern, sizeof(pattern));
+    if (*p == delim) p++;
+    p = parse_field(p, delim, replacement, sizeof(replacement));
+    if (*p == delim) p++;
+    int global = strchr(p, 'g') != NULL;
+
+    // An empty pattern repeats the last search
+    if (!pattern[0]) snprintf(pattern, sizeof(pattern), "%s", state->search);
+
+    int lines = (int)text_line_count(state->text);
+    if (first > last) {
+        int t = first;
+        first = last;
+        last = t;
+    }
+    if (first < 0 || last >= lines) {
+        snprintf(state->message, sizeof(state->message), "Invalid range");
+        return 1;
+    }
+
+    const char* error;
+    Regex* re = re_compile(pattern, &error);
+    if (!re) {
+        snprintf(state->message, sizeof(state->message), "Invalid pattern: %s", error);
+        return 1;
+    }
+
+    // The workers read the piece tree directly; put it in its final shape
+    text_index_wait(state->text);
+    text_flush(state->text);
+    size_t begin = text_line_start(state->text, first);
+    size_t end = last + 1 < lines ? text_line_start(state->text, last + 1) : text_size(state->text);
+
+    int crlf = crlf_document(state);
+    int threads = state->index_threads > 0 ? state->index_threads : thread_cpu_count();
+    if (threads > SUBST_MAX_THREADS) threads = SUBST_MAX_THREADS;
+    size_t max_parts = (end - begin) / SUBST_MIN_PART;
+    int num_parts = (size_t)threads < max_parts ? threads : (int)(max_parts > 0 ? max_parts : 1);
+
+    SubstPart parts[SUBST_MAX_THREADS];
+    Thread workers[SUBST_MAX_THREADS];
+    int started[SUBST_MAX_THREADS];
+    memset(parts, 0, num_parts * sizeof(SubstPart));
+    size_t part_begin = begin;
+    for (int i = 0; i < num_parts; i++) {
+        size_t part_end = end;
+        if (i + 1 < num_parts) {
+            // Move the cut to the start of the next line
+            size_t row, col;
+            part_end = begin + (end - begin) / num_parts * (i + 1);
+            text_position(state->text, part_end, &row, &col);
+            if (col > 0) part_end = row + 1 < (size_t)lines ? text_line_start(state->text, row + 1) : end;
+            if (part_end < part_begin) part_end = part_begin;
+            if (part_end > end) part_end = end;
+        }
+        SubstPart* part = &parts[i];
+        part->buf = state->text;
+        part->re = re;
+        part->replacement = replacement;
+        part->global = global;
+        part->crlf = crlf;
+        part->begin = part_begin;
+        part->end = part_end;
+        part->last = i + 1 == num_parts && last == lines - 1;
+        part_begin = part_end;
+    }
+
+    // Part 0 runs here while the others run on workers
+    for (int i = 1; i < num_parts; i++) {
+        started[i] = thread_create(&workers[i], part_run, &parts[i]);
+    }
+    part_run(&parts[0]);
+    for (int i = 1; i < num_parts; i++) {
+        if (started[i]) thread_join(workers[i]);
+        else part_run(&parts[i]);
+    }
+    re_free(re);
+
+    size_t substitutions = 0, changed = 0, bytes = 0;
+    int failed = 0;
+    SubstEdit* final = NULL;
+    long long shift = 0;  // How far the last edit moves as the earlier ones are applied
+    for (int i = 0; i < num_parts; i++) {
+        SubstPart* part = &parts[i];
+        failed |= part->failed;
+        substitutions += part->substitutions;
+        changed += part->lines;
+        for (size_t k = 0; k < part->num_edits; k++) {
+            SubstEdit* e = &part->edits[k];
+            if (final) shift += (long long)final->length - (long long)final->old_length;
+            final = e;
+            bytes += e->old_length + e->length;
+        }
+    }
+
+    if (failed) {
+        snprintf(state->message, sizeof(state->message), "Memory allocation failed in :s");
+    } else if (substitutions == 0) {
+        snprintf(state->message, sizeof(state->message), "Pattern not found: %.200s", pattern);
+    } else {
+        // A change too large for the undo memory cap cannot be undone
+        int record = bytes <= state->undo->limit;
+        if (!record) undo_clear(state->undo);
+        if (!commit_edits(state, parts, num_parts, record)) {
+            snprintf(state->message, sizeof(state->message), "Memory allocation failed in :s");
+        } else {
+            snprintf(state->message, sizeof(state->message), "%zu substitution%s on %zu line%s%s",
+                     substitutions, substitutions == 1 ? "" : "s", changed, changed == 1 ? "" : "s",
+                     record ? "" : " (too large to undo)");
+        }
+
+        // The cursor goes to the start of the last change
+        size_t row, col;
+        text_position(state->text, (size_t)((long long)final->offset + shift), &row, &col);
+        state->cursor_row = (int)row;
+        state->cursor_col = 0;
+        mark_dirty(state, first, INT_MAX);
+    }
+
+    for (int i = 0; i < num_parts; i++) part_free(&parts[i]);
+    return 1;
+}
@@ -0,0 +1,454 @@
+#ifndef _WIN32
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <term.h>
+
+// termios + ANSI escape backend. Each frame is diffed against the previous
+// one and the escape sequences for the changed cells are collected into a
+// single buffer that goes out in one write().
+//
+// It normally talks to the terminal on stdin and stdout. In server mode it
+// is attached to a client's socket instead (posix_term_attach): the client
+// keeps its own terminal in raw mode and relays bytes both ways, and
+// reports its size in-band as CSI 8 ; rows ; cols t, the form xterm uses to
+// answer a size query.
+
+static int in_fd = STDIN_FILENO;
+static int out_fd = STDOUT_FILENO;
+static int peer_rows;         // Size last reported by an attached client
+static int peer_cols;
+static int size_reported;     // The key just decoded was a size report
+static int closed;            // Input hit end of file or an error
+
+static struct termios original_termios;
+static int raw_mode;
+
+static char* out;             // Frame output
+static size_t out_len;
+static size_t out_cap;
+
+// Terminal state as of the end of the last write; -1 when unknown
+static int term_row = -1;
+static int term_col = -1;
+static int term_style = -1;
+
+static unsigned char input[4096];   // Bytes read but not yet parsed
+static size_t input_len;
+
+static char* paste;           // Text of the last bracketed paste
+static size_t paste_len;
+static size_t paste_cap;
+
+static volatile sig_atomic_t resized;
+
+// Unchanged cells shorter than this between two changes are rewritten
+// rather than skipped with a cursor move, which costs about as much
+#define MAX_SKIP 4
+
+// Bracketed paste markers; the terminal wraps pasted text in them
+#define PASTE_BEGIN "\x1b[200~"
+#define PASTE_END "\x1b[201~"
+#define PASTE_MARKER_LEN 6
+
+// How long a paste may stall before what arrived so far is delivered
+#define PASTE_TIMEOUT_MS 1000
+
+// SGR sequence per style, and the style of each cell attribute
+static const char* style_sgr[] = {
+    "\x1b[0m",                // Default colors
+    "\x1b[0;33m",             // Yellow
+    "\x1b[0;30;43m"           // Black on yellow
+};
+
+static const int attr_style[] = {
+    0,                        // ATTR_BLANK
+    0,                        // ATTR_TEXT
+    1,                        // ATTR_MODE
+    2                         // ATTR_MATCH
+};
+
+static void on_resize(int sig) {
+    (void)sig;
+    resized = 1;
+}
+
+static void out_append(const char* s, size_t n) {
+    if (out_len + n > out_cap) {
+        size_t cap = out_cap ? out_cap * 2 : 16384;
+        while (cap < out_len + n) cap *= 2;
+        char* grown = realloc(out, cap);
+        if (!grown) return;
+        out = grown;
+        out_cap = cap;
+    }
+    memcpy(out + out_len, s, n);
+    out_len += n;
+}
+
+static void out_puts(const char* s) {
+    out_append(s, strlen(s));
+}
+
+static void out_move(int row, int col) {
+    if (row == term_row && col == term_col) return;
+    char seq[32];
+    int n = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row + 1, col + 1);
+    out_append(seq, n);
+    term_row = row;
+    term_col = col;
+}
+
+// Write the frame buffer out, retrying short writes
+static void out_send(void) {
+    size_t sent = 0;
+    while (sent < out_len) {
+        ssize_t n = write(out_fd, out + sent, out_len - sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        sent += n;
+    }
+    out_len = 0;
+}
+
+// Talk to a client on these descriptors from the next init on, or to the
+// terminal again with -1. rows and cols are its size until it reports
+// another.
+void posix_term_attach(int in, int out, int rows, int cols) {
+    in_fd = in < 0 ? STDIN_FILENO : in;
+    out_fd = out < 0 ? STDOUT_FILENO : out;
+    peer_rows = rows;
+    peer_cols = cols;
+    closed = 0;
+    input_len = 0;
+}
+
+// 1 once the input has ended, e.g. an attached client went away
+int posix_term_closed(void) {
+    return closed;
+}
+
+static int posix_init(void) {
+    if (in_fd != STDIN_FILENO) {
+        // The client owns the terminal's mode
+        out_puts("\x1b[?1049h\x1b[0m\x1b[2J\x1b[?2004h");
+        out_send();
+        term_row = term_col = term_style = -1;
+        return 1;
+    }
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original_termios) != 0) {
+        fprintf(stderr, "Error: standard input is not a terminal\n");
+        return 0;
+    }
+
+    struct termios raw = original_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+        fprintf(stderr, "Error: cannot set raw terminal mode\n");
+        return 0;
+    }
+    raw_mode = 1;
+
+    // No SA_RESTART, so a resize interrupts poll() in read_key
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_resize;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+
+    // Alternate screen, cleared, with bracketed paste
+    out_puts("\x1b[?1049h\x1b[0m\x1b[2J\x1b[?2004h");
+    out_send();
+    term_row = term_col = term_style = -1;
+    return 1;
+}
+
+static void posix_cleanup(void) {
+    out_puts("\x1b[?2004l\x1b[0m\x1b[2J\x1b[?1049l");
+    out_send();
+    if (raw_mode && in_fd == STDIN_FILENO) tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
+    raw_mode = 0;
+
+    free(out);
+    out = NULL;
+    out_cap = 0;
+    free(paste);
+    paste = NULL;
+    paste_cap = 0;
+}
+
+static int posix_get_size(int* rows, int* cols) {
+    struct winsize ws;
+    if (ioctl(out_fd, TIOCGWINSZ, &ws) != 0 || ws.ws_col == 0) {
+        if (peer_rows <= 0 || peer_cols <= 0) return 0;
+        *rows = peer_rows;
+        *cols = peer_cols;
+        return 1;
+    }
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+    return 1;
+}
+
+static int cell_differs(const Cell* back, const Cell* front) {
+    return back->ch != front->ch || back->attr != front->attr;
+}
+
+static void posix_flush(const Cell* back, Cell* front, int rows, int cols,
+                        int cursor_row, int cursor_col, FlushStats* stats) {
+    stats->cells = 0;
+
+    for (int y = 0; y < rows; y++) {
+        const Cell* back_row = back + y * cols;
+        Cell* front_row = front + y * cols;
+
+        int x = 0;
+        while (x < cols) {
+            if (!cell_differs(&back_row[x], &front_row[x])) {
+                x++;
+                continue;
+            }
+
+            // Extend the run over short stretches of unchanged cells
+            int end = x;
+            for (int j = x + 1; j < cols && j - end <= MAX_SKIP; j++) {
+                if (cell_differs(&back_row[j], &front_row[j])) end = j;
+            }
+
+            out_move(y, x);
+            for (int k = x; k <= end; k++) {
+                int style = attr_style[back_row[k].attr];
+                if (style != term_style) {
+                    out_puts(style_sgr[style]);
+                    term_style = style;
+                }
+                // Keep the grid in step with the terminal: one byte, one column
+                char c = back_row[k].ch;
+                if ((unsigned char)c < 32 || (unsigned char)c >= 127) c = '?';
+                out_append(&c, 1);
+                front_row[k] = back_row[k];
+            }
+            stats->cells += end - x + 1;
+
+            // Writing the last column leaves the cursor in a pending-wrap state
+            term_col = end + 1;
+            if (term_col >= cols) term_row = term_col = -1;
+            x = end + 1;
+        }
+    }
+
+    out_move(cursor_row, cursor_col);
+    stats->bytes = out_len;
+    out_send();
+}
+
+static int paste_append(const unsigned char* data, size_t n) {
+    if (paste_len + n > paste_cap) {
+        size_t cap = paste_cap ? paste_cap * 2 : 65536;
+        while (cap < paste_len + n) cap *= 2;
+        char* grown = realloc(paste, cap);
+        if (!grown) return 0;
+        paste = grown;
+        paste_cap = cap;
+    }
+    memcpy(paste + paste_len, data, n);
+    paste_len += n;
+    return 1;
+}
+
+// Position of the end-of-paste marker in the input buffer, or -1
+static long find_paste_end(void) {
+    for (size_t i = 0; i + PASTE_MARKER_LEN <= input_len; i++) {
+        if (input[i] == 0x1b && memcmp(input + i, PASTE_END, PASTE_MARKER_LEN) == 0) return (long)i;
+    }
+    return -1;
+}
+
+static void input_consume(size_t n) {
+    memmove(input, input + n, input_len - n);
+    input_len -= n;
+}
+
+// Collect everything up to the end-of-paste marker into paste. The input
+// buffer is emptied into paste as it fills, so the paste may be any size.
+static void read_paste(void) {
+    paste_len = 0;
+    for (;;) {
+        long end = find_paste_end();
+        if (end >= 0) {
+            paste_append(input, end);
+            input_consume(end + PASTE_MARKER_LEN);
+            return;
+        }
+
+        // Keep a tail that may be the start of a split end marker
+        size_t keep = input_len < PASTE_MARKER_LEN - 1 ? input_len : PASTE_MARKER_LEN - 1;
+        if (!paste_append(input, input_len - keep)) return;
+        input_consume(input_len - keep);
+
+        struct pollfd pfd = { in_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, PASTE_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        ssize_t n = ready > 0 ? read(in_fd, input + input_len, sizeof(input) - input_len) : 0;
+        if (n <= 0) {
+            // The terminal never closed the paste; deliver what we have
+            paste_append(input, input_len);
+            input_len = 0;
+            return;
+        }
+        input_len += n;
+    }
+}
+
+// Take the size from the parameters of CSI 8 ; rows ; cols t
+static void size_report(const unsigned char* params, size_t length) {
+    char text[32];
+    int rows, cols;
+    if (length >= sizeof(text)) return;
+    memcpy(text, params, length);
+    text[length] = '\0';
+    if (sscanf(text, "8;%d;%d", &rows, &cols) == 2 && rows > 0 && cols > 0) {
+        peer_rows = rows;
+        peer_cols = cols;
+        size_reported = 1;
+    }
+}
+
+// Decode one key from the front of the input buffer. Returns the number of
+// bytes consumed, or 0 if more bytes are needed.
+static size_t decode_key(KeyEvent* event, int more_pending) {
+    unsigned char c = input[0];
+    event->ch = 0;
+    event->key = KEY_NONE;
+    event->text = NULL;
+    event->length = 0;
+
+    if (c == 0x1b) {
+        if (input_len == 1) {
+            // A lone ESC is the Escape key unless the rest of a sequence is
+            // still on its way
+            if (more_pending) return 0;
+            event->key = KEY_ESCAPE;
+            return 1;
+        }
+        if (input[1] != '[' && input[1] != 'O') {
+            event->key = KEY_ESCAPE;
+            return 1;
+        }
+        // CSI / SS3: parameters and intermediates, then a final byte
+        size_t i = 2;
+        while (i < input_len && (input[i] < 0x40 || input[i] > 0x7e)) i++;
+        if (i == input_len) return more_pending ? 0 : input_len;
+        if (i + 1 == PASTE_MARKER_LEN && memcmp(input, PASTE_BEGIN, PASTE_MARKER_LEN) == 0) {
+            event->key = KEY_PASTE;
+            return i + 1;
+        }
+        switch (input[i]) {
+            case 't': size_report(input + 2, i - 2); break;
+            case 'A': event->key = KEY_UP; break;
+            case 'B': event->key = KEY_DOWN; break;
+            case 'C': event->key = KEY_RIGHT; break;
+            case 'D': event->key = KEY_LEFT; break;
+        }
+        return i + 1;
+    }
+
+    if (c == '\r' || c == '\n') event->key = KEY_ENTER;
+    else if (c == 127 || c == 8) event->key = KEY_BACKSPACE;
+    else if (c >= 1 && c <= 26) {
+        event->key = KEY_CTRL;
+        event->ch = (char)('a' + c - 1);
+    } else if (c >= 32 && c <= 126) {
+        event->key = KEY_CHAR;
+        event->ch = (char)c;
+    }
+    return 1;
+}
+
+// 1 if the input buffer holds only the start of an escape sequence: a lone
+// ESC, or a CSI / SS3 sequence without its final byte
+static int escape_incomplete(void) {
+    if (input[0] != 0x1b) return 0;
+    if (input_len == 1) return 1;
+    if (input[1] != '[' && input[1] != 'O') return 0;
+    for (size_t i = 2; i < input_len; i++) {
+        if (input[i] >= 0x40 && input[i] <= 0x7e) return 0;
+    }
+    return 1;
+}
+
+static int posix_read_key(KeyEvent* event, int timeout_ms) {
+    // A resize is not a key; the next frame picks up the size
+    if (resized) {
+        resized = 0;
+        return 0;
+    }
+    for (;;) {
+        if (input_len > 0) {
+            // Give an incomplete escape sequence a moment to arrive
+            struct pollfd pfd = { in_fd, POLLIN, 0 };
+            int more = escape_incomplete() && poll(&pfd, 1, 25) > 0;
+            if (more) {
+                ssize_t n = read(in_fd, input + input_len, sizeof(input) - input_len);
+                if (n > 0) input_len += n;
+            }
+
+            size_t used = decode_key(event, more && input_len < sizeof(input));
+            if (used > 0) {
+                input_consume(used);
+                if (size_reported) {
+                    // Not a key; the next frame picks up the size
+                    size_reported = 0;
+                    return 0;
+                }
+                if (event->key == KEY_PASTE) {
+                    read_paste();
+                    event->text = paste;
+                    event->length = paste_len;
+                }
+                return 1;
+            }
+        }
+
+        struct pollfd pfd = { in_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0 && errno == EINTR) {
+            resized = 0;
+            return 0;
+        }
+        if (ready <= 0) return ready;
+
+        ssize_t n = read(in_fd, input + input_len, sizeof(input) - input_len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+        if (n <= 0) {
+            closed = 1;
+            return -1;
+        }
+        input_len += n;
+    }
+}
+
+const TermBackend posix_term = {
+    "posix",
+    posix_init,
+    posix_cleanup,
+    posix_get_size,
+    posix_flush,
+    posix_read_key
+};
+
+#endif // !_WIN32
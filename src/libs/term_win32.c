@@ -0,0 +1,164 @@
+#ifdef _WIN32
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <term.h>
+
+static HANDLE hStdOut;
+static HANDLE hStdIn;
+static DWORD originalConsoleMode;
+static CHAR_INFO* span;       // One row of cells being written
+static int span_cols;
+
+#define FOREGROUND_YELLOW (FOREGROUND_RED | FOREGROUND_GREEN)
+
+static WORD attr_colors[] = {
+    0,                                                  // ATTR_BLANK
+    FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_RED, // ATTR_TEXT: white
+    FOREGROUND_YELLOW,                                  // ATTR_MODE
+    BACKGROUND_RED | BACKGROUND_GREEN                   // ATTR_MATCH: black on yellow
+};
+
+static int win32_init(void) {
+    hStdOut = GetStdHandle(STD_OUTPUT_HANDLE);
+    hStdIn = GetStdHandle(STD_INPUT_HANDLE);
+    if (hStdOut == INVALID_HANDLE_VALUE || hStdIn == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Error getting console handles\n");
+        return 0;
+    }
+
+    // Save original console mode for later restoration
+    GetConsoleMode(hStdIn, &originalConsoleMode);
+
+    // hide cursor
+    CONSOLE_CURSOR_INFO cursor_info = {0};
+    cursor_info.dwSize = 1;
+    cursor_info.bVisible = 0;
+    SetConsoleCursorInfo(hStdOut, &cursor_info);
+
+    SetConsoleOutputCP(CP_UTF8);
+    return 1;
+}
+
+static void win32_cleanup(void) {
+    CONSOLE_CURSOR_INFO cursor_info = {0};
+    cursor_info.dwSize = 1;
+    cursor_info.bVisible = 1;
+    SetConsoleCursorInfo(hStdOut, &cursor_info);
+
+    SetConsoleMode(hStdIn, originalConsoleMode);
+    SetConsoleOutputCP(CP_OEMCP);
+
+    free(span);
+    span = NULL;
+    span_cols = 0;
+}
+
+static int win32_get_size(int* rows, int* cols) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if (!GetConsoleScreenBufferInfo(hStdOut, &csbi)) return 0;
+    *cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    *rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+    return 1;
+}
+
+// Write one rectangle per row span that differs from front
+static void win32_flush(const Cell* back, Cell* front, int rows, int cols,
+                        int cursor_row, int cursor_col, FlushStats* stats) {
+    if (span_cols < cols) {
+        CHAR_INFO* grown = realloc(span, cols * sizeof(CHAR_INFO));
+        if (!grown) return;
+        span = grown;
+        span_cols = cols;
+    }
+
+    stats->cells = 0;
+    stats->bytes = 0;
+    for (int y = 0; y < rows; y++) {
+        const Cell* back_row = back + y * cols;
+        Cell* front_row = front + y * cols;
+
+        int first = -1, last = -1;
+        for (int x = 0; x < cols; x++) {
+            if (back_row[x].ch != front_row[x].ch || back_row[x].attr != front_row[x].attr) {
+                if (first < 0) first = x;
+                last = x;
+            }
+        }
+        if (first < 0) continue;
+
+        int n = last - first + 1;
+        for (int i = 0; i < n; i++) {
+            span[i].Char.AsciiChar = back_row[first + i].ch;
+            span[i].Attributes = attr_colors[back_row[first + i].attr];
+            front_row[first + i] = back_row[first + i];
+        }
+
+        COORD span_size = { (SHORT)n, 1 };
+        COORD span_coord = { 0, 0 };
+        SMALL_RECT region = { (SHORT)first, (SHORT)y, (SHORT)last, (SHORT)y };
+        WriteConsoleOutputA(hStdOut, span, span_size, span_coord, &region);
+        stats->cells += n;
+        stats->bytes += n * sizeof(CHAR_INFO);
+    }
+
+    COORD coord = { (SHORT)cursor_col, (SHORT)cursor_row };
+    SetConsoleCursorPosition(hStdOut, coord);
+}
+
+static int win32_read_key(KeyEvent* event, int timeout_ms) {
+    INPUT_RECORD inputRecord;
+    DWORD eventsRead;
+
+    for (;;) {
+        DWORD waitResult = WaitForSingleObject(hStdIn, timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+        if (waitResult == WAIT_TIMEOUT) return 0;
+        if (waitResult != WAIT_OBJECT_0) return -1;
+
+        // Read input event from console
+        if (!ReadConsoleInput(hStdIn, &inputRecord, 1, &eventsRead) || eventsRead == 0) {
+            fprintf(stderr, "Input read error: %lu\n", GetLastError());
+            return -1;
+        }
+
+        // Process only key down events; skip key releases and the like
+        // without waiting again so a queued burst drains in one go
+        if (inputRecord.EventType == KEY_EVENT && inputRecord.Event.KeyEvent.bKeyDown) break;
+        timeout_ms = 0;
+    }
+
+    KEY_EVENT_RECORD keyEvent = inputRecord.Event.KeyEvent;
+    event->ch = keyEvent.uChar.AsciiChar;
+    event->text = NULL;
+    event->length = 0;
+    switch (keyEvent.wVirtualKeyCode) {
+        case VK_ESCAPE: event->key = KEY_ESCAPE; break;
+        case VK_RETURN: event->key = KEY_ENTER; break;
+        case VK_BACK:   event->key = KEY_BACKSPACE; break;
+        case VK_UP:     event->key = KEY_UP; break;
+        case VK_DOWN:   event->key = KEY_DOWN; break;
+        case VK_LEFT:   event->key = KEY_LEFT; break;
+        case VK_RIGHT:  event->key = KEY_RIGHT; break;
+        default:
+            if (event->ch >= 1 && event->ch <= 26) {
+                event->key = KEY_CTRL;
+                event->ch = (char)('a' + event->ch - 1);
+            } else {
+                event->key = event->ch >= 32 && event->ch <= 126 ? KEY_CHAR : KEY_NONE;
+            }
+            break;
+    }
+    return 1;
+}
+
+const TermBackend win32_term = {
+    "win32",
+    win32_init,
+    win32_cleanup,
+    win32_get_size,
+    win32_flush,
+    win32_read_key
+};
+
+#endif // _WIN32
@@ -0,0 +1,2247 @@
+#include <text.h>
+#include <clock.h>
+#include <lz.h>
+#include <scan.h>
+#include <thread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Size of an add buffer. Inserted text is appended to the newest add
+// buffer; a new one is started when it runs out of room so that existing
+// bytes never move. Larger inserts are spread over several, which keeps
+// each one a reasonable unit to compress.
+#define ADD_CHUNK_SIZE (256 * 1024)
+
+// Chunk slots preallocated by text_snapshot for the buffer to switch to
+// if it is cleared while the snapshot is live
+#define SNAPSHOT_SPARE_CHUNKS 4
+
+// Bytes of the original buffer indexed per work item in text_load_parallel
+#define INDEX_PART_SIZE (8 * 1024 * 1024)
+#define INDEX_MAX_THREADS 64
+
+// Bytes searched per step of a backward text_find, which walks windows
+// from the end because pieces can only be visited front to back
+#define FIND_WINDOW (1024 * 1024)
+
+// Interning: shorter lines are appended without a lookup, since a piece
+// node costs more than the bytes shared
+#define INTERN_MIN 32
+#define INTERN_MIN_SLOTS 1024
+
+struct PieceNode {
+    PieceNode* left;
+    PieceNode* right;
+    unsigned priority;    // Treap heap key
+    int chunk;            // Index into TextBuffer.chunks
+    size_t start;         // Offset of the piece inside its chunk
+    size_t length;        // Bytes in this piece
+    size_t lf;            // Newlines in this piece
+    size_t sub_length;    // Bytes in this subtree
+    size_t sub_lf;        // Newlines in this subtree
+};
+
+static unsigned next_priority(TextBuffer* buf) {
+    // xorshift32
+    unsigned x = buf->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf->seed = x;
+    return x;
+}
+
+static size_t sub_length(const PieceNode* n) {
+    return n ? n->sub_length : 0;
+}
+
+static size_t sub_lf(const PieceNode* n) {
+    return n ? n->sub_lf : 0;
+}
+
+static void update(PieceNode* n) {
+    n->sub_length = sub_length(n->left) + n->length + sub_length(n->right);
+    n->sub_lf = sub_lf(n->left) + n->lf + sub_lf(n->right);
+}
+
+// ---------------------------------------------------------------------------
+// Large-file paging
+//
+// Pages of the original buffer that have been read are kept in a list in
+// order of use; touching a page moves it to the front, and pages past the
+// budget fall off the back and are evicted. Substitute workers read through
+// the buffer concurrently, so the list is under a lock.
+
+#define PAGE_NONE ((size_t)-1)
+
+typedef struct {
+    size_t prev;
+    size_t next;
+    int resident;
+} PageLink;
+
+struct TextPager {
+    const char* data;
+    size_t length;
+    size_t budget;        // Pages kept resident, 0 = no limit
+    size_t resident;
+    PageLink* links;      // One per page
+    size_t head;          // Most recently used
+    size_t tail;          // Least recently used
+    TextReleaseFn evict;
+    void* ctx;
+    Mutex lock;
+};
+
+static size_t pager_budget_pages(size_t budget) {
+    if (budget == 0) return 0;
+    return budget > TEXT_PAGE_SIZE ? budget / TEXT_PAGE_SIZE : 1;
+}
+
+static TextPager* pager_create(TextBuffer* buf, const char* data, size_t length) {
+    TextPager* p = calloc(1, sizeof(TextPager));
+    size_t pages = (length + TEXT_PAGE_SIZE - 1) / TEXT_PAGE_SIZE;
+    if (p) p->links = calloc(pages, sizeof(PageLink));
+    if (!p || !p->links) {
+        free(p);
+        return NULL;
+    }
+    p->data = data;
+    p->length = length;
+    p->budget = pager_budget_pages(buf->page_budget);
+    p->head = PAGE_NONE;
+    p->tail = PAGE_NONE;
+    p->evict = buf->page_evict;
+    p->ctx = buf->page_evict_ctx;
+    mutex_init(&p->lock);
+    return p;
+}
+
+static void pager_free(TextPager* p) {
+    if (!p) return;
+    mutex_destroy(&p->lock);
+    free(p->links);
+    free(p);
+}
+
+static void pager_unlink(TextPager* p, size_t i) {
+    PageLink* l = &p->links[i];
+    if (l->prev != PAGE_NONE) p->links[l->prev].next = l->next;
+    else p->head = l->next;
+    if (l->next != PAGE_NONE) p->links[l->next].prev = l->prev;
+    else p->tail = l->prev;
+}
+
+// Evict from the back until the budget holds. Called with the lock held.
+static void pager_trim(TextPager* p) {
+    while (p->budget && p->resident > p->budget) {
+        size_t victim = p->tail;
+        pager_unlink(p, victim);
+        p->links[victim].resident = 0;
+        p->resident--;
+
+        size_t offset = victim * TEXT_PAGE_SIZE;
+        size_t length = p->length - offset < TEXT_PAGE_SIZE ? p->length - offset : TEXT_PAGE_SIZE;
+        p->evict((char*)p->data + offset, length, p->ctx);
+    }
+}
+
+// Note that the original's bytes [offset, offset + length) are being read
+static void pager_touch(TextPager* p, size_t offset, size_t length) {
+    if (length == 0) return;
+    size_t first = offset / TEXT_PAGE_SIZE;
+    size_t last = (offset + length - 1) / TEXT_PAGE_SIZE;
+
+    mutex_lock(&p->lock);
+    for (size_t i = first; i <= last; i++) {
+        PageLink* l = &p->links[i];
+        if (l->resident) {
+            if (p->head == i) continue;
+            pager_unlink(p, i);
+        } else {
+            l->resident = 1;
+            p->resident++;
+        }
+        l->prev = PAGE_NONE;
+        l->next = p->head;
+        if (p->head != PAGE_NONE) p->links[p->head].prev = i;
+        p->head = i;
+        if (p->tail == PAGE_NONE) p->tail = i;
+        pager_trim(p);
+    }
+    mutex_unlock(&p->lock);
+}
+
+// Touch a range of chunk c if it is the paged original
+static void page_in(TextBuffer* buf, const TextChunk* c, size_t offset, size_t length) {
+    if (buf->pager && c == &buf->chunks[0]) pager_touch(buf->pager, offset, length);
+}
+
+void text_set_paging(TextBuffer* buf, size_t budget, TextReleaseFn evict, void* ctx) {
+    buf->page_budget = evict ? budget : 0;
+    buf->page_evict = evict;
+    buf->page_evict_ctx = ctx;
+
+    TextPager* p = buf->pager;
+    if (p) {
+        mutex_lock(&p->lock);
+        p->budget = pager_budget_pages(budget);
+        pager_trim(p);
+        mutex_unlock(&p->lock);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Chunks and their line-start indexes
+
+static int chunk_push_line_start(TextChunk* c, size_t offset) {
+    if (c->line_count == c->line_cap) {
+        size_t cap = c->line_cap ? c->line_cap * 2 : 64;
+        size_t* starts = realloc(c->line_starts, cap * sizeof(size_t));
+        if (!starts) return 0;
+        c->line_starts = starts;
+        c->line_cap = cap;
+    }
+    c->line_starts[c->line_count++] = offset;
+    return 1;
+}
+
+// Record the line starts of data[from, to)
+static int chunk_index(TextChunk* c, size_t from, size_t to) {
+    return scan_index_lf(c->data + from, to - from, from,
+                         &c->line_starts, &c->line_count, &c->line_cap);
+}
+
+// Append line starts numbered first, first + 1, ... to a sparse index,
+// keeping every line_stride-th
+static int chunk_add_sparse(TextChunk* c, const size_t* starts, size_t count, size_t first) {
+    size_t skip = (c->line_stride - first % c->line_stride) % c->line_stride;
+    for (size_t i = skip; i < count; i += c->line_stride) {
+        if (!chunk_push_line_start(c, starts[i])) return 0;
+    }
+    return 1;
+}
+
+static void chunk_release(TextChunk* c) {
+    if (c->release) c->release(c->data, c->length, c->release_ctx);
+    else free(c->data);
+    if (c->index_release) c->index_release(c->index_data, c->index_length, c->index_ctx);
+    else free(c->line_starts);
+    free(c->packed);
+    memset(c, 0, sizeof(*c));
+}
+
+// Number of line starts <= value
+static size_t starts_upto(TextBuffer* buf, const TextChunk* c, size_t value) {
+    size_t lo = 0, hi = c->line_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->line_starts[mid] <= value) lo = mid + 1;
+        else hi = mid;
+    }
+    if (c->line_stride <= 1) return lo;
+
+    // Sparse: count the rest from the last indexed start
+    size_t from = c->line_starts[lo - 1];
+    page_in(buf, c, from, value - from);
+    return (lo - 1) * c->line_stride + 1 + scan_count_lf(c->data + from, value - from);
+}
+
+// Offset of line start k (start 0 being offset 0)
+static size_t chunk_line_start(TextBuffer* buf, const TextChunk* c, size_t k) {
+    if (c->line_stride <= 1) return c->line_starts[k];
+
+    size_t pos = c->line_starts[k / c->line_stride];
+    size_t from = pos;
+    for (size_t n = k % c->line_stride; n > 0; n--) {
+        const char* lf = memchr(c->data + pos, '\n', c->length - pos);
+        pos = lf - c->data + 1;
+    }
+    page_in(buf, c, from, pos - from);
+    return pos;
+}
+
+// Newlines in chunk bytes [start, end)
+static size_t chunk_count_lf(TextBuffer* buf, const TextChunk* c, size_t start, size_t end) {
+    return starts_upto(buf, c, end) - starts_upto(buf, c, start);
+}
+
+// Offset, relative to the piece start, just past the n-th (1-based) newline
+static size_t piece_newline_end(TextBuffer* buf, const PieceNode* n, size_t nth) {
+    const TextChunk* c = &buf->chunks[n->chunk];
+    return chunk_line_start(buf, c, starts_upto(buf, c, n->start) + nth - 1) - n->start;
+}
+
+// ---------------------------------------------------------------------------
+// Compressed add buffers
+//
+// Full add buffers are queued for the packer thread, which compresses them
+// in order; the compressed copy is kept for good. The plain bytes are then
+// dropped once they go PACK_COLD_TICKS ticks unread, and the least recently
+// read are dropped whenever more than PACK_RESIDENT_MAX bytes are inflated,
+// so a search through the whole document streams through memory instead of
+// inflating all of it. Readers pin a chunk while they use its bytes;
+// substitute workers read concurrently, so inflating, pins and the list of
+// inflated chunks are under the packer's lock. Nothing is dropped while a
+// snapshot is live, since its spans may point at the plain bytes.
+//
+// Add buffers are mapped rather than taken from the heap, so that dropping
+// one gives the memory back to the system at once.
+
+#define PACK_TICK_MS 1000
+#define PACK_COLD_TICKS 2
+#define PACK_RESIDENT_MAX (32 * 1024 * 1024)
+
+// A buffer is kept compressed only if that saves at least 1/PACK_MIN_SAVING
+#define PACK_MIN_SAVING 8
+
+#define PACK_NONE (-1)
+
+// Storage for one add buffer; pages are only backed once written
+static char* block_alloc(void) {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, ADD_CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* p = mmap(NULL, ADD_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static void block_free(char* data) {
+    if (!data) return;
+#ifdef _WIN32
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, ADD_CHUNK_SIZE);
+#endif
+}
+
+// TextReleaseFn for add buffers
+static void block_release(char* data, size_t length, void* ctx) {
+    (void)length;
+    (void)ctx;
+    block_free(data);
+}
+
+typedef struct {
+    int chunk;
+    const char* src;      // Plain bytes, which stay put until installed
+    size_t length;
+    char* packed;         // Result; NULL if it did not pay off
+    size_t packed_length;
+} PackJob;
+
+typedef struct {
+    int prev;
+    int next;
+} PackLink;
+
+struct TextPacker {
+    Thread thread;
+    Mutex lock;
+    Cond wake;
+    int stop;
+    PackJob* jobs;        // Queue: [0, finished) done, [finished, taken) in flight
+    size_t count;
+    size_t cap;
+    size_t taken;
+    size_t finished;
+    int next;             // First add buffer not queued yet
+    PackLink* links;      // By chunk: compressed chunks with their bytes in memory
+    int link_cap;
+    int head;             // Most recently read
+    int tail;             // Least recently read
+    size_t inflated;      // Plain bytes held by compressed chunks
+    unsigned tick;
+    double tick_ms;       // Time of the last tick
+};
+
+static void pack_worker(void* arg) {
+    TextPacker* p = arg;
+    mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && p->taken == p->count) cond_wait(&p->wake, &p->lock);
+        if (p->stop) break;
+        PackJob job = p->jobs[p->taken++];
+        mutex_unlock(&p->lock);
+
+        char* out = malloc(lz_bound(job.length));
+        size_t packed = out ? lz_compress(job.src, job.length, out) : 0;
+        if (out && packed > job.length - job.length / PACK_MIN_SAVING) {
+            free(out);
+            out = NULL;
+        } else if (out) {
+            char* shrunk = realloc(out, packed);
+            if (shrunk) out = shrunk;
+        }
+
+        // Jobs finish in order, so this one is at finished
+        mutex_lock(&p->lock);
+        p->jobs[p->finished].packed = out;
+        p->jobs[p->finished].packed_length = packed;
+        p->finished++;
+        cond_broadcast(&p->wake);
+    }
+    mutex_unlock(&p->lock);
+}
+
+// Wait for the job in flight and forget every chunk. Their bytes may go
+// away afterwards.
+static void pack_reset(TextPacker* p) {
+    mutex_lock(&p->lock);
+    while (p->finished < p->taken) cond_wait(&p->wake, &p->lock);
+    for (size_t i = 0; i < p->finished; i++) {
+        free(p->jobs[i].packed);
+    }
+    p->count = p->taken = p->finished = 0;
+    p->next = 1;
+    p->head = p->tail = PACK_NONE;
+    p->inflated = 0;
+    mutex_unlock(&p->lock);
+}
+
+static void pack_stop(TextPacker* p) {
+    if (!p) return;
+    pack_reset(p);
+    mutex_lock(&p->lock);
+    p->stop = 1;
+    cond_broadcast(&p->wake);
+    mutex_unlock(&p->lock);
+    thread_join(p->thread);
+    mutex_destroy(&p->lock);
+    cond_destroy(&p->wake);
+    free(p->jobs);
+    free(p->links);
+    free(p);
+}
+
+// Plain bytes of a compressed buffer; NULL if they cannot be had
+static char* pack_inflate(const char* packed, size_t packed_length, size_t length) {
+    char* data = block_alloc();
+    if (data && !lz_decompress(packed, packed_length, data, length)) {
+        block_free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+// The list of inflated chunks, most recently read first. Called with the
+// lock held, as are the functions below.
+static void pack_unlink(TextPacker* p, int i) {
+    PackLink* l = &p->links[i];
+    if (l->prev != PACK_NONE) p->links[l->prev].next = l->next;
+    else p->head = l->next;
+    if (l->next != PACK_NONE) p->links[l->next].prev = l->prev;
+    else p->tail = l->prev;
+}
+
+static void pack_link(TextPacker* p, int i, int front) {
+    PackLink* l = &p->links[i];
+    if (front) {
+        l->prev = PACK_NONE;
+        l->next = p->head;
+        if (p->head != PACK_NONE) p->links[p->head].prev = i;
+        p->head = i;
+        if (p->tail == PACK_NONE) p->tail = i;
+    } else {
+        l->next = PACK_NONE;
+        l->prev = p->tail;
+        if (p->tail != PACK_NONE) p->links[p->tail].next = i;
+        p->tail = i;
+        if (p->head == PACK_NONE) p->head = i;
+    }
+}
+
+static void pack_drop(TextBuffer* buf, TextPacker* p, int i) {
+    TextChunk* c = &buf->chunks[i];
+    pack_unlink(p, i);
+    block_free(c->data);
+    c->data = NULL;
+    p->inflated -= c->length;
+}
+
+// Drop from the back of the list until no more than PACK_RESIDENT_MAX
+// bytes are inflated, and with cold set also whatever has gone unread for
+// PACK_COLD_TICKS. Chunks being read are skipped.
+static void pack_trim(TextBuffer* buf, TextPacker* p, int cold) {
+    if (buf->snapshot) return;
+    int i = p->tail;
+    while (i != PACK_NONE) {
+        TextChunk* c = &buf->chunks[i];
+        int prev = p->links[i].prev;
+        int stale = cold && p->tick - c->used >= PACK_COLD_TICKS;
+        if (p->inflated <= PACK_RESIDENT_MAX && !stale) break;
+        if (!c->readers) pack_drop(buf, p, i);
+        i = prev;
+    }
+}
+
+// Bytes of chunk c for reading, inflated if they were dropped. Returns NULL
+// if that fails. Pair with chunk_unpin.
+static const char* chunk_pin(TextBuffer* buf, TextChunk* c) {
+    TextPacker* p = buf->packer;
+    if (!c->packed || !p) return c->data;
+
+    int i = (int)(c - buf->chunks);
+    mutex_lock(&p->lock);
+    if (!c->data) {
+        c->data = pack_inflate(c->packed, c->packed_length, c->length);
+        if (c->data) {
+            p->inflated += c->length;
+            pack_link(p, i, 1);
+        }
+    } else if (p->head != i) {
+        pack_unlink(p, i);
+        pack_link(p, i, 1);
+    }
+    const char* data = c->data;
+    if (data) {
+        c->readers++;
+        c->used = p->tick;
+    }
+    mutex_unlock(&p->lock);
+    return data;
+}
+
+static void chunk_unpin(TextBuffer* buf, TextChunk* c) {
+    TextPacker* p = buf->packer;
+    if (!c->packed || !p) return;
+
+    mutex_lock(&p->lock);
+    c->readers--;
+    if (p->inflated > PACK_RESIDENT_MAX) pack_trim(buf, p, 0);
+    mutex_unlock(&p->lock);
+}
+
+int text_set_compress(TextBuffer* buf, int on) {
+    TextPacker* p = buf->packer;
+    if (on) {
+        if (p) return 1;
+        p = calloc(1, sizeof(TextPacker));
+        if (!p) return 0;
+        mutex_init(&p->lock);
+        cond_init(&p->wake);
+        p->next = 1;
+        p->head = p->tail = PACK_NONE;
+        p->tick_ms = clock_ms();
+        if (!thread_create(&p->thread, pack_worker, p)) {
+            mutex_destroy(&p->lock);
+            cond_destroy(&p->wake);
+            free(p);
+            return 0;
+        }
+        buf->packer = p;
+        return 1;
+    }
+    if (!p) return 1;
+
+    // Bring everything back before letting the compressed copies go
+    for (int i = 1; i < buf->num_chunks; i++) {
+        TextChunk* c = &buf->chunks[i];
+        if (c->packed && !c->data) {
+            c->data = pack_inflate(c->packed, c->packed_length, c->length);
+            if (!c->data) return 0;
+            p->inflated += c->length;
+            pack_link(p, i, 1);
+        }
+    }
+    pack_stop(p);
+    buf->packer = NULL;
+
+    // A live snapshot may still read the copies; they go with the chunks
+    if (buf->snapshot) return 1;
+    for (int i = 1; i < buf->num_chunks; i++) {
+        TextChunk* c = &buf->chunks[i];
+        free(c->packed);
+        c->packed = NULL;
+        c->packed_length = 0;
+    }
+    return 1;
+}
+
+// Install a finished job. Returns 0 if there is no room to track the chunk.
+static int pack_install(TextBuffer* buf, TextPacker* p, const PackJob* job) {
+    if (!job->packed) return 1;
+    if (job->chunk >= p->link_cap) {
+        int cap = p->link_cap ? p->link_cap : 64;
+        while (cap <= job->chunk) cap *= 2;
+        PackLink* links = realloc(p->links, cap * sizeof(PackLink));
+        if (!links) return 0;
+        p->links = links;
+        p->link_cap = cap;
+    }
+
+    // Written rather than read, so the first to go
+    TextChunk* c = &buf->chunks[job->chunk];
+    c->packed = job->packed;
+    c->packed_length = job->packed_length;
+    c->used = p->tick - PACK_COLD_TICKS;
+    p->inflated += c->length;
+    pack_link(p, job->chunk, 0);
+    return 1;
+}
+
+// Install compressed copies, queue newly filled add buffers and drop the
+// plain bytes of compressed ones gone cold
+void text_pack_poll(TextBuffer* buf) {
+    TextPacker* p = buf->packer;
+    if (!p) return;
+
+    mutex_lock(&p->lock);
+    for (size_t i = 0; i < p->finished; i++) {
+        if (!pack_install(buf, p, &p->jobs[i])) free(p->jobs[i].packed);
+    }
+    if (p->finished) {
+        memmove(p->jobs, p->jobs + p->finished, (p->count - p->finished) * sizeof(PackJob));
+        p->count -= p->finished;
+        p->taken -= p->finished;
+        p->finished = 0;
+    }
+
+    // Every add buffer but the newest is full
+    int queued = 0;
+    for (; p->next < buf->num_chunks - 1; p->next++) {
+        if (p->count == p->cap) {
+            size_t cap = p->cap ? p->cap * 2 : 64;
+            PackJob* jobs = realloc(p->jobs, cap * sizeof(PackJob));
+            if (!jobs) break;
+            p->jobs = jobs;
+            p->cap = cap;
+        }
+        TextChunk* c = &buf->chunks[p->next];
+        if (c->packed) continue;
+        PackJob* job = &p->jobs[p->count++];
+        job->chunk = p->next;
+        job->src = c->data;
+        job->length = c->length;
+        job->packed = NULL;
+        queued = 1;
+    }
+    if (queued) cond_broadcast(&p->wake);
+
+    double now = clock_ms();
+    int cold = now - p->tick_ms >= PACK_TICK_MS;
+    if (cold) {
+        p->tick++;
+        p->tick_ms = now;
+    }
+    pack_trim(buf, p, cold);
+    mutex_unlock(&p->lock);
+}
+
+// 1 while add buffers are waiting to be compressed or installed
+int text_pack_pending(TextBuffer* buf) {
+    TextPacker* p = buf->packer;
+    if (!p) return 0;
+    mutex_lock(&p->lock);
+    int pending = p->count > 0 || p->next < buf->num_chunks - 1;
+    mutex_unlock(&p->lock);
+    return pending;
+}
+
+// ---------------------------------------------------------------------------
+// Piece tree
+
+// Nodes are carved from slabs that double in size up to NODE_SLAB_MAX, so a
+// heavily edited document costs a few dozen allocations rather than one per
+// piece, and dropping the whole tree frees the slabs without walking it.
+// Nodes released one at a time go on a free list for reuse.
+
+#define NODE_SLAB_MIN 64
+#define NODE_SLAB_MAX 65536
+
+struct NodeSlab {
+    NodeSlab* next;
+    size_t used;
+    size_t capacity;
+    PieceNode nodes[];
+};
+
+static PieceNode* node_alloc(TextBuffer* buf) {
+    PieceNode* n = buf->free_nodes;
+    if (n) {
+        buf->free_nodes = n->left;
+        return n;
+    }
+
+    NodeSlab* slab = buf->slabs;
+    if (!slab || slab->used == slab->capacity) {
+        size_t capacity = slab ? slab->capacity * 2 : NODE_SLAB_MIN;
+        if (capacity > NODE_SLAB_MAX) capacity = NODE_SLAB_MAX;
+        slab = malloc(sizeof(NodeSlab) + capacity * sizeof(PieceNode));
+        if (!slab) return NULL;
+        slab->next = buf->slabs;
+        slab->used = 0;
+        slab->capacity = capacity;
+        buf->slabs = slab;
+    }
+    return &slab->nodes[slab->used++];
+}
+
+static void node_release(TextBuffer* buf, PieceNode* n) {
+    if (!n) return;
+    n->left = buf->free_nodes;
+    buf->free_nodes = n;
+}
+
+// Drop every node at once
+static void node_release_all(TextBuffer* buf) {
+    while (buf->slabs) {
+        NodeSlab* next = buf->slabs->next;
+        free(buf->slabs);
+        buf->slabs = next;
+    }
+    buf->free_nodes = NULL;
+}
+
+static PieceNode* node_new(TextBuffer* buf, int chunk, size_t start, size_t length) {
+    PieceNode* n = node_alloc(buf);
+    if (!n) return NULL;
+    n->left = NULL;
+    n->right = NULL;
+    n->priority = next_priority(buf);
+    n->chunk = chunk;
+    n->start = start;
+    n->length = length;
+    n->lf = chunk_count_lf(buf, &buf->chunks[chunk], start, start + length);
+    update(n);
+    return n;
+}
+
+static void tree_free(TextBuffer* buf, PieceNode* n) {
+    while (n) {
+        PieceNode* right = n->right;
+        tree_free(buf, n->left);
+        node_release(buf, n);
+        n = right;
+    }
+}
+
+static PieceNode* tree_merge(PieceNode* a, PieceNode* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority >= b->priority) {
+        a->right = tree_merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = tree_merge(a, b->left);
+    update(b);
+    return b;
+}
+
+// Split t so that *l holds the first pos bytes and *r the rest. A piece
+// straddling pos is cut in two, using *spare for the tail so the split itself
+// cannot fail; *spare is cleared when it is consumed.
+static void tree_split(TextBuffer* buf, PieceNode* t, size_t pos,
+                       PieceNode** l, PieceNode** r, PieceNode** spare) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+
+    size_t left_len = sub_length(t->left);
+    if (pos <= left_len) {
+        PieceNode* rl;
+        tree_split(buf, t->left, pos, l, &rl, spare);
+        t->left = rl;
+        update(t);
+        *r = t;
+        return;
+    }
+    if (pos >= left_len + t->length) {
+        PieceNode* rr;
+        tree_split(buf, t->right, pos - left_len - t->length, &rr, r, spare);
+        t->right = rr;
+        update(t);
+        *l = t;
+        return;
+    }
+
+    // Cut inside this piece. The tail gets a priority of its own and is
+    // merged into the right subtree: reusing the head's priority would give
+    // every piece cut from one original the same priority, and a run of
+    // equal priorities merges into a list.
+    size_t k = pos - left_len;
+    PieceNode* tail = *spare;
+    *spare = NULL;
+    tail->left = NULL;
+    tail->right = NULL;
+    tail->priority = next_priority(buf);
+    tail->chunk = t->chunk;
+    tail->start = t->start + k;
+    tail->length = t->length - k;
+    tail->lf = chunk_count_lf(buf, &buf->chunks[t->chunk], tail->start, tail->start + tail->length);
+    update(tail);
+
+    PieceNode* right = t->right;
+    t->length = k;
+    t->lf -= tail->lf;
+    t->right = NULL;
+    update(t);
+
+    *l = t;
+    *r = tree_merge(tail, right);
+}
+
+// Visit document bytes [from, to) of subtree t, which starts at doc offset base
+static int tree_visit(TextBuffer* buf, PieceNode* t, size_t base, size_t from, size_t to,
+                      TextChunkFn fn, void* ctx) {
+    while (t && from < to) {
+        size_t node_start = base + sub_length(t->left);
+        size_t node_end = node_start + t->length;
+
+        if (from < node_start) {
+            if (!tree_visit(buf, t->left, base, from, to, fn, ctx)) return 0;
+        }
+
+        size_t a = from > node_start ? from : node_start;
+        size_t b = to < node_end ? to : node_end;
+        if (a < b) {
+            TextChunk* c = &buf->chunks[t->chunk];
+            const char* data = chunk_pin(buf, c);
+            if (!data) return 0;
+            int more = fn(data + t->start + (a - node_start), b - a, ctx);
+            chunk_unpin(buf, c);
+            if (!more) return 0;
+        }
+
+        if (to <= node_end) break;
+        base = node_end;
+        t = t->right;
+    }
+    return 1;
+}
+
+// A visit that touches each page of the original before handing it out
+typedef struct {
+    TextBuffer* buf;
+    TextChunkFn fn;
+    void* ctx;
+} PagedVisit;
+
+static int paged_span(const char* data, size_t length, void* ctx) {
+    PagedVisit* pv = ctx;
+    const TextChunk* c = &pv->buf->chunks[0];
+    if (data < c->data || data >= c->data + c->length) return pv->fn(data, length, pv->ctx);
+
+    size_t pos = data - c->data;
+    size_t end = pos + length;
+    while (pos < end) {
+        size_t next = (pos / TEXT_PAGE_SIZE + 1) * TEXT_PAGE_SIZE;
+        if (next > end) next = end;
+        pager_touch(pv->buf->pager, pos, next - pos);
+        if (!pv->fn(c->data + pos, next - pos, pv->ctx)) return 0;
+        pos = next;
+    }
+    return 1;
+}
+
+// Visit document bytes [from, to) for reading
+static int visit_range(TextBuffer* buf, size_t from, size_t to, TextChunkFn fn, void* ctx) {
+    if (!buf->pager) return tree_visit(buf, buf->root, 0, from, to, fn, ctx);
+    PagedVisit pv = { buf, fn, ctx };
+    return tree_visit(buf, buf->root, 0, from, to, paged_span, &pv);
+}
+
+// ---------------------------------------------------------------------------
+// Parallel line indexing
+//
+// text_load_parallel splits the original buffer into parts that a pool of
+// workers indexes independently. Finished parts are stitched onto the
+// chunk's line_starts strictly in order, so part i lands at the prefix sum of
+// the newline counts before it. Until every part is in, the piece tree covers
+// only the stitched prefix (up to its last newline): the first screen can be
+// drawn as soon as part 0 is done, and anything that edits or reads by
+// document offset waits for the rest.
+
+typedef struct {
+    size_t* starts;
+    size_t count;
+    size_t cap;
+    int state;            // 0: pending, 1: done, -1: failed
+} IndexPart;
+
+struct TextIndexer {
+    const char* data;
+    size_t length;        // Bytes in the original buffer
+    size_t text_length;   // Piece length once fully indexed
+    IndexPart* parts;
+    size_t num_parts;
+    size_t next_part;     // Next part handed to a worker
+    size_t stitched;      // Parts appended to line_starts
+    size_t lines;         // Line starts stitched, counting the one at 0
+    size_t last_start;    // Offset of the last of them
+    TextReleaseFn evict;  // Drops each part once scanned, in large-file mode
+    void* evict_ctx;
+    int cancel;
+    Mutex lock;
+    Cond done;
+    Thread threads[INDEX_MAX_THREADS];
+    int num_threads;
+};
+
+static void index_worker(void* arg) {
+    TextIndexer* ix = arg;
+
+    mutex_lock(&ix->lock);
+    while (!ix->cancel && ix->next_part < ix->num_parts) {
+        size_t i = ix->next_part++;
+        mutex_unlock(&ix->lock);
+
+        IndexPart* part = &ix->parts[i];
+        size_t begin = i * INDEX_PART_SIZE;
+        size_t end = begin + INDEX_PART_SIZE < ix->length ? begin + INDEX_PART_SIZE : ix->length;
+        int ok = scan_index_lf(ix->data + begin, end - begin, begin,
+                               &part->starts, &part->count, &part->cap);
+        if (ix->evict) ix->evict((char*)ix->data + begin, end - begin, ix->evict_ctx);
+
+        mutex_lock(&ix->lock);
+        part->state = ok ? 1 : -1;
+        cond_broadcast(&ix->done);
+    }
+    mutex_unlock(&ix->lock);
+}
+
+// Join the workers and drop the indexer
+static void index_stop(TextBuffer* buf) {
+    TextIndexer* ix = buf->indexer;
+    if (!ix) return;
+
+    mutex_lock(&ix->lock);
+    ix->cancel = 1;
+    mutex_unlock(&ix->lock);
+    for (int i = 0; i < ix->num_threads; i++) {
+        thread_join(ix->threads[i]);
+    }
+
+    for (size_t i = 0; i < ix->num_parts; i++) {
+        free(ix->parts[i].starts);
+    }
+    free(ix->parts);
+    mutex_destroy(&ix->lock);
+    cond_destroy(&ix->done);
+    free(ix);
+    buf->indexer = NULL;
+}
+
+// Append finished parts to line_starts, in order. With block set, waits
+// until all parts are in. Returns 1 if any part was stitched.
+static int index_stitch(TextBuffer* buf, int block) {
+    TextIndexer* ix = buf->indexer;
+    TextChunk* c = &buf->chunks[0];
+    int progress = 0;
+    int failed = 0;
+
+    mutex_lock(&ix->lock);
+    while (ix->stitched < ix->num_parts && !failed) {
+        IndexPart* part = &ix->parts[ix->stitched];
+        if (part->state == 0) {
+            if (!block) break;
+            cond_wait(&ix->done, &ix->lock);
+            continue;
+        }
+
+        if (part->state < 0) {
+            failed = 1;
+            break;
+        }
+        if (c->line_stride > 1) {
+            if (!chunk_add_sparse(c, part->starts, part->count, ix->lines)) {
+                failed = 1;
+                break;
+            }
+        } else {
+            if (c->line_count + part->count > c->line_cap) {
+                // Size for the whole file from the density seen so far
+                size_t cap = c->line_cap * 2;
+                size_t estimate = (c->line_count + part->count) / (ix->stitched + 1) * ix->num_parts;
+                if (cap < estimate + estimate / 8) cap = estimate + estimate / 8;
+                if (cap < c->line_count + part->count) cap = c->line_count + part->count;
+                size_t* starts = realloc(c->line_starts, cap * sizeof(size_t));
+                if (!starts) {
+                    failed = 1;
+                    break;
+                }
+                c->line_starts = starts;
+                c->line_cap = cap;
+            }
+            memcpy(c->line_starts + c->line_count, part->starts, part->count * sizeof(size_t));
+            c->line_count += part->count;
+        }
+        ix->lines += part->count;
+        if (part->count > 0) ix->last_start = part->starts[part->count - 1];
+        free(part->starts);
+        part->starts = NULL;
+        ix->stitched++;
+        progress = 1;
+    }
+    int complete = ix->stitched == ix->num_parts;
+    mutex_unlock(&ix->lock);
+
+    // Show the stitched prefix up to its last newline, or everything
+    size_t covered = ix->text_length;
+    if (!complete) {
+        covered = ix->last_start;
+        if (covered > 0) covered--;
+    }
+    if (progress && covered != sub_length(buf->root)) {
+        PieceNode* root = covered ? node_new(buf, 0, 0, covered) : NULL;
+        if (root || !covered) {
+            tree_free(buf, buf->root);
+            buf->root = root;
+        }
+    }
+
+    if (failed) {
+        fprintf(stderr, "Line indexing failed; showing the first %zu bytes\n", covered);
+    }
+    if (complete || failed) index_stop(buf);
+    return progress;
+}
+
+// Stitch whatever the workers have finished. Returns 1 if the text grew.
+int text_index_poll(TextBuffer* buf) {
+    if (!buf->indexer) return 0;
+    return index_stitch(buf, 0);
+}
+
+// Block until the whole original buffer is indexed
+void text_index_wait(TextBuffer* buf) {
+    if (buf->indexer) index_stitch(buf, 1);
+}
+
+// Percentage of the original buffer indexed, or -1 if not indexing
+int text_index_progress(TextBuffer* buf) {
+    TextIndexer* ix = buf->indexer;
+    if (!ix) return -1;
+    return (int)(ix->stitched * 100 / ix->num_parts);
+}
+
+// ---------------------------------------------------------------------------
+// Interning
+//
+// Most lines of a log are unique, so a line's first insertion only leaves a
+// 32-bit fingerprint in a set. A line whose fingerprint is already there is
+// looked up in a hash table of lines inserted more than once, which maps it
+// to where a copy lives in an add buffer; if none is found this copy is
+// appended and recorded for the next time. Both tables only grow until the
+// buffer is cleared, which empties them along with the add buffers.
+
+typedef struct {
+    uint64_t hash;        // 0 marks an empty slot
+    int chunk;
+    size_t start;
+    size_t length;
+} InternSlot;
+
+struct InternTable {
+    uint32_t* seen;       // Fingerprints of lines inserted so far, 0 = empty
+    size_t seen_count;
+    size_t seen_cap;      // Power of two
+    InternSlot* slots;    // Copies of lines inserted more than once
+    size_t count;
+    size_t capacity;      // Power of two
+};
+
+static uint64_t intern_hash(const char* text, size_t length) {
+    // Eight bytes per step, then a final avalanche; 0 is reserved
+    uint64_t h = length * 0x9E3779B97F4A7C15ull;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t w;
+        memcpy(&w, text + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, text + i, length - i);
+    h = (h ^ tail) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 29;
+    return h ? h : 1;
+}
+
+static InternTable* intern_create(void) {
+    InternTable* t = calloc(1, sizeof(InternTable));
+    if (!t) return NULL;
+    t->seen = calloc(INTERN_MIN_SLOTS, sizeof(uint32_t));
+    t->slots = calloc(INTERN_MIN_SLOTS, sizeof(InternSlot));
+    if (!t->seen || !t->slots) {
+        free(t->seen);
+        free(t->slots);
+        free(t);
+        return NULL;
+    }
+    t->seen_cap = INTERN_MIN_SLOTS;
+    t->capacity = INTERN_MIN_SLOTS;
+    return t;
+}
+
+static void intern_free(InternTable* t) {
+    if (!t) return;
+    free(t->seen);
+    free(t->slots);
+    free(t);
+}
+
+static void intern_reset(InternTable* t) {
+    if (!t) return;
+    memset(t->seen, 0, t->seen_cap * sizeof(uint32_t));
+    memset(t->slots, 0, t->capacity * sizeof(InternSlot));
+    t->seen_count = 0;
+    t->count = 0;
+}
+
+// Add a line's fingerprint to the seen set; returns 1 if it was there
+// already. A set that cannot grow reports every line as new.
+static int intern_seen(InternTable* t, uint64_t hash) {
+    uint32_t f = (uint32_t)(hash >> 32);
+    if (!f) f = 1;
+    if ((t->seen_count + 1) * 2 > t->seen_cap) {
+        size_t cap = t->seen_cap * 2;
+        uint32_t* seen = calloc(cap, sizeof(uint32_t));
+        if (!seen) return 0;
+        for (size_t i = 0; i < t->seen_cap; i++) {
+            if (!t->seen[i]) continue;
+            size_t j = t->seen[i] & (cap - 1);
+            while (seen[j]) j = (j + 1) & (cap - 1);
+            seen[j] = t->seen[i];
+        }
+        free(t->seen);
+        t->seen = seen;
+        t->seen_cap = cap;
+    }
+
+    size_t i = f & (t->seen_cap - 1);
+    for (; t->seen[i]; i = (i + 1) & (t->seen_cap - 1)) {
+        if (t->seen[i] == f) return 1;
+    }
+    t->seen[i] = f;
+    t->seen_count++;
+    return 0;
+}
+
+// Find a copy of text; returns its slot or NULL
+static const InternSlot* intern_find(TextBuffer* buf, uint64_t hash, const char* text, size_t length) {
+    InternTable* t = buf->interned;
+    for (size_t i = hash & (t->capacity - 1); t->slots[i].hash; i = (i + 1) & (t->capacity - 1)) {
+        const InternSlot* s = &t->slots[i];
+        if (s->hash != hash || s->length != length) continue;
+        TextChunk* c = &buf->chunks[s->chunk];
+        const char* data = chunk_pin(buf, c);
+        if (!data) continue;
+        int same = memcmp(data + s->start, text, length) == 0;
+        chunk_unpin(buf, c);
+        if (same) return s;
+    }
+    return NULL;
+}
+
+// Record a copy; a table that cannot grow just stops learning lines
+static void intern_add(InternTable* t, uint64_t hash, int chunk, size_t start, size_t length) {
+    if ((t->count + 1) * 2 > t->capacity) {
+        size_t capacity = t->capacity * 2;
+        InternSlot* slots = calloc(capacity, sizeof(InternSlot));
+        if (!slots) return;
+        for (size_t i = 0; i < t->capacity; i++) {
+            if (!t->slots[i].hash) continue;
+            size_t j = t->slots[i].hash & (capacity - 1);
+            while (slots[j].hash) j = (j + 1) & (capacity - 1);
+            slots[j] = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->capacity = capacity;
+    }
+
+    size_t i = hash & (t->capacity - 1);
+    while (t->slots[i].hash) i = (i + 1) & (t->capacity - 1);
+    t->slots[i].hash = hash;
+    t->slots[i].chunk = chunk;
+    t->slots[i].start = start;
+    t->slots[i].length = length;
+    t->count++;
+}
+
+int text_set_intern(TextBuffer* buf, int on) {
+    if (!on) {
+        intern_free(buf->interned);
+        buf->interned = NULL;
+        return 1;
+    }
+    if (!buf->interned) buf->interned = intern_create();
+    return buf->interned != NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Lifetime
+
+TextBuffer* text_create(void) {
+    TextBuffer* buf = calloc(1, sizeof(TextBuffer));
+    if (!buf) return NULL;
+
+    buf->chunk_cap = SNAPSHOT_SPARE_CHUNKS;
+    buf->chunks = calloc(buf->chunk_cap, sizeof(TextChunk));
+    if (!buf->chunks || !chunk_push_line_start(&buf->chunks[0], 0)) {
+        free(buf->chunks);
+        free(buf);
+        return NULL;
+    }
+    buf->num_chunks = 1;
+    buf->seed = 2463534242u;
+    return buf;
+}
+
+void text_free(TextBuffer* buf) {
+    if (!buf) return;
+    text_clear(buf);
+    intern_free(buf->interned);
+    pack_stop(buf->packer);
+    chunk_release(&buf->chunks[0]);
+    free(buf->line.data);
+    free(buf->chunks);
+    free(buf);
+}
+
+// Drop all text, leaving a single empty line
+void text_clear(TextBuffer* buf) {
+    index_stop(buf);
+    if (buf->packer) pack_reset(buf->packer);
+    pager_free(buf->pager);
+    buf->pager = NULL;
+    node_release_all(buf);
+    buf->root = NULL;
+
+    TextSnapshot* snap = buf->snapshot;
+    if (snap) {
+        // A reader may still be using the chunks; let the snapshot own them
+        snap->chunks = buf->chunks;
+        snap->num_chunks = buf->num_chunks;
+        snap->owner = NULL;
+        buf->chunks = snap->spare;
+        buf->chunk_cap = SNAPSHOT_SPARE_CHUNKS;
+        snap->spare = NULL;
+        buf->snapshot = NULL;
+    } else {
+        for (int i = 0; i < buf->num_chunks; i++) {
+            chunk_release(&buf->chunks[i]);
+        }
+    }
+    buf->num_chunks = 1;
+    chunk_push_line_start(&buf->chunks[0], 0);
+    intern_reset(buf->interned);
+    buf->changes = 0;
+
+    // Keep the edit line's storage for reuse
+    buf->line_active = 0;
+    buf->line_dirty = 0;
+}
+
+// Enter large-file mode for the original just placed in chunk 0, if a
+// budget is set. Without memory for the page list it loads as usual.
+static void paging_start(TextBuffer* buf) {
+    TextChunk* c = &buf->chunks[0];
+    if (!buf->page_budget || c->length == 0) return;
+    buf->pager = pager_create(buf, c->data, c->length);
+    if (buf->pager) c->line_stride = TEXT_LINE_STRIDE;
+}
+
+// Build the sparse index of a paged original a part at a time, dropping
+// each part's pages once it is scanned
+static int chunk_index_sparse(TextBuffer* buf, TextChunk* c) {
+    size_t* starts = NULL;
+    size_t cap = 0;
+    size_t lines = 1;
+    for (size_t begin = 0; begin < c->length; begin += INDEX_PART_SIZE) {
+        size_t end = c->length - begin > INDEX_PART_SIZE ? begin + INDEX_PART_SIZE : c->length;
+        size_t count = 0;
+        if (!scan_index_lf(c->data + begin, end - begin, begin, &starts, &count, &cap) ||
+            !chunk_add_sparse(c, starts, count, lines)) {
+            free(starts);
+            return 0;
+        }
+        lines += count;
+        buf->page_evict(c->data + begin, end - begin, buf->page_evict_ctx);
+    }
+    free(starts);
+    return 1;
+}
+
+// Make data the original buffer. The buffer owns it from then on and gives
+// it back through release (or free() if release is NULL); on failure the
+// caller keeps ownership. A trailing newline terminates the last line rather
+// than starting an empty one.
+int text_load_memory(TextBuffer* buf, char* data, size_t length,
+                     TextReleaseFn release, void* release_ctx) {
+    text_clear(buf);
+
+    TextChunk* c = &buf->chunks[0];
+    c->data = data;
+    c->length = length;
+    c->capacity = length;
+    paging_start(buf);
+    if (!(buf->pager ? chunk_index_sparse(buf, c) : chunk_index(c, 0, length))) goto fail;
+
+    if (length > 0 && data[length - 1] == '\n') length--;
+    if (length > 0) {
+        buf->root = node_new(buf, 0, 0, length);
+        if (!buf->root) goto fail;
+    }
+
+    c->release = release;
+    c->release_ctx = release_ctx;
+    return 1;
+
+fail:
+    c->data = NULL;
+    text_clear(buf);
+    return 0;
+}
+
+// The line starts fit data: they start at 0, go up strictly, stay within
+// data and each but the first follows a '\n'. A damaged index would
+// otherwise put edits in the wrong place. One pass over the starts; in
+// large-file mode the pages it reads are dropped again as it goes.
+static int index_fits(TextBuffer* buf, const char* data, size_t length,
+                      const size_t* starts, size_t count) {
+    if (count == 0 || starts[0] != 0) return 0;
+    size_t dropped = 0;
+    for (size_t i = 1; i < count; i++) {
+        if (starts[i] <= starts[i - 1] || starts[i] > length || data[starts[i] - 1] != '\n') {
+            return 0;
+        }
+        if (buf->pager && starts[i] - dropped > INDEX_PART_SIZE) {
+            size_t to = (starts[i] - 1) / TEXT_PAGE_SIZE * TEXT_PAGE_SIZE;
+            buf->page_evict((char*)data + dropped, to - dropped, buf->page_evict_ctx);
+            dropped = to;
+        }
+    }
+    if (buf->pager) buf->page_evict((char*)data + dropped, length - dropped, buf->page_evict_ctx);
+    return 1;
+}
+
+int text_load_indexed(TextBuffer* buf, char* data, size_t length,
+                      TextReleaseFn release, void* release_ctx, const TextLineIndex* index) {
+    text_clear(buf);
+
+    TextChunk* c = &buf->chunks[0];
+    c->data = data;
+    c->length = length;
+    c->capacity = length;
+    paging_start(buf);
+    size_t stride = c->line_stride > 1 ? c->line_stride : 1;
+    if (index->stride != stride || !index_fits(buf, data, length, index->starts, index->count)) {
+        goto fail;
+    }
+
+    size_t* heap_starts = c->line_starts;
+    c->line_starts = index->starts;
+    c->line_count = c->line_cap = index->count;
+    if (length > 0 && data[length - 1] == '\n') length--;
+    if (length > 0) {
+        buf->root = node_new(buf, 0, 0, length);
+        if (!buf->root) {
+            c->line_starts = heap_starts;
+            c->line_count = c->line_cap = 0;
+            goto fail;
+        }
+    }
+    free(heap_starts);
+
+    c->index_data = index->data;
+    c->index_length = index->length;
+    c->index_release = index->release;
+    c->index_ctx = index->release_ctx;
+    c->release = release;
+    c->release_ctx = release_ctx;
+    return 1;
+
+fail:
+    c->data = NULL;
+    text_clear(buf);
+    return 0;
+}
+
+int text_line_index(TextBuffer* buf, TextLineIndex* index) {
+    TextChunk* c = &buf->chunks[0];
+    if (buf->indexer || !c->data) return 0;
+    memset(index, 0, sizeof(*index));
+    index->starts = c->line_starts;
+    index->count = c->line_count;
+    index->stride = c->line_stride > 1 ? c->line_stride : 1;
+    return 1;
+}
+
+// Like text_load_memory, but index the original buffer on up to threads
+// workers (0: one per CPU). Returns once the first part is indexed; the rest
+// completes in the background (see text_index_poll).
+int text_load_parallel(TextBuffer* buf, char* data, size_t length,
+                       TextReleaseFn release, void* release_ctx, int threads) {
+    if (threads <= 0) threads = thread_cpu_count();
+    if (threads > INDEX_MAX_THREADS) threads = INDEX_MAX_THREADS;
+    if (threads <= 1 || length < 2 * INDEX_PART_SIZE) {
+        return text_load_memory(buf, data, length, release, release_ctx);
+    }
+
+    text_clear(buf);
+
+    TextIndexer* ix = calloc(1, sizeof(TextIndexer));
+    if (!ix) return 0;
+    ix->data = data;
+    ix->length = length;
+    ix->text_length = data[length - 1] == '\n' ? length - 1 : length;
+    ix->num_parts = (length + INDEX_PART_SIZE - 1) / INDEX_PART_SIZE;
+    ix->parts = calloc(ix->num_parts, sizeof(IndexPart));
+    if (!ix->parts) {
+        free(ix);
+        return 0;
+    }
+    mutex_init(&ix->lock);
+    cond_init(&ix->done);
+
+    TextChunk* c = &buf->chunks[0];
+    c->data = data;
+    c->length = length;
+    c->capacity = length;
+    c->release = release;
+    c->release_ctx = release_ctx;
+    buf->indexer = ix;
+    paging_start(buf);
+    ix->lines = 1;
+    if (buf->pager) {
+        ix->evict = buf->page_evict;
+        ix->evict_ctx = buf->page_evict_ctx;
+    }
+
+    if ((size_t)threads > ix->num_parts) threads = (int)ix->num_parts;
+    for (int i = 0; i < threads; i++) {
+        if (!thread_create(&ix->threads[ix->num_threads], index_worker, ix)) break;
+        ix->num_threads++;
+    }
+    if (ix->num_threads == 0) index_worker(ix);
+
+    // Wait for the first part so there is something to show
+    mutex_lock(&ix->lock);
+    while (ix->parts[0].state == 0) cond_wait(&ix->done, &ix->lock);
+    mutex_unlock(&ix->lock);
+    index_stitch(buf, 0);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Piece tree queries. These see the tree only, i.e. the edit line as it was
+// when it was opened.
+
+// Document offset of the first byte of row (clamped to the last line)
+static size_t tree_line_start(TextBuffer* buf, size_t row) {
+    if (row == 0) return 0;
+    if (row > sub_lf(buf->root)) row = sub_lf(buf->root);
+
+    PieceNode* t = buf->root;
+    size_t offset = 0;
+    while (t) {
+        size_t left_lf = sub_lf(t->left);
+        if (row <= left_lf) {
+            t = t->left;
+            continue;
+        }
+        row -= left_lf;
+        offset += sub_length(t->left);
+        if (row <= t->lf) {
+            return offset + piece_newline_end(buf, t, row);
+        }
+        row -= t->lf;
+        offset += t->length;
+        t = t->right;
+    }
+    return offset;
+}
+
+static size_t tree_line_length(TextBuffer* buf, size_t row) {
+    size_t start = tree_line_start(buf, row);
+    if (row < sub_lf(buf->root)) {
+        return tree_line_start(buf, row + 1) - 1 - start;
+    }
+    return sub_length(buf->root) - start;
+}
+
+typedef struct {
+    char* dst;
+    size_t copied;
+} ReadCtx;
+
+static int read_chunk(const char* data, size_t length, void* ctx) {
+    ReadCtx* rc = ctx;
+    memcpy(rc->dst + rc->copied, data, length);
+    rc->copied += length;
+    return 1;
+}
+
+static size_t tree_read(TextBuffer* buf, size_t offset, char* dst, size_t length) {
+    ReadCtx rc = { dst, 0 };
+    visit_range(buf, offset, offset + length, read_chunk, &rc);
+    return rc.copied;
+}
+
+// Append up to ADD_CHUNK_SIZE bytes of text to the newest add buffer,
+// starting a new one if it is full. Returns the bytes appended, 0 on failure.
+static size_t append_text(TextBuffer* buf, const char* text, size_t length, int* chunk, size_t* start) {
+    TextChunk* c = buf->num_chunks > 1 ? &buf->chunks[buf->num_chunks - 1] : NULL;
+    if (length > ADD_CHUNK_SIZE) length = ADD_CHUNK_SIZE;
+
+    if (!c || c->capacity - c->length < length) {
+        if (buf->num_chunks == buf->chunk_cap) {
+            int cap = buf->chunk_cap * 2;
+            TextChunk* chunks = realloc(buf->chunks, cap * sizeof(TextChunk));
+            if (!chunks) return 0;
+            buf->chunks = chunks;
+            buf->chunk_cap = cap;
+        }
+
+        c = &buf->chunks[buf->num_chunks];
+        memset(c, 0, sizeof(*c));
+        c->capacity = ADD_CHUNK_SIZE;
+        c->data = block_alloc();
+        c->release = block_release;
+        if (!c->data || !chunk_push_line_start(c, 0)) {
+            chunk_release(c);
+            return 0;
+        }
+        buf->num_chunks++;
+    }
+
+    *chunk = (int)(c - buf->chunks);
+    *start = c->length;
+    memcpy(c->data + c->length, text, length);
+    c->length += length;
+    return chunk_index(c, *start, c->length) ? length : 0;
+}
+
+// A run of inserted text that is contiguous in one chunk
+typedef struct {
+    int chunk;
+    size_t start;
+    size_t length;
+} AddRun;
+
+// Runs of one insert. Most inserts are a single run, held in one.
+typedef struct {
+    AddRun* runs;
+    size_t count;
+    size_t cap;
+    AddRun one;
+} RunList;
+
+// Add a run, extending the last one if it continues where that ends
+static int run_push(RunList* list, int chunk, size_t start, size_t length) {
+    AddRun* last = list->count ? &list->runs[list->count - 1] : NULL;
+    if (last && last->chunk == chunk && last->start + last->length == start) {
+        last->length += length;
+        return 1;
+    }
+    if (list->count == list->cap) {
+        size_t cap = list->cap * 2;
+        AddRun* r = list->runs != &list->one ? realloc(list->runs, cap * sizeof(AddRun))
+                                             : malloc(cap * sizeof(AddRun));
+        if (!r) return 0;
+        if (list->runs == &list->one) r[0] = list->one;
+        list->runs = r;
+        list->cap = cap;
+    }
+    AddRun* run = &list->runs[list->count++];
+    run->chunk = chunk;
+    run->start = start;
+    run->length = length;
+    return 1;
+}
+
+// Append text, over as many add buffers as it takes
+static int append_runs(TextBuffer* buf, const char* text, size_t length, RunList* list) {
+    while (length > 0) {
+        int chunk;
+        size_t start;
+        size_t n = append_text(buf, text, length, &chunk, &start);
+        if (!n || !run_push(list, chunk, start, n)) return 0;
+        text += n;
+        length -= n;
+    }
+    return 1;
+}
+
+// Place text line by line, reusing copies of lines seen before and
+// appending the rest. Adjacent placements are merged, so the result is a
+// handful of runs unless the text alternates between new and repeated lines.
+static int intern_place(TextBuffer* buf, const char* text, size_t length, RunList* list) {
+    size_t pos = 0;
+    while (pos < length) {
+        const char* lf = memchr(text + pos, '\n', length - pos);
+        size_t seg = lf ? (size_t)(lf - text) + 1 - pos : length - pos;
+
+        const InternSlot* found = NULL;
+        uint64_t hash = 0;
+        int repeated = 0;
+        if (seg >= INTERN_MIN && seg <= ADD_CHUNK_SIZE) {
+            hash = intern_hash(text + pos, seg);
+            repeated = intern_seen(buf->interned, hash);
+            if (repeated) found = intern_find(buf, hash, text + pos, seg);
+        }
+        if (found) {
+            if (!run_push(list, found->chunk, found->start, seg)) return 0;
+        } else {
+            if (!append_runs(buf, text + pos, seg, list)) return 0;
+            // A line that fits an add buffer is never split, so it ends the last run
+            const AddRun* last = &list->runs[list->count - 1];
+            if (repeated) intern_add(buf->interned, hash, last->chunk, last->start + last->length - seg, seg);
+        }
+        pos += seg;
+    }
+    return 1;
+}
+
+static int tree_insert(TextBuffer* buf, size_t offset, const char* text, size_t length) {
+    RunList list = { NULL, 0, 1, { 0, 0, 0 } };
+    list.runs = &list.one;
+    int ok = buf->interned ? intern_place(buf, text, length, &list)
+                           : append_runs(buf, text, length, &list);
+    AddRun* runs = list.runs;
+    size_t count = list.count;
+
+    // Allocate every node before touching the tree so that failure leaves
+    // the document as it was
+    PieceNode* nodes = NULL;
+    PieceNode* spare = ok ? node_alloc(buf) : NULL;
+    ok = spare != NULL;
+    for (size_t i = 0; ok && i < count; i++) {
+        PieceNode* node = node_new(buf, runs[i].chunk, runs[i].start, runs[i].length);
+        if (!node) {
+            ok = 0;
+            break;
+        }
+        node->right = nodes;
+        nodes = node;
+    }
+
+    if (ok) {
+        // The list is in reverse; merge it back to front
+        PieceNode *l, *r, *mid = NULL;
+        tree_split(buf, buf->root, offset, &l, &r, &spare);
+        while (nodes) {
+            PieceNode* next = nodes->right;
+            nodes->right = NULL;
+            update(nodes);
+            mid = tree_merge(nodes, mid);
+            nodes = next;
+        }
+        buf->root = tree_merge(tree_merge(l, mid), r);
+    }
+    while (nodes) {
+        PieceNode* next = nodes->right;
+        node_release(buf, nodes);
+        nodes = next;
+    }
+    node_release(buf, spare);
+    if (runs != &list.one) free(runs);
+    return ok;
+}
+
+static int tree_delete(TextBuffer* buf, size_t offset, size_t length) {
+    PieceNode* spares[2] = { node_alloc(buf), node_alloc(buf) };
+    if (!spares[0] || !spares[1]) {
+        node_release(buf, spares[0]);
+        node_release(buf, spares[1]);
+        return 0;
+    }
+
+    PieceNode *l, *mid, *r;
+    tree_split(buf, buf->root, offset, &l, &r, &spares[0]);
+    tree_split(buf, r, length, &mid, &r, &spares[1]);
+    tree_free(buf, mid);
+    buf->root = tree_merge(l, r);
+    node_release(buf, spares[0]);
+    node_release(buf, spares[1]);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Edit line
+//
+// Typing goes into a gap buffer holding the line under the cursor, so runs of
+// inserts and backspaces are O(1) and touch neither the allocator nor the
+// piece tree. The line is written back to the tree (text_flush) before any
+// operation that needs document offsets, and its gap is closed only when it
+// is read for display.
+
+// Move the gap so that it starts at pos
+static void line_move_gap(Line* line, size_t pos) {
+    if (pos < line->gap_start) {
+        size_t n = line->gap_start - pos;
+        memmove(line->data + line->gap_end - n, line->data + pos, n);
+        line->gap_start -= n;
+        line->gap_end -= n;
+    } else if (pos > line->gap_start) {
+        size_t n = pos - line->gap_start;
+        memmove(line->data + line->gap_start, line->data + line->gap_end, n);
+        line->gap_start += n;
+        line->gap_end += n;
+    }
+}
+
+// Copy length bytes of the line's text from col, reading around the gap
+// so that it stays where the next edit needs it
+static void line_copy(const Line* line, size_t col, char* dst, size_t length) {
+    if (col < line->gap_start) {
+        size_t n = line->gap_start - col < length ? line->gap_start - col : length;
+        memcpy(dst, line->data + col, n);
+        dst += n;
+        col += n;
+        length -= n;
+    }
+    memcpy(dst, line->data + line->gap_end + (col - line->gap_start), length);
+}
+
+// Make the gap at least extra bytes wide
+static int line_reserve(Line* line, size_t extra) {
+    if (line->gap_end - line->gap_start >= extra) return 1;
+
+    size_t capacity = line->capacity ? line->capacity * 2 : 64;
+    if (capacity < line->length + extra) capacity = line->length + extra;
+
+    char* data = realloc(line->data, capacity);
+    if (!data) return 0;
+
+    size_t tail = line->capacity - line->gap_end;
+    memmove(data + capacity - tail, data + line->gap_end, tail);
+    line->data = data;
+    line->gap_end = capacity - tail;
+    line->capacity = capacity;
+    return 1;
+}
+
+// Load row into the edit line, writing back the previous one first
+static int line_open(TextBuffer* buf, size_t row) {
+    if (buf->line_active && buf->line_row == row) return 1;
+    if (!text_flush(buf)) return 0;
+
+    Line* line = &buf->line;
+    size_t start = tree_line_start(buf, row);
+    size_t length = tree_line_length(buf, row);
+
+    line->length = 0;
+    line->gap_start = 0;
+    line->gap_end = line->capacity;
+    if (!line_reserve(line, length + 1)) return 0;
+
+    // Text goes after the gap; the first edit moves the gap to the cursor
+    line->gap_end = line->capacity - length;
+    tree_read(buf, start, line->data + line->gap_end, length);
+    line->length = length;
+
+    buf->line_row = row;
+    buf->line_tree_length = length;
+    buf->line_active = 1;
+    buf->line_dirty = 0;
+    return 1;
+}
+
+// Write the edit line back to the piece tree
+int text_flush(TextBuffer* buf) {
+    if (!buf->line_active) return 1;
+
+    Line* line = &buf->line;
+    if (buf->line_dirty) {
+        // The old text goes first and the line stays open until its new
+        // text is in, so a failure at either step leaves the document whole:
+        // the line still stands for whatever the tree holds of its row
+        line_move_gap(line, line->length);
+        size_t start = tree_line_start(buf, buf->line_row);
+        if (buf->line_tree_length > 0) {
+            if (!tree_delete(buf, start, buf->line_tree_length)) return 0;
+            buf->line_tree_length = 0;
+        }
+        if (line->length > 0 && !tree_insert(buf, start, line->data, line->length)) return 0;
+    }
+
+    buf->line_active = 0;
+    buf->line_dirty = 0;
+    return 1;
+}
+
+// Insert c at row/col through the edit line
+int text_insert_char(TextBuffer* buf, size_t row, size_t col, char c) {
+    text_index_wait(buf);
+    if (c == '\n') return text_insert(buf, text_offset(buf, row, col), &c, 1);
+    if (!line_open(buf, row)) return 0;
+
+    Line* line = &buf->line;
+    if (col > line->length) col = line->length;
+    if (!line_reserve(line, 1)) return 0;
+    line_move_gap(line, col);
+    line->data[line->gap_start++] = c;
+    line->length++;
+    buf->line_dirty = 1;
+    buf->changes++;
+    return 1;
+}
+
+// Delete the character before row/col, within the line, through the edit line
+int text_delete_char(TextBuffer* buf, size_t row, size_t col) {
+    text_index_wait(buf);
+    if (!line_open(buf, row)) return 0;
+
+    Line* line = &buf->line;
+    if (col > line->length) col = line->length;
+    if (col == 0) return 1;
+    line_move_gap(line, col);
+    line->gap_start--;
+    line->length--;
+    buf->line_dirty = 1;
+    buf->changes++;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Queries
+
+size_t text_memory(TextBuffer* buf) {
+    size_t bytes = 0;
+    for (int i = 0; i < buf->num_chunks; i++) {
+        const TextChunk* c = &buf->chunks[i];
+        if (i == 0 && buf->pager) {
+            mutex_lock(&buf->pager->lock);
+            bytes += buf->pager->resident * TEXT_PAGE_SIZE;
+            mutex_unlock(&buf->pager->lock);
+        } else if (c->data) {
+            bytes += c->capacity;
+        }
+        bytes += c->packed_length;
+        bytes += c->index_release ? c->index_length : c->line_cap * sizeof(size_t);
+    }
+    return bytes;
+}
+
+size_t text_size(TextBuffer* buf) {
+    size_t size = sub_length(buf->root);
+    if (buf->line_active) size = size - buf->line_tree_length + buf->line.length;
+    return size;
+}
+
+size_t text_line_count(TextBuffer* buf) {
+    return sub_lf(buf->root) + 1;
+}
+
+// Document offset of the first byte of row (clamped to the last line)
+size_t text_line_start(TextBuffer* buf, size_t row) {
+    if (row > sub_lf(buf->root)) row = sub_lf(buf->root);
+
+    size_t start = tree_line_start(buf, row);
+    if (buf->line_active && row > buf->line_row) {
+        start = start - buf->line_tree_length + buf->line.length;
+    }
+    return start;
+}
+
+// Length of row, excluding its newline
+size_t text_line_length(TextBuffer* buf, size_t row) {
+    if (buf->line_active && row == buf->line_row) return buf->line.length;
+    return tree_line_length(buf, row);
+}
+
+size_t text_offset(TextBuffer* buf, size_t row, size_t col) {
+    return text_line_start(buf, row) + col;
+}
+
+// Convert a document offset to a row and column
+void text_position(TextBuffer* buf, size_t offset, size_t* row, size_t* col) {
+    text_index_wait(buf);
+    text_flush(buf);
+    if (offset > text_size(buf)) offset = text_size(buf);
+
+    PieceNode* t = buf->root;
+    size_t lines = 0;
+    size_t pos = offset;
+    while (t) {
+        size_t left_len = sub_length(t->left);
+        if (pos < left_len) {
+            t = t->left;
+            continue;
+        }
+        lines += sub_lf(t->left);
+        pos -= left_len;
+        if (pos < t->length) {
+            lines += chunk_count_lf(buf, &buf->chunks[t->chunk], t->start, t->start + pos);
+            break;
+        }
+        lines += t->lf;
+        pos -= t->length;
+        t = t->right;
+    }
+
+    *row = lines;
+    *col = offset - tree_line_start(buf, lines);
+}
+
+// ---------------------------------------------------------------------------
+// Reading
+
+// Call fn on each contiguous run of bytes in [offset, offset + length), in
+// order. Stops early and returns 0 if fn returns 0.
+int text_foreach(TextBuffer* buf, size_t offset, size_t length, TextChunkFn fn, void* ctx) {
+    text_index_wait(buf);
+    text_flush(buf);
+
+    size_t size = text_size(buf);
+    if (offset > size) offset = size;
+    if (length > size - offset) length = size - offset;
+    return visit_range(buf, offset, offset + length, fn, ctx);
+}
+
+static int add_span(const char* data, size_t length, void* ctx) {
+    TextSnapshot* snap = ctx;
+    if (snap->count % 1024 == 0) {
+        TextSpan* spans = realloc(snap->spans, (snap->count + 1024) * sizeof(TextSpan));
+        if (!spans) return 0;
+        snap->spans = spans;
+    }
+    snap->spans[snap->count].data = data;
+    snap->spans[snap->count].length = length;
+    snap->count++;
+    snap->length += length;
+    return 1;
+}
+
+// A compressed add buffer a snapshot reads from
+typedef struct {
+    const char* packed;
+    size_t packed_length;
+    size_t length;
+    char* data;           // Inflated while spans in it are being written
+    size_t unwritten;     // Bytes of its spans not yet written
+} PackSource;
+
+typedef struct {
+    int chunk;
+    size_t start;
+} PackRef;
+
+struct TextSnapshotPack {
+    PackSource* sources;  // By chunk
+    PackRef* refs;        // Where each span without data is, in order
+    size_t ref_count;
+    int* open;            // Sources inflated at the moment
+    int open_count;
+};
+
+static void snapshot_pack_free(TextSnapshotPack* pack) {
+    if (!pack) return;
+    for (int i = 0; i < pack->open_count; i++) {
+        block_free(pack->sources[pack->open[i]].data);
+    }
+    free(pack->sources);
+    free(pack->refs);
+    free(pack->open);
+    free(pack);
+}
+
+// Add a span for a piece whose add buffer is compressed and not in memory
+static int snapshot_ref(TextBuffer* buf, TextSnapshot* snap, const PieceNode* t) {
+    TextSnapshotPack* pack = snap->pack;
+    if (!pack) {
+        pack = snap->pack = calloc(1, sizeof(TextSnapshotPack));
+        if (!pack) return 0;
+        pack->sources = calloc(buf->num_chunks, sizeof(PackSource));
+        pack->open = malloc(buf->num_chunks * sizeof(int));
+        if (!pack->sources || !pack->open) return 0;
+    }
+    if (pack->ref_count % 1024 == 0) {
+        PackRef* refs = realloc(pack->refs, (pack->ref_count + 1024) * sizeof(PackRef));
+        if (!refs) return 0;
+        pack->refs = refs;
+    }
+    pack->refs[pack->ref_count].chunk = t->chunk;
+    pack->refs[pack->ref_count].start = t->start;
+    pack->ref_count++;
+
+    const TextChunk* c = &buf->chunks[t->chunk];
+    PackSource* src = &pack->sources[t->chunk];
+    src->packed = c->packed;
+    src->packed_length = c->packed_length;
+    src->length = c->length;
+    src->unwritten += t->length;
+    return add_span(NULL, t->length, snap);
+}
+
+// Add a span per piece of subtree t, in order
+static int snapshot_walk(TextBuffer* buf, TextSnapshot* snap, const PieceNode* t) {
+    for (; t; t = t->right) {
+        if (!snapshot_walk(buf, snap, t->left)) return 0;
+        const TextChunk* c = &buf->chunks[t->chunk];
+        int ok = c->data ? add_span(c->data + t->start, t->length, snap)
+                         : snapshot_ref(buf, snap, t);
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+// Freeze the current text. Costs one span per piece; no text is copied.
+// Returns NULL if a snapshot is already live or memory runs out.
+TextSnapshot* text_snapshot(TextBuffer* buf) {
+    if (buf->snapshot) return NULL;
+    text_index_wait(buf);
+    if (!text_flush(buf)) return NULL;
+
+    TextSnapshot* snap = calloc(1, sizeof(TextSnapshot));
+    if (!snap) return NULL;
+    snap->spare = calloc(SNAPSHOT_SPARE_CHUNKS, sizeof(TextChunk));
+    if (!snap->spare || !snapshot_walk(buf, snap, buf->root)) {
+        snapshot_pack_free(snap->pack);
+        free(snap->spare);
+        free(snap->spans);
+        free(snap);
+        return NULL;
+    }
+    snap->owner = buf;
+    if (buf->pager) {
+        snap->paged = buf->chunks[0].data;
+        snap->paged_length = buf->chunks[0].length;
+        snap->evict = buf->page_evict;
+        snap->evict_ctx = buf->page_evict_ctx;
+    }
+    buf->snapshot = snap;
+    return snap;
+}
+
+void text_snapshot_free(TextSnapshot* snap) {
+    if (!snap) return;
+    if (snap->owner) snap->owner->snapshot = NULL;
+    for (int i = 0; i < snap->num_chunks; i++) {
+        chunk_release(&snap->chunks[i]);
+    }
+    free(snap->chunks);
+    free(snap->spare);
+    free(snap->spans);
+    snapshot_pack_free(snap->pack);
+    free(snap);
+}
+
+// Call fn on each span in order. Stops early and returns 0 if fn returns 0.
+// In large-file mode spans of the original are cut at page boundaries, so
+// that a writer can drop each page as soon as it is out.
+int text_snapshot_foreach(const TextSnapshot* snap, TextChunkFn fn, void* ctx) {
+    TextSnapshotPack* pack = snap->pack;
+    size_t ref = 0;
+    for (size_t i = 0; i < snap->count; i++) {
+        const char* data = snap->spans[i].data;
+        size_t length = snap->spans[i].length;
+        if (!data) {
+            // Inflate the add buffer until all its spans are written
+            const PackRef* r = &pack->refs[ref++];
+            PackSource* src = &pack->sources[r->chunk];
+            if (!src->data) {
+                src->data = pack_inflate(src->packed, src->packed_length, src->length);
+                if (!src->data) return 0;
+                pack->open[pack->open_count++] = r->chunk;
+            }
+            if (!fn(src->data + r->start, length, ctx)) return 0;
+            continue;
+        }
+        if (!snap->paged || data < snap->paged || data >= snap->paged + snap->paged_length) {
+            if (!fn(data, length, ctx)) return 0;
+            continue;
+        }
+
+        size_t pos = data - snap->paged;
+        size_t end = pos + length;
+        while (pos < end) {
+            size_t next = (pos / TEXT_PAGE_SIZE + 1) * TEXT_PAGE_SIZE;
+            if (next > end) next = end;
+            if (!fn(snap->paged + pos, next - pos, ctx)) return 0;
+            pos = next;
+        }
+    }
+    return 1;
+}
+
+// Note that data[0, length), handed out by text_snapshot_foreach, is no
+// longer needed, e.g. once it is written out. Pages of a paged original up
+// to the one it ends in are dropped from memory, and an add buffer inflated for
+// the snapshot is freed once all of its spans are through. Safe to call from
+// the thread reading the snapshot.
+void text_snapshot_evict(TextSnapshot* snap, const char* data, size_t length) {
+    TextSnapshotPack* pack = snap->pack;
+    for (int i = 0; pack && i < pack->open_count; i++) {
+        PackSource* src = &pack->sources[pack->open[i]];
+        if (data < src->data || data >= src->data + src->length) continue;
+        src->unwritten -= length < src->unwritten ? length : src->unwritten;
+        if (src->unwritten == 0) {
+            block_free(src->data);
+            src->data = NULL;
+            pack->open[i] = pack->open[--pack->open_count];
+        }
+        return;
+    }
+
+    if (!snap->paged || data + length <= snap->paged || data >= snap->paged + snap->paged_length) return;
+
+    size_t to = (size_t)(data + length - snap->paged);
+    if (to > snap->paged_length) to = snap->paged_length;
+
+    // Spans of an edited file are often much shorter than a page, so rather
+    // than only whole pages inside each one, drop every page passed since
+    // the last call: spans come in document order, and the original's
+    // pieces in the order of the original. The page data ends in probably
+    // holds the next span and stays. A page read again is faulted back in.
+    // The tail of the original counts as a whole page.
+    if (to < snap->paged_length) to = to / TEXT_PAGE_SIZE * TEXT_PAGE_SIZE;
+    if (snap->paged_dropped < to) {
+        snap->evict((char*)snap->paged + snap->paged_dropped, to - snap->paged_dropped, snap->evict_ctx);
+        snap->paged_dropped = to;
+    }
+}
+
+// Copy up to length bytes starting at offset; returns bytes copied
+size_t text_read(TextBuffer* buf, size_t offset, char* dst, size_t length) {
+    ReadCtx rc = { dst, 0 };
+    text_foreach(buf, offset, length, read_chunk, &rc);
+    return rc.copied;
+}
+
+// State of text_find while it visits the pieces of a region
+typedef struct {
+    const char* pat;
+    size_t pat_len;
+    int backward;         // Keep the last match rather than stop at the first
+    size_t base;          // Document offset of the next span
+    char carry[TEXT_FIND_MAX];  // Last pat_len - 1 bytes seen
+    size_t carry_len;
+    char window[2 * TEXT_FIND_MAX];
+    size_t match;         // SCAN_NONE until found
+} FindCtx;
+
+static int find_span(const char* data, size_t length, void* ctx) {
+    FindCtx* fc = ctx;
+    size_t keep = fc->pat_len - 1;
+
+    // Matches that start in the previous span and end in this one
+    if (fc->carry_len > 0) {
+        size_t take = length < keep ? length : keep;
+        memcpy(fc->window, fc->carry, fc->carry_len);
+        memcpy(fc->window + fc->carry_len, data, take);
+        size_t at = fc->backward
+            ? scan_rfind(fc->window, fc->carry_len + take, fc->pat, fc->pat_len)
+            : scan_find(fc->window, fc->carry_len + take, fc->pat, fc->pat_len);
+        if (at != SCAN_NONE && at < fc->carry_len) {
+            fc->match = fc->base - fc->carry_len + at;
+            if (!fc->backward) return 0;
+        }
+    }
+
+    size_t at = fc->backward ? scan_rfind(data, length, fc->pat, fc->pat_len)
+                             : scan_find(data, length, fc->pat, fc->pat_len);
+    if (at != SCAN_NONE) {
+        fc->match = fc->base + at;
+        if (!fc->backward) return 0;
+    }
+
+    if (length >= keep) {
+        memcpy(fc->carry, data + length - keep, keep);
+        fc->carry_len = keep;
+    } else {
+        size_t total = fc->carry_len + length;
+        size_t drop = total > keep ? total - keep : 0;
+        memmove(fc->carry, fc->carry + drop, fc->carry_len - drop);
+        memcpy(fc->carry + fc->carry_len - drop, data, length);
+        fc->carry_len = total - drop;
+    }
+    fc->base += length;
+    return 1;
+}
+
+// Find the first (or with backward, the last) occurrence of pat that starts
+// in [from, to). Pieces are searched where they live, without copying;
+// only matches spanning two pieces go through a small window. Returns 1 and
+// sets *at if there is one.
+int text_find(TextBuffer* buf, const char* pat, size_t pat_len, size_t from, size_t to,
+              int backward, size_t* at) {
+    if (pat_len == 0 || pat_len > TEXT_FIND_MAX) return 0;
+    text_index_wait(buf);
+    if (!text_flush(buf)) return 0;
+
+    size_t size = text_size(buf);
+    if (to > size) to = size;
+    if (from >= to) return 0;
+    size_t end = to + pat_len - 1 < size ? to + pat_len - 1 : size;
+
+    FindCtx* fc = malloc(sizeof(FindCtx));
+    if (!fc) return 0;
+    fc->pat = pat;
+    fc->pat_len = pat_len;
+    fc->backward = backward;
+    fc->match = SCAN_NONE;
+
+    if (!backward) {
+        fc->base = from;
+        fc->carry_len = 0;
+        text_foreach(buf, from, end - from, find_span, fc);
+    } else {
+        // Windows overlap by pat_len - 1 bytes so no match is cut in two
+        for (;;) {
+            size_t start = end - from > FIND_WINDOW ? end - FIND_WINDOW : from;
+            fc->base = start;
+            fc->carry_len = 0;
+            text_foreach(buf, start, end - start, find_span, fc);
+            if (fc->match != SCAN_NONE || start == from) break;
+            end = start + pat_len - 1;
+        }
+    }
+
+    int found = fc->match != SCAN_NONE;
+    if (found) *at = fc->match;
+    free(fc);
+    return found;
+}
+
+// Copy up to length bytes of row starting at col; returns bytes copied
+size_t text_get_line(TextBuffer* buf, size_t row, size_t col, char* dst, size_t length) {
+    if (buf->line_active && row == buf->line_row) {
+        Line* line = &buf->line;
+        if (col >= line->length) return 0;
+        if (length > line->length - col) length = line->length - col;
+        line_copy(line, col, dst, length);
+        return length;
+    }
+
+    size_t line_len = tree_line_length(buf, row);
+    if (col >= line_len) return 0;
+    if (length > line_len - col) length = line_len - col;
+    return tree_read(buf, tree_line_start(buf, row) + col, dst, length);
+}
+
+// ---------------------------------------------------------------------------
+// Editing
+
+// Insert text at a document offset
+int text_insert(TextBuffer* buf, size_t offset, const char* text, size_t length) {
+    text_index_wait(buf);
+    if (length == 0) return 1;
+    if (!text_flush(buf)) return 0;
+    if (offset > text_size(buf)) offset = text_size(buf);
+    buf->changes++;
+    return tree_insert(buf, offset, text, length);
+}
+
+// Delete length bytes starting at a document offset
+int text_delete(TextBuffer* buf, size_t offset, size_t length) {
+    text_index_wait(buf);
+    if (!text_flush(buf)) return 0;
+
+    size_t size = text_size(buf);
+    if (offset >= size || length == 0) return 1;
+    if (length > size - offset) length = size - offset;
+    buf->changes++;
+    return tree_delete(buf, offset, length);
+}
@@ -0,0 +1,97 @@
+#include <thread.h>
+#include <stdlib.h>
+
+// Heap-allocated start record, freed by the new thread
+typedef struct {
+    ThreadFn fn;
+    void* arg;
+} ThreadStart;
+
+#ifdef _WIN32
+
+static DWORD WINAPI thread_main(LPVOID param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+int thread_create(Thread* thread, ThreadFn fn, void* arg) {
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if (!start) return 0;
+    start->fn = fn;
+    start->arg = arg;
+
+    *thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+    if (!*thread) {
+        free(start);
+        return 0;
+    }
+    return 1;
+}
+
+void thread_join(Thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+int thread_cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+void mutex_init(Mutex* mutex) { InitializeSRWLock(mutex); }
+void mutex_destroy(Mutex* mutex) { (void)mutex; }
+void mutex_lock(Mutex* mutex) { AcquireSRWLockExclusive(mutex); }
+void mutex_unlock(Mutex* mutex) { ReleaseSRWLockExclusive(mutex); }
+
+void cond_init(Cond* cond) { InitializeConditionVariable(cond); }
+void cond_destroy(Cond* cond) { (void)cond; }
+void cond_wait(Cond* cond, Mutex* mutex) { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+void cond_broadcast(Cond* cond) { WakeAllConditionVariable(cond); }
+
+#else
+
+#include <unistd.h>
+
+static void* thread_main(void* param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return NULL;
+}
+
+int thread_create(Thread* thread, ThreadFn fn, void* arg) {
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if (!start) return 0;
+    start->fn = fn;
+    start->arg = arg;
+
+    if (pthread_create(thread, NULL, thread_main, start) != 0) {
+        free(start);
+        return 0;
+    }
+    return 1;
+}
+
+void thread_join(Thread thread) {
+    pthread_join(thread, NULL);
+}
+
+int thread_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void mutex_init(Mutex* mutex) { pthread_mutex_init(mutex, NULL); }
+void mutex_destroy(Mutex* mutex) { pthread_mutex_destroy(mutex); }
+void mutex_lock(Mutex* mutex) { pthread_mutex_lock(mutex); }
+void mutex_unlock(Mutex* mutex) { pthread_mutex_unlock(mutex); }
+
+void cond_init(Cond* cond) { pthread_cond_init(cond, NULL); }
+void cond_destroy(Cond* cond) { pthread_cond_destroy(cond); }
+void cond_wait(Cond* cond, Mutex* mutex) { pthread_cond_wait(cond, mutex); }
+void cond_broadcast(Cond* cond) { pthread_cond_broadcast(cond); }
+
+#endif
@@ -0,0 +1,232 @@
+#include <undo.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Record layout in the arena: a header, the bytes inserted or deleted, then
+// the record's total size so the journal can be walked backwards.
+enum {
+    RECORD_INSERT,
+    RECORD_DELETE
+};
+
+typedef struct {
+    size_t offset;        // Document offset of the edit
+    size_t length;        // Bytes that follow the header
+    int kind;
+    int starts_group;     // First record of an undo unit
+} RecordHeader;
+
+#define FOOTER_SIZE sizeof(size_t)
+
+static size_t record_size(size_t length) {
+    return sizeof(RecordHeader) + length + FOOTER_SIZE;
+}
+
+static void read_header(const UndoJournal* j, size_t at, RecordHeader* h) {
+    memcpy(h, j->data + at, sizeof(*h));
+}
+
+static void write_header(UndoJournal* j, size_t at, const RecordHeader* h) {
+    memcpy(j->data + at, h, sizeof(*h));
+}
+
+static void write_footer(UndoJournal* j, size_t end, size_t size) {
+    memcpy(j->data + end - FOOTER_SIZE, &size, FOOTER_SIZE);
+}
+
+// Start of the record that ends at end
+static size_t record_before(const UndoJournal* j, size_t end) {
+    size_t size;
+    memcpy(&size, j->data + end - FOOTER_SIZE, FOOTER_SIZE);
+    return end - size;
+}
+
+static int reserve(UndoJournal* j, size_t extra) {
+    if (j->used + extra <= j->capacity) return 1;
+
+    size_t capacity = j->capacity ? j->capacity * 2 : 4096;
+    while (capacity < j->used + extra) capacity *= 2;
+    char* data = realloc(j->data, capacity);
+    if (!data) return 0;
+    j->data = data;
+    j->capacity = capacity;
+    return 1;
+}
+
+// Drop the oldest units until incoming more bytes fit in three quarters of
+// the limit, so trimming is rare. The open unit is never cut into: a single
+// unit larger than the limit stays until the next one starts.
+static void trim(UndoJournal* j, size_t incoming) {
+    if (j->used + incoming <= j->limit) return;
+
+    size_t keep = j->limit - j->limit / 4;
+    size_t need = j->used + incoming > keep ? j->used + incoming - keep : 0;
+    size_t cut = j->used;
+    size_t last_start = 0;
+    int found = 0;
+    for (size_t at = 0; at < j->used;) {
+        RecordHeader h;
+        read_header(j, at, &h);
+        if (h.starts_group) {
+            last_start = at;
+            if (!found && at >= need) {
+                cut = at;
+                found = 1;
+            }
+        }
+        at += record_size(h.length);
+    }
+    if (j->group_open && cut > last_start) cut = last_start;
+    if (cut > j->top) cut = j->top;
+    if (cut == 0) return;
+
+    memmove(j->data, j->data + cut, j->used - cut);
+    j->used -= cut;
+    j->top -= cut;
+}
+
+static int append(UndoJournal* j, int kind, size_t offset, const char* text, size_t length) {
+    // A new edit ends the redo history
+    j->used = j->top;
+
+    size_t size = record_size(length);
+    trim(j, size);
+    if (!reserve(j, size)) {
+        undo_clear(j);
+        return 0;
+    }
+
+    RecordHeader h = { offset, length, kind, !j->group_open };
+    write_header(j, j->used, &h);
+    memcpy(j->data + j->used + sizeof(h), text, length);
+    j->used += size;
+    write_footer(j, j->used, size);
+    j->top = j->used;
+    j->group_open = 1;
+    j->extendable = kind == RECORD_INSERT;
+    return 1;
+}
+
+// The newest record, if it is an insert that typing may still change
+static int last_insert(const UndoJournal* j, size_t* at, RecordHeader* h) {
+    if (!j->extendable || j->top != j->used || j->used == 0) return 0;
+    *at = record_before(j, j->used);
+    read_header(j, *at, h);
+    return h->kind == RECORD_INSERT;
+}
+
+UndoJournal* undo_create(size_t limit) {
+    UndoJournal* j = calloc(1, sizeof(UndoJournal));
+    if (!j) return NULL;
+    j->limit = limit;
+    return j;
+}
+
+void undo_free(UndoJournal* j) {
+    if (!j) return;
+    free(j->data);
+    free(j);
+}
+
+// Forget all history, e.g. when another file is loaded
+void undo_clear(UndoJournal* j) {
+    free(j->data);
+    j->data = NULL;
+    j->used = j->capacity = j->top = 0;
+    j->group_open = 0;
+    j->extendable = 0;
+}
+
+void undo_set_limit(UndoJournal* j, size_t limit) {
+    j->limit = limit;
+    trim(j, 0);
+}
+
+int undo_insert(UndoJournal* j, size_t offset, const char* text, size_t length) {
+    if (length == 0) return 1;
+
+    // Continue the last insert when typing on where it ended
+    size_t at;
+    RecordHeader h;
+    if (last_insert(j, &at, &h) && offset == h.offset + h.length) {
+        trim(j, length);
+        if (!reserve(j, length)) {
+            undo_clear(j);
+            return 0;
+        }
+        at = record_before(j, j->used);
+        size_t end = j->used - FOOTER_SIZE;
+        memcpy(j->data + end, text, length);
+        h.length += length;
+        write_header(j, at, &h);
+        j->used += length;
+        write_footer(j, j->used, j->used - at);
+        j->top = j->used;
+        return 1;
+    }
+    return append(j, RECORD_INSERT, offset, text, length);
+}
+
+int undo_delete(UndoJournal* j, size_t offset, const char* text, size_t length) {
+    if (length == 0) return 1;
+
+    // Backspacing over just-typed text shortens the insert instead
+    size_t at;
+    RecordHeader h;
+    if (last_insert(j, &at, &h) && length <= h.length &&
+        offset + length == h.offset + h.length) {
+        h.length -= length;
+        write_header(j, at, &h);
+        j->used -= length;
+        write_footer(j, j->used, j->used - at);
+        j->top = j->used;
+        return 1;
+    }
+    return append(j, RECORD_DELETE, offset, text, length);
+}
+
+void undo_break(UndoJournal* j) {
+    j->group_open = 0;
+    j->extendable = 0;
+}
+
+int undo_undo(UndoJournal* j, TextBuffer* buf, size_t* offset, UndoApplyFn applied, void* ctx) {
+    undo_break(j);
+    if (j->top == 0) return 0;
+
+    // Revert records newest first, back to the start of the unit
+    for (;;) {
+        size_t at = record_before(j, j->top);
+        RecordHeader h;
+        read_header(j, at, &h);
+        const char* text = j->data + at + sizeof(h);
+        int ok = h.kind == RECORD_INSERT ? text_delete(buf, h.offset, h.length)
+                                         : text_insert(buf, h.offset, text, h.length);
+        if (!ok) return 0;
+        if (applied) applied(h.kind != RECORD_INSERT, h.offset, text, h.length, ctx);
+        j->top = at;
+        *offset = h.offset;
+        if (h.starts_group || j->top == 0) return 1;
+    }
+}
+
+int undo_redo(UndoJournal* j, TextBuffer* buf, size_t* offset, UndoApplyFn applied, void* ctx) {
+    undo_break(j);
+    if (j->top == j->used) return 0;
+
+    // Reapply records oldest first, up to the start of the next unit
+    do {
+        RecordHeader h;
+        read_header(j, j->top, &h);
+        const char* text = j->data + j->top + sizeof(h);
+        int ok = h.kind == RECORD_INSERT ? text_insert(buf, h.offset, text, h.length)
+                                         : text_delete(buf, h.offset, h.length);
+        if (!ok) return 0;
+        if (applied) applied(h.kind == RECORD_INSERT, h.offset, text, h.length, ctx);
+        j->top += record_size(h.length);
+        *offset = h.kind == RECORD_INSERT ? h.offset + h.length : h.offset;
+
+        if (j->top < j->used) read_header(j, j->top, &h);
+        if (j->top == j->used || h.starts_group) return 1;
+    } while (1);
+}
@@ -1,10 +1,24 @@
 #include <tvi.h>
+#include <clock.h>
 
 // display: command line arguments
 static void print_help() {
     printf("Tiny VI Editor (tvi) - Minimal vi-like editor\n");
     printf("Usage:\n");
-    printf("  tvi [file]         Edit specified file\n");
+    printf("  tvi [file...]      Edit specified files, one buffer each\n");
+    printf("  tvi -j N [file]    Index large files on N threads (0: one per CPU)\n");
+    printf("  tvi -m MB [file]   Page files over MB instead of keeping them in memory\n");
+    printf("  tvi -f file        Follow text appended to the file, as with tail -f\n");
+    printf("  tvi -r file        Recover unsaved edits from the file's swap file\n");
+    printf("  tvi -n [file]      Keep no swap file\n");
+    printf("  tvi --server [file...]\n");
+    printf("                     Keep files loaded in a server for tvi --client\n");
+    printf("  tvi --client [file]\n");
+    printf("                     Edit in the running server, attaching this terminal\n");
+    printf("  tvi -S path ...    Use path as the server's socket\n");
+    printf("  tvi -- file...     Treat the rest as file names, even if they start with -\n");
+    printf("  tvi --replay keys.txt [file]\n");
+    printf("                     Run a key script headless and print latency as JSON\n");
     printf("  tvi -h, --help     Show this help message\n");
     printf("  tvi -usage         Show internal editor commands\n");
     printf("  tvi -info          Show program information\n");
@@ -17,7 +31,15 @@ static void print_usage() {
     printf("  i          Enter insert mode\n");
     printf("  :          Enter command mode\n");
     printf("  h/j/k/l    Move cursor (left/down/up/right)\n");
+    printf("  w/b/e      Next word / previous word / end of word\n");
+    printf("  0 / $      Start / end of line\n");
+    printf("  gg / G     First / last line, or line N with a count\n");
+    printf("  N<motion>  Repeat a motion N times, e.g. 1000j or 3w\n");
     printf("  x          Delete character at cursor\n");
+    printf("  u          Undo last change\n");
+    printf("  Ctrl-R     Redo last undone change\n");
+    printf("  /pat ?pat  Search down / up, highlighting matches as you type\n");
+    printf("  n / N      Next match in the same / opposite direction\n");
     printf("  ESC        Return to normal mode\n");
     printf("\nCommand Mode:\n");
     printf("  :w         Save current file\n");
@@ -25,97 +47,193 @@ static void print_usage() {
     printf("  :wq        Save and quit\n");
     printf("  :set number   Show line numbers\n");
     printf("  :set nonumber Hide line numbers\n");
+    printf("  :set threads=N Worker threads for line indexing and :s (0: one per CPU)\n");
+    printf("  :set stats    Show render statistics (cells and bytes per frame)\n");
+    printf("  :set fsync    Flush saved files to disk before :w returns\n");
+    printf("  :set undomem=N Memory for undo history in MB (default 64)\n");
+    printf("  :set intern   Store repeated lines put back by :s and undo once\n");
+    printf("  :set compress Compress edited text not in use, inflating it when read\n");
+    printf("  :follow       Take in text appended to the file as it arrives\n");
+    printf("  :nofollow     Stop following the file\n");
+    printf("  :e file       Open file in a buffer of its own\n");
+    printf("  :bn / :bp     Show the next / previous buffer\n");
+    printf("  :ls           List buffers (%% shown, + modified)\n");
+    printf("  :set buffermem=N Memory for all buffers in MB before unmodified ones are evicted (default 2048; 0: no limit)\n");
+    printf("  :set pagemem=N Memory for a file in large-file mode in MB (default 1024; 0: off)\n");
+    printf("  :N            Jump to line N\n");
+    printf("  :redraw       Resend the whole screen on the next frame\n");
+    printf("  :noh          Stop highlighting search matches\n");
+    printf("  :[range]s/re/rep/[g]  Replace re with rep; range is %%, N, N,M, . or $\n");
 }
 
 // display: program information
 static void print_info() {
     printf("Tiny VI Editor (tvi) v1.0\n");
-    printf("A minimal vi-like text editor for Windows\n");
-    printf("Supports cmd and PowerShell\n");
+    printf("A minimal vi-like text editor for Windows and POSIX terminals\n");
+    printf("Supports cmd, PowerShell and ANSI terminals\n");
     printf("Copyright (C) 2023\n");
 }
 
-static int parse_arguments(int argc, char* argv[], char** filename) {
-    if (argc == 1) {
-        *filename = NULL;
-        return 0;
-    }
+static int parse_arguments(int argc, char* argv[], char** files, int* num_files, int* threads,
+                           long* page_mb, char** replay, int* follow, int* swap,
+                           int* server, char** socket_path) {
+    *num_files = 0;
     
-    if (argc == 2) {
+    for (int i = 1; i < argc; i++) {
         // Check for help/info flags
-        if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             print_help();
             return 1; // Exit after displaying
-        } else if (strcmp(argv[1], "-usage") == 0) {
+        } else if (strcmp(argv[i], "-usage") == 0) {
             print_usage();
             return 1; // Exit after displaying
-        } else if (strcmp(argv[1], "-info") == 0) {
+        } else if (strcmp(argv[i], "-info") == 0) {
             print_info();
             return 1; // Exit after displaying
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            *threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            *page_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            *follow = 1;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            *swap = 2;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            *swap = 0;
+        } else if (strcmp(argv[i], "--server") == 0) {
+            *server = 1;
+        } else if (strcmp(argv[i], "--client") == 0) {
+            *server = 2;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            *socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            *replay = argv[++i];
+        } else if (strcmp(argv[i], "--") == 0) {
+            // Everything after -- is a filename
+            while (++i < argc) files[(*num_files)++] = argv[i];
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            // Unknown option, or one missing its value
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            fprintf(stderr, "Use 'tvi -h' for help\n");
+            return -1;
         } else {
             // Treat as filename
-            *filename = argv[1];
-            return 0;
+            files[(*num_files)++] = argv[i];
         }
     }
     
-    // Too many arguments
-    fprintf(stderr, "Error: Too many arguments\n");
-    fprintf(stderr, "Use 'tvi -h' for help\n");
-    return 1;
+    return 0;
 }
 
 // Main entry point of the Tiny VI editor
 int main(int argc, char* argv[]) {
     EditorState state;
-    char* filename = NULL;
+    char** files = calloc(argc, sizeof(char*));
+    int num_files = 0;
+    int threads = 0;
+    long page_mb = -1;
+    char* replay = NULL;
+    int follow = 0;
+    int swap = 1;         // 0: none, 1: new swap file, 2: recover
+    int server = 0;       // 1: run the server, 2: attach to it
+    char* socket_path = NULL;
+    char default_socket[256];
     
     // Parse command line arguments
-    if (parse_arguments(argc, argv, &filename) != 0) {
-        return 0; // Exit if we displayed info/help
+    if (!files) {
+        fprintf(stderr, "Memory allocation failed for arguments\n");
+        return 1;
+    }
+    int parsed = parse_arguments(argc, argv, files, &num_files, &threads, &page_mb, &replay,
+                                 &follow, &swap, &server, &socket_path);
+    if (parsed != 0) {
+        free(files);
+        return parsed < 0 ? 1 : 0; // Exit if we displayed info/help or hit a bad option
+    }
+    if (server && !socket_path) {
+        if (!server_socket_path(default_socket, sizeof(default_socket))) {
+            free(files);
+            return 1;
+        }
+        socket_path = default_socket;
+    }
+
+    // The client only relays the terminal; the server does the rest
+    if (server == 2) {
+        int status = client_run(socket_path, num_files > 0 ? files[0] : NULL);
+        free(files);
+        return status;
     }
     
     // Initialize core editor state and screen system
     init_editor(&state);
+    state.index_threads = threads;
+    if (page_mb >= 0) state.page_budget = (size_t)page_mb << 20;
+    state.use_swap = swap != 0;
+    if (replay && !replay_open(replay)) {
+        free(files);
+        return 1;
+    }
+
+    // Server: load the files given, then serve clients until stopped
+    if (server == 1) {
+        for (int i = 0; i < num_files; i++) {
+            buffer_switch(&state, buffer_add(&state, files[i], swap == 2));
+        }
+        free(files);
+        if (state.num_buffers > 0) state.buffers[0].following = follow;
+        if (state.num_buffers > 0) buffer_switch(&state, 0);
+        else show_welcome_screen(&state);
+        int status = server_run(&state, socket_path);
+        save_wait(&state);
+        buffer_free_all(&state, 1);  // Unsaved edits stay recoverable from the swap files
+        return status;
+    }
     init_screen(&state);
     
-    // Handle file loading if filename provided
-    if (filename) {
-        state.filename = _strdup(filename);
-        load_file(&state, filename);
-        state.welcome_screen = 0; // Disable welcome screen
+    // Every file gets a buffer; only the first is loaded now, the others
+    // when first shown
+    double load_ms = 0;
+    for (int i = 0; i < num_files; i++) {
+        buffer_add(&state, files[i], swap == 2);
+    }
+    free(files);
+    if (state.num_buffers > 0) {
+        state.buffers[0].following = follow;
+        double start = clock_ms();
+        buffer_switch(&state, 0);
+        load_ms = clock_ms() - start;
     } else {
         // No file provided - display welcome screen
         show_welcome_screen(&state);
         state.welcome_screen = 1;
     }
     
+    // Headless: run the key script instead of the terminal loop
+    int status = 0;
+    if (replay) {
+        status = replay_run(&state, load_ms);
+        state.quit = 1;
+    }
+    
     // Main editor loop - runs until user exits
-    while (1) {
-        // Track current terminal dimensions
-        int old_rows = state.screen_rows;
-        int old_cols = state.screen_cols;
-        
-        // Update terminal size information
-        update_terminal_size(&state);
-        
-        // Refresh screen if terminal size changed
-        if (old_rows != state.screen_rows || old_cols != state.screen_cols) {
-            refresh_screen(&state);
-        }
+    while (!state.quit) {
+        // Redraw what changed since the last pass; this is the only place a
+        // frame is rendered, so a batch of input costs one render
+        refresh_screen(&state);
         
         // Process user input events
         handle_input(&state);
         
-        // Redraw screen with current state
-        refresh_screen(&state);
+        // Take in the results of background work
+        editor_poll(&state);
     }
     
-    // Cleanup resources (theoretical reach - loop runs indefinitely)
-    free_lines(&state);       // Free allocated text lines
-    free(state.filename);     // Free stored filename
+    // Cleanup resources
+    save_wait(&state);        // Let a background save finish writing
     cleanup_screen();         // Restore terminal to original state
+    buffer_free_all(&state, 0);  // Free every buffer; nothing left to recover after a normal exit
     
-    return 0;
+    return status;
 }
     
\ No newline at end of file
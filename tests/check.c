@@ -0,0 +1,1116 @@
+#include <tvi.h>
+#include <clock.h>
+#include <lz.h>
+#include <re.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Tests run by make check. Each drives the editor the way the terminal
+// would, through a scripted key backend, and checks the outcome:
+//
+//   motions    counts, word motions, G/gg and :N (see motion.c)
+//   input      a 1 MB bracketed paste and a burst of typing, each applied
+//              as one edit by one handle_input call
+//   scroll     paging through a 10M-line buffer; frame time must not grow
+//              with the distance from the top
+//   undo       undo and redo of typing, backspace, x and :s against
+//              snapshots, with and without a tight memory cap
+//   regex      backtracking and the Pike VM against each other on random
+//              patterns, a pattern that backtracks exponentially, and :s on
+//              CRLF lines
+//   lz         compress/decompress round trips, malformed blocks, and
+//              reading and editing text whose add buffers were compressed
+//              and dropped
+//   server     a client session over the socket: ls, open, edit, :w,
+//              detach and stop (POSIX only)
+//   index      a large file's cached line index used on the next load, and
+//              a stale or damaged one ignored for a scan
+//   recover    an editor that dies after random edits and saves, then
+//              tvi -r, also with the last batch torn or garbage after it
+//              (POSIX only)
+//
+// Usage: check [dir]
+//   dir      where the tests put their files (default build)
+
+static int failures;
+static const char* test_dir = "build";
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("  FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// ---------------------------------------------------------------------------
+// Scripted keys: read_key hands out the queued events, all of them without
+// waiting, as a terminal would for typing faster than frames or a paste
+
+#define SCRIPT_MAX 65536
+
+static KeyEvent script[SCRIPT_MAX];
+static size_t script_len;
+static size_t script_pos;
+static int frames;
+static char top_row[256];     // Row 0 of the last frame
+
+static int script_init(void) {
+    return 1;
+}
+
+static void script_cleanup(void) {
+}
+
+static int script_size(int* rows, int* cols) {
+    *rows = 24;
+    *cols = 80;
+    return 1;
+}
+
+static void script_flush(const Cell* back, Cell* front, int rows, int cols,
+                         int cursor_row, int cursor_col, FlushStats* stats) {
+    (void)cursor_row;
+    (void)cursor_col;
+    memcpy(front, back, (size_t)rows * cols * sizeof(Cell));
+    int n = cols < (int)sizeof(top_row) - 1 ? cols : (int)sizeof(top_row) - 1;
+    for (int i = 0; i < n; i++) top_row[i] = back[i].ch ? back[i].ch : ' ';
+    while (n > 0 && top_row[n - 1] == ' ') n--;
+    top_row[n] = '\0';
+    stats->cells = rows * cols;
+    stats->bytes = 0;
+    frames++;
+}
+
+static int script_read(KeyEvent* event, int timeout_ms) {
+    (void)timeout_ms;
+    if (script_pos >= script_len) return 0;
+    *event = script[script_pos++];
+    return 1;
+}
+
+static const TermBackend script_term = {
+    "script",
+    script_init,
+    script_cleanup,
+    script_size,
+    script_flush,
+    script_read
+};
+
+// Queue keys written as in a replay script's plain characters: ESC is
+// Escape, '\r' Enter, '\b' Backspace, '\x01' the down arrow, '\x12' Ctrl-R
+static void queue_keys(const char* keys) {
+    for (; *keys && script_len < SCRIPT_MAX; keys++) {
+        KeyEvent e = { KEY_CHAR, *keys, NULL, 0 };
+        if (*keys == '\x1b') e.key = KEY_ESCAPE;
+        else if (*keys == '\r') e.key = KEY_ENTER;
+        else if (*keys == '\b') e.key = KEY_BACKSPACE;
+        else if (*keys == '\x01') e.key = KEY_DOWN;
+        else if (*keys == '\x12') {
+            e.key = KEY_CTRL;
+            e.ch = 'r';
+        }
+        script[script_len++] = e;
+    }
+}
+
+// Run the queued keys; returns the handle_input calls it took
+static int run_keys(EditorState* state) {
+    int calls = 0;
+    while (script_pos < script_len && !state->quit) {
+        handle_input(state);
+        calls++;
+    }
+    script_len = script_pos = 0;
+    return calls;
+}
+
+static void keys(EditorState* state, const char* k) {
+    queue_keys(k);
+    run_keys(state);
+}
+
+static char* read_all(EditorState* state, size_t* length) {
+    *length = text_size(state->text);
+    char* data = malloc(*length + 1);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed in check\n");
+        exit(1);
+    }
+    text_read(state->text, 0, data, *length);
+    data[*length] = '\0';
+    return data;
+}
+
+static void write_file(const char* path, const char* text, size_t length) {
+    FILE* file = fopen(path, "wb");
+    if (!file || fwrite(text, 1, length, file) != length) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        exit(1);
+    }
+    fclose(file);
+}
+
+// The whole file, NUL-terminated, or NULL if it cannot be read
+static char* read_file(const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = size >= 0 ? malloc((size_t)size + 1) : NULL;
+    *length = data ? fread(data, 1, (size_t)size, file) : 0;
+    if (data) data[*length] = '\0';
+    fclose(file);
+    return data;
+}
+
+// The text is text exactly
+static int text_is(EditorState* state, const char* text) {
+    size_t length;
+    char* data = read_all(state, &length);
+    int same = length == strlen(text) && memcmp(data, text, length) == 0;
+    free(data);
+    return same;
+}
+
+static void setup(EditorState* state, const char* text) {
+    init_editor(state);
+    state->buffer_budget = 0;
+    if (text && !text_insert(state->text, 0, text, strlen(text))) {
+        fprintf(stderr, "Memory allocation failed in check\n");
+        exit(1);
+    }
+}
+
+static void teardown(EditorState* state) {
+    text_free(state->text);
+    undo_free(state->undo);
+}
+
+// ---------------------------------------------------------------------------
+
+static void expect_cursor(EditorState* state, const char* k, int row, int col) {
+    keys(state, k);
+    CHECK(state->cursor_row == row && state->cursor_col == col,
+          "after %s the cursor is at %d:%d, not %d:%d", k, state->cursor_row, state->cursor_col, row, col);
+}
+
+static void test_motions(void) {
+    EditorState state;
+    setup(&state, "foo bar_baz, qux\n\n  indented line\nlast word");
+
+    // Words: letters and '_' form one, other marks another; an empty line
+    // is a word for w and b
+    expect_cursor(&state, "w", 0, 4);
+    expect_cursor(&state, "w", 0, 11);
+    expect_cursor(&state, "w", 0, 13);
+    expect_cursor(&state, "w", 1, 0);
+    expect_cursor(&state, "w", 2, 2);
+    expect_cursor(&state, "gg3w", 0, 13);
+    expect_cursor(&state, "b", 0, 11);
+    expect_cursor(&state, "2b", 0, 0);
+    expect_cursor(&state, "e", 0, 2);
+    expect_cursor(&state, "e", 0, 10);
+    expect_cursor(&state, "2e", 0, 15);
+    expect_cursor(&state, "10b", 0, 0);
+    expect_cursor(&state, "G$10w", 3, 9);
+
+    // Line ends and jumps
+    expect_cursor(&state, "gg0", 0, 0);
+    expect_cursor(&state, "$", 0, 16);
+    expect_cursor(&state, "0" "2$", 1, 0);
+    expect_cursor(&state, "gg3$", 2, 15);
+    expect_cursor(&state, "G", 3, 0);
+    expect_cursor(&state, "gg", 0, 0);
+    expect_cursor(&state, "3G", 2, 2);
+    expect_cursor(&state, "1G", 0, 0);
+    expect_cursor(&state, ":3\r", 2, 2);
+    expect_cursor(&state, ":99\r", 3, 0);
+    expect_cursor(&state, ":1\r", 0, 0);
+
+    // Counted characters and lines, clamped at the ends
+    expect_cursor(&state, "3l", 0, 3);
+    expect_cursor(&state, "20l", 2, 5);
+    expect_cursor(&state, "10000h", 0, 0);
+    expect_cursor(&state, "10000l", 3, 9);
+    expect_cursor(&state, "gg5j", 3, 0);
+    expect_cursor(&state, "2k", 1, 0);
+    expect_cursor(&state, "\x01\x01", 3, 0);
+    expect_cursor(&state, "gg2\x01", 2, 0);
+
+    // Escape drops a count; an unknown sequence does nothing
+    expect_cursor(&state, "9\x1bj", 3, 0);
+    expect_cursor(&state, "ggj" "gx", 1, 0);
+
+    // A count of 10M lines takes one jump, not 10M steps
+    teardown(&state);
+    setup(&state, NULL);
+    size_t lines = 10000000;
+    char* data = malloc(lines * 2);
+    if (!data) exit(1);
+    for (size_t i = 0; i < lines; i++) {
+        data[2 * i] = 'x';
+        data[2 * i + 1] = '\n';
+    }
+    text_load_memory(state.text, data, lines * 2 - 1, NULL, NULL);
+    double start = clock_ms();
+    keys(&state, "9999999j");
+    double ms = clock_ms() - start;
+    CHECK(state.cursor_row == 9999999, "9999999j went to row %d", state.cursor_row);
+    CHECK(ms < 50, "9999999j took %.1f ms", ms);
+    teardown(&state);
+}
+
+// ---------------------------------------------------------------------------
+
+static void test_input(void) {
+    EditorState state;
+    setup(&state, NULL);
+
+    // A bracketed paste arrives as one event, lines broken with '\r'
+    size_t size = 1 << 20;
+    char* paste = malloc(size);
+    char* expected = malloc(size + 1);
+    if (!paste || !expected) exit(1);
+    for (size_t i = 0; i < size; i++) {
+        char c = i % 61 == 60 ? '\r' : 'a' + i % 26;
+        paste[i] = c;
+        expected[i] = c == '\r' ? '\n' : c;
+    }
+    expected[size] = '\0';
+    queue_keys("i");
+    run_keys(&state);
+    KeyEvent e = { KEY_PASTE, 0, paste, size };
+    script[script_len++] = e;
+    double start = clock_ms();
+    int calls = run_keys(&state);
+    double ms = clock_ms() - start;
+
+    size_t length;
+    char* got = read_all(&state, &length);
+    CHECK(length == size && memcmp(got, expected, size) == 0, "the 1 MB paste did not arrive intact");
+    CHECK(calls == 1, "the paste took %d handle_input calls", calls);
+    CHECK(ms < 500, "the 1 MB paste took %.1f ms", ms);
+    free(got);
+    printf("  1 MB paste: %.2f ms\n", ms);
+
+    // Typing faster than frames: one handle_input call, one edit to undo
+    keys(&state, "\x1b" "u");
+    CHECK(text_size(state.text) == 0, "undo left %zu bytes of the paste", text_size(state.text));
+    queue_keys("i");
+    for (int i = 0; i < 60000; i++) queue_keys(i % 50 == 49 ? "\r" : "x");
+    calls = run_keys(&state);
+    CHECK(calls == 1, "a burst of 60000 keys took %d handle_input calls", calls);
+    CHECK(text_line_count(state.text) == 1201, "the burst made %zu lines", text_line_count(state.text));
+    CHECK(state.cursor_row == 1200 && state.cursor_col == 0, "the burst left the cursor at %d:%d",
+          state.cursor_row, state.cursor_col);
+    keys(&state, "\x1b" "u");
+    CHECK(text_size(state.text) == 0, "undo left %zu bytes of the burst", text_size(state.text));
+
+    free(paste);
+    free(expected);
+    teardown(&state);
+}
+
+// ---------------------------------------------------------------------------
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double* ms, int n) {
+    qsort(ms, n, sizeof(double), compare_double);
+    return ms[n / 2];
+}
+
+// Page down n times from row, timing each frame
+static double page_frames(EditorState* state, int row, int n) {
+    double ms[256];
+    state->cursor_row = row;
+    refresh_screen(state);
+    for (int i = 0; i < n; i++) {
+        double start = clock_ms();
+        motion_lines(state, state->screen_rows - 1);
+        refresh_screen(state);
+        ms[i] = clock_ms() - start;
+    }
+    return median(ms, n);
+}
+
+static void test_scroll(void) {
+    EditorState state;
+    setup(&state, NULL);
+    size_t lines = 10000000;
+    char* data = malloc(lines * 16);
+    if (!data) exit(1);
+    size_t length = 0;
+    for (size_t i = 0; i < lines; i++) {
+        length += (size_t)sprintf(data + length, "line %zu\n", i + 1);
+    }
+    text_load_memory(state.text, data, length - 1, NULL, NULL);
+    init_screen(&state);
+
+    double top = page_frames(&state, 0, 200);
+    double middle = page_frames(&state, 5000000, 200);
+    double bottom = page_frames(&state, 9990000, 200);
+    printf("  10M lines, median frame: top %.3f ms, middle %.3f ms, bottom %.3f ms\n", top, middle, bottom);
+    CHECK(bottom < top * 4 + 0.05 && middle < top * 4 + 0.05, "frame time grows down the file");
+
+    // The viewport follows the cursor and shows its lines
+    keys(&state, "G");
+    refresh_screen(&state);
+    CHECK(state.row_offset == 10000000 - 23, "at the last line the viewport starts at row %d", state.row_offset);
+    char expect[32];
+    snprintf(expect, sizeof(expect), "line %d", state.row_offset + 1);
+    CHECK(strcmp(top_row, expect) == 0, "the top row shows \"%s\", not \"%s\"", top_row, expect);
+    keys(&state, "gg");
+    refresh_screen(&state);
+    CHECK(state.row_offset == 0 && strcmp(top_row, "line 1") == 0, "gg shows \"%s\"", top_row);
+
+    cleanup_screen();
+    teardown(&state);
+}
+
+// ---------------------------------------------------------------------------
+
+static unsigned long random_state = 1;
+
+// Deterministic pseudo-random numbers in [0, n), so failures repeat
+static size_t random_below(size_t n) {
+    random_state = random_state * 6364136223846793005ul + 1442695040888963407ul;
+    return (size_t)(random_state >> 33) % n;
+}
+
+// One random edit through the keys, as one undo unit: an x, or typing
+// with line breaks and backspaces, somewhere in the document
+static void random_edit(EditorState* state) {
+    char k[160];
+    size_t at = random_below(text_size(state->text) + 1);
+    int n = at ? snprintf(k, sizeof(k), "gg0%zul", at) : snprintf(k, sizeof(k), "gg0");
+    if (random_below(4) == 0) {
+        snprintf(k + n, sizeof(k) - n, "x");
+    } else {
+        k[n++] = 'i';
+        size_t typed = 1 + random_below(40);
+        for (size_t i = 0; i < typed; i++) {
+            size_t r = random_below(16);
+            k[n++] = r == 0 ? '\r' : r == 1 ? '\b' : (char)('a' + random_below(26));
+        }
+        k[n++] = '\x1b';
+        k[n] = '\0';
+    }
+    keys(state, k);
+}
+
+#define UNDO_UNITS 300
+
+// Make units of random edits, a snapshot after each, then undo back and
+// redo forward through them. Returns how many could be undone.
+static int undo_walk(EditorState* state) {
+    static char* snaps[UNDO_UNITS + 1];
+    size_t length;
+    snaps[0] = read_all(state, &length);
+    for (int unit = 1; unit <= UNDO_UNITS; unit++) {
+        random_edit(state);
+        snaps[unit] = read_all(state, &length);
+    }
+
+    // Back as far as the journal goes, then forward again to the end
+    int undone = 0;
+    for (; undone < UNDO_UNITS; undone++) {
+        keys(state, "u");
+        if (strcmp(state->message, "Already at oldest change") == 0) break;
+        if (!text_is(state, snaps[UNDO_UNITS - undone - 1])) {
+            CHECK(0, "undo %d did not restore unit %d", undone + 1, UNDO_UNITS - undone - 1);
+            break;
+        }
+    }
+    for (int i = undone; i > 0; i--) {
+        keys(state, "\x12");
+        if (!text_is(state, snaps[UNDO_UNITS - i + 1])) {
+            CHECK(0, "redo did not restore unit %d", UNDO_UNITS - i + 1);
+            break;
+        }
+    }
+    keys(state, "\x12");
+    CHECK(strcmp(state->message, "Already at newest change") == 0, "redo went past the newest change");
+    for (int i = 0; i <= UNDO_UNITS; i++) free(snaps[i]);
+    return undone;
+}
+
+static void test_undo(void) {
+    EditorState state;
+    setup(&state, "first line\nsecond line\n");
+
+    // Every unit undone and redone in turn
+    int undone = undo_walk(&state);
+    CHECK(undone == UNDO_UNITS, "only %d of %d units could be undone", undone, UNDO_UNITS);
+
+    // With a 2 KB cap the oldest units go, the newest ones still undo
+    // exactly, and the journal stays within the cap
+    undo_clear(state.undo);
+    undo_set_limit(state.undo, 2048);
+    undone = undo_walk(&state);
+    CHECK(undone > 0 && undone < UNDO_UNITS, "with a 2 KB cap %d units could be undone", undone);
+    CHECK(state.undo->used <= 2048, "the journal holds %zu bytes past its 2 KB cap", state.undo->used);
+    printf("  2 KB cap: the newest %d of %d units undo\n", undone, UNDO_UNITS);
+    teardown(&state);
+
+    // Backspace takes back what was just typed instead of adding a record
+    setup(&state, NULL);
+    keys(&state, "iabcd\b\bef\x1b");
+    size_t backspaced = state.undo->used;
+    CHECK(text_is(&state, "abef"), "typing with backspaces made the wrong text");
+    teardown(&state);
+    setup(&state, NULL);
+    keys(&state, "iabef\x1b");
+    CHECK(backspaced == state.undo->used, "backspacing left a %zu-byte journal, typing it %zu",
+          backspaced, state.undo->used);
+    keys(&state, "u");
+    CHECK(text_is(&state, ""), "undo did not take back the typing in one unit");
+    teardown(&state);
+
+    // :s is one unit however many lines it changes
+    setup(&state, "foo 1\nbar\nfoo 2\nfoo 3");
+    keys(&state, ":%s/foo/baz/\r");
+    CHECK(text_is(&state, "baz 1\nbar\nbaz 2\nbaz 3"), ":s made the wrong text");
+    keys(&state, "u");
+    CHECK(text_is(&state, "foo 1\nbar\nfoo 2\nfoo 3"), "undo did not take back :s in one unit");
+    keys(&state, "\x12");
+    CHECK(text_is(&state, "baz 1\nbar\nbaz 2\nbaz 3"), "redo did not reapply :s");
+
+    // :set undomem takes a number of MB and nothing else
+    keys(&state, ":set undomem=3\r");
+    CHECK(state.undo->limit == (size_t)3 << 20, ":set undomem=3 set a cap of %zu", state.undo->limit);
+    const char* invalid[] = { "-1", "abc", "", " 4", "4MB", "99999999999999999999" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        char k[64];
+        snprintf(k, sizeof(k), ":set undomem=%s\r", invalid[i]);
+        keys(&state, k);
+        CHECK(state.undo->limit == (size_t)3 << 20 && strncmp(state.message, "Invalid value", 13) == 0,
+              ":set undomem=%s was taken", invalid[i]);
+    }
+    teardown(&state);
+}
+
+// ---------------------------------------------------------------------------
+
+#define REGEX_CASES 200000
+
+// A random pattern over a, b and c, with every kind of atom and quantifier
+static void random_pattern(char* p) {
+    static const char* atoms[] = { "a", "b", "c", ".", "[ab]", "[^a]", "[a-b]" };
+    static const char* quants[] = { "", "", "*", "\\+", "\\?" };
+    int n = 0;
+    if (random_below(4) == 0) p[n++] = '^';
+    size_t count = 1 + random_below(5);
+    for (size_t i = 0; i < count; i++) {
+        n += sprintf(p + n, "%s%s", atoms[random_below(7)], quants[random_below(5)]);
+    }
+    if (random_below(4) == 0) p[n++] = '$';
+    p[n] = '\0';
+}
+
+static void test_regex(void) {
+    // The Pike VM, backtracking and re_search must agree everywhere
+    char pattern[64], line[32];
+    int mismatches = 0;
+    for (int i = 0; i < REGEX_CASES && mismatches < 5; i++) {
+        random_pattern(pattern);
+        size_t length = random_below(sizeof(line));
+        for (size_t k = 0; k < length; k++) line[k] = (char)('a' + random_below(3));
+        size_t from = random_below(length + 1);
+
+        const char* error;
+        Regex* re = re_compile(pattern, &error);
+        if (!re) {
+            CHECK(0, "\"%s\" did not compile: %s", pattern, error);
+            mismatches++;
+            continue;
+        }
+        size_t s[3] = { 0 }, e[3] = { 0 };
+        int found[3];
+        found[0] = re_search_with(re, RE_BACKTRACK, line, length, from, &s[0], &e[0]);
+        found[1] = re_search_with(re, RE_PIKE, line, length, from, &s[1], &e[1]);
+        found[2] = re_search(re, line, length, from, &s[2], &e[2]);
+        for (int m = 1; m < 3; m++) {
+            if (found[m] != found[0] || (found[0] && (s[m] != s[0] || e[m] != e[0]))) {
+                CHECK(0, "\"%s\" on \"%.*s\" from %zu: %s found %d [%zu, %zu), backtracking %d [%zu, %zu)",
+                      pattern, (int)length, line, from, m == 1 ? "the Pike VM" : "re_search",
+                      found[m], s[m], e[m], found[0], s[0], e[0]);
+                mismatches++;
+            }
+        }
+        re_free(re);
+    }
+
+    // Backtracking is exponential in the stars here; the budget hands the
+    // line to the Pike VM instead
+    size_t size = 200 * 1024;
+    char* as = malloc(size + 1);
+    if (!as) exit(1);
+    memset(as, 'a', size);
+    as[size] = '\0';
+    EditorState state;
+    setup(&state, as);
+    double start = clock_ms();
+    keys(&state, ":s/a*a*a*a*a*a*a*a*a*a*a*a*b/x/\r");
+    double ms = clock_ms() - start;
+    CHECK(strncmp(state.message, "Pattern not found", 17) == 0, "a*...b on a line of a's: %s", state.message);
+    CHECK(ms < 2000, ":s/a*a*...a*b/ on a 200 KB line took %.0f ms", ms);
+    printf("  :s/a*a*...a*b/ on a 200 KB line: %.1f ms\n", ms);
+    keys(&state, ":s/a*a*a*a*a*a*a*a*a*a*a*a*$/x/\r");
+    CHECK(text_is(&state, "x"), "a*...a*$ did not take the whole line");
+    teardown(&state);
+    free(as);
+
+    // The '\r' of a CRLF line is not matched, and \r in the replacement
+    // breaks the line the way the file does
+    setup(&state, "foo\r\nbar\r\n");
+    keys(&state, ":%s/o$/X/\r");
+    CHECK(text_is(&state, "foX\r\nbar\r\n"), "o$ did not match before the \\r");
+    keys(&state, ":%s/a/\\r/\r");
+    CHECK(text_is(&state, "foX\r\nb\r\nr\r\n"), "\\r did not put in a CRLF line break");
+    teardown(&state);
+    setup(&state, "foo\nbar\n");
+    keys(&state, ":%s/a/\\r/\r");
+    CHECK(text_is(&state, "foo\nb\nr\n"), "\\r did not put in a LF line break");
+    teardown(&state);
+}
+
+// ---------------------------------------------------------------------------
+
+static void pause_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+// Compress data and expand it again; returns the compressed size, or 0
+// after failing a check
+static size_t lz_round_trip(const char* name, const char* data, size_t length) {
+    char* packed = malloc(lz_bound(length));
+    char* plain = malloc(length + 1);
+    if (!packed || !plain) exit(1);
+    size_t size = lz_compress(data, length, packed);
+    int ok = size <= lz_bound(length) && lz_decompress(packed, size, plain, length) &&
+             memcmp(plain, data, length) == 0;
+    CHECK(ok, "%s (%zu bytes) did not come back from lz", name, length);
+    free(packed);
+    free(plain);
+    return ok ? size : 0;
+}
+
+// Text as lines that repeat their words, so that it compresses
+static char* make_lines(size_t count, size_t* length) {
+    char* data = malloc(count * 64);
+    if (!data) exit(1);
+    *length = 0;
+    for (size_t i = 0; i < count; i++) {
+        *length += (size_t)sprintf(data + *length, "%zu: the packer compresses full add buffers\n", i);
+    }
+    return data;
+}
+
+typedef struct {
+    char* data;
+    size_t length;
+} Collect;
+
+static int collect_span(const char* data, size_t length, void* ctx) {
+    Collect* c = ctx;
+    memcpy(c->data + c->length, data, length);
+    c->length += length;
+    return 1;
+}
+
+static void test_lz(void) {
+    // Round trips: empty, tiny, incompressible, runs long enough for the
+    // extra length bytes, and copies from near the 64 KB window's end
+    size_t size = 300 * 1024;
+    char* data = malloc(size);
+    if (!data) exit(1);
+    lz_round_trip("empty", "", 0);
+    lz_round_trip("one byte", "x", 1);
+    for (size_t i = 0; i < size; i++) data[i] = (char)random_below(256);
+    lz_round_trip("random bytes", data, size);
+    memset(data, 'a', size);
+    size_t packed = lz_round_trip("a run", data, size);
+    CHECK(packed > 0 && packed < size / 100, "a run of 300 KB compressed to %zu bytes", packed);
+    for (size_t i = 0; i < 65000; i++) data[i] = (char)random_below(256);
+    memcpy(data + 65000, data, 65000);
+    lz_round_trip("a copy 65000 bytes back", data, 130000);
+    size_t length;
+    char* lines = make_lines(5000, &length);
+    lz_round_trip("lines", lines, length);
+
+    // Malformed blocks are refused, not followed out of bounds
+    char* block = malloc(lz_bound(length));
+    char* out = malloc(length + 1);
+    if (!block || !out) exit(1);
+    size_t n = lz_compress(lines, length, block);
+    CHECK(!lz_decompress(block, n, out, length + 1), "a block expanded to more than its size");
+    CHECK(!lz_decompress(block, n, out, length - 1), "a block expanded to less than its size");
+    for (size_t cut = 0; cut < n; cut += 1 + cut / 16) {
+        CHECK(!lz_decompress(block, cut, out, length), "a block cut to %zu of %zu bytes was taken", cut, n);
+    }
+    // "abcdabcdabcd": 4 literals, a copy of 8 from 4 back, no literals
+    char small[16];
+    size_t small_n = lz_compress("abcdabcdabcd", 12, small);
+    CHECK(small_n == 8 && (unsigned char)small[0] == 0x44 && small[5] == 4,
+          "abcdabcdabcd compressed differently than expected");
+    small[5] = 0;
+    CHECK(!lz_decompress(small, small_n, out, 12), "a copy from offset 0 was taken");
+    small[5] = 5;
+    CHECK(!lz_decompress(small, small_n, out, 12), "a copy from before the start was taken");
+    for (int i = 0; i < 2000; i++) {
+        size_t k = random_below(64);
+        for (size_t b = 0; b < k; b++) block[b] = (char)random_below(256);
+        lz_decompress(block, k, out, random_below(length)); // Must not crash
+    }
+    free(block);
+    free(out);
+    free(data);
+
+    // Enough text for the least recently read add buffers to be dropped
+    // once compressed; reading, searching, editing and a snapshot then
+    // inflate them as they go
+    EditorState state;
+    setup(&state, NULL);
+    CHECK(text_set_compress(state.text, 1), "compression did not start");
+    free(lines);
+    lines = make_lines(1000000, &length);
+    for (size_t at = 0; at < length; at += 100000) {
+        text_insert(state.text, at, lines + at, length - at < 100000 ? length - at : 100000);
+    }
+    double start = clock_ms();
+    while (text_pack_pending(state.text) && clock_ms() - start < 30000) {
+        text_pack_poll(state.text);
+        pause_ms(5);
+    }
+    int dropped = 0;
+    for (int i = 1; i < state.text->num_chunks; i++) {
+        dropped += state.text->chunks[i].packed && !state.text->chunks[i].data;
+    }
+    CHECK(dropped > 0, "no add buffer was dropped after compressing %zu bytes", length);
+    printf("  %zu bytes in %d add buffers, %d dropped\n", length, state.text->num_chunks - 1, dropped);
+
+    CHECK(text_is(&state, lines), "text read back from compressed add buffers differs");
+    size_t at;
+    const char* last = "999999: the packer";
+    CHECK(text_find(state.text, last, strlen(last), 0, text_size(state.text), 0, &at) &&
+          at == length - 47, "search through compressed add buffers did not find the last line");
+    text_insert(state.text, 1000, "X", 1);
+    memmove(lines + 1001, lines + 1000, length + 1 - 1000);
+    lines[1000] = 'X';
+    length++;
+    size_t cut = length / 2;
+    text_delete(state.text, cut, 10);
+    memmove(lines + cut, lines + cut + 10, length + 1 - cut - 10);
+    length -= 10;
+    CHECK(text_is(&state, lines), "edits in compressed add buffers went wrong");
+
+    TextSnapshot* snap = text_snapshot(state.text);
+    Collect c = { malloc(length), 0 };
+    if (!snap || !c.data) exit(1);
+    text_snapshot_foreach(snap, collect_span, &c);
+    CHECK(c.length == length && memcmp(c.data, lines, length) == 0, "a snapshot of compressed text differs");
+    text_snapshot_free(snap);
+    free(c.data);
+
+    CHECK(text_set_compress(state.text, 0), "compression did not stop");
+    CHECK(text_is(&state, lines), "text differs after compression stopped");
+    free(lines);
+    teardown(&state);
+}
+
+// ---------------------------------------------------------------------------
+
+#define INDEX_LINES 1100000
+#define INDEX_LINE_SIZE 64    // Bytes in each line of the file
+
+// Load path as its only buffer, waiting for the line index; returns 1 if
+// it came from the cache rather than a scan
+static int load_large(EditorState* state, const char* path) {
+    init_editor(state);
+    buffer_switch(state, buffer_add(state, path, 0));
+    int cached = !state->cache_index;
+    text_index_wait(state->text);
+    editor_poll(state); // Writes the cache after a scan
+    return cached;
+}
+
+// Line row of the document is "line N", N = row + 1
+static int line_reads(EditorState* state, size_t row) {
+    char got[16] = "", expect[16];
+    text_get_line(state->text, row, 0, got, 12);
+    snprintf(expect, sizeof(expect), "line %07zu", row + 1);
+    return memcmp(got, expect, 12) == 0;
+}
+
+// Overwrite count line starts from entry at of the cache at path
+static void damage_index(const char* path, size_t at, const size_t* values, size_t count) {
+    FILE* file = fopen(path, "r+b");
+    if (!file) return;
+    fseek(file, (long)(48 + at * sizeof(size_t)), SEEK_SET); // After the header
+    fwrite(values, sizeof(size_t), count, file);
+    fclose(file);
+}
+
+static void test_index(void) {
+    char path[1024], cache[1040];
+    snprintf(path, sizeof(path), "%s/check-index.txt", test_dir);
+    snprintf(cache, sizeof(cache), "%s.tvi-idx", path);
+    size_t length = 0;
+    char* data = malloc((size_t)INDEX_LINES * INDEX_LINE_SIZE + 1);
+    if (!data) exit(1);
+    for (size_t i = 0; i < INDEX_LINES; i++) {
+        length += (size_t)sprintf(data + length, "line %07zu: a file large enough for its line index to be kept\n", i + 1);
+    }
+    write_file(path, data, length);
+    remove(cache);
+
+    EditorState state;
+    CHECK(!load_large(&state, path), "a file with no cache was not scanned");
+    buffer_free_all(&state, 0);
+    CHECK(access(cache, F_OK) == 0, "no cache was written after the scan");
+    CHECK(load_large(&state, path), "the cache was not used on the next load");
+    CHECK(line_reads(&state, 500002), "with the cache line 500003 reads wrong");
+    buffer_free_all(&state, 0);
+
+    // Damaged entries: pointing past the end, going backwards, or not at
+    // the start of a line. Each must send the load back to a scan.
+    size_t cache_length;
+    char* intact = read_file(cache, &cache_length);
+    if (!intact) exit(1);
+    size_t past[4] = { (size_t)1 << 40, (size_t)1 << 40, (size_t)1 << 40, (size_t)1 << 40 };
+    size_t backwards[2] = { 500001 * INDEX_LINE_SIZE, 500000 * INDEX_LINE_SIZE };
+    size_t inside[1] = { 500000 * INDEX_LINE_SIZE + 1 };
+    struct {
+        const char* what;
+        const size_t* values;
+        size_t count;
+    } damage[] = {
+        { "past the end", past, 4 },
+        { "going backwards", backwards, 2 },
+        { "inside a line", inside, 1 },
+    };
+    for (size_t i = 0; i < sizeof(damage) / sizeof(damage[0]); i++) {
+        write_file(cache, intact, cache_length);
+        damage_index(cache, 500000, damage[i].values, damage[i].count);
+        CHECK(!load_large(&state, path), "a cache with entries %s was used", damage[i].what);
+        CHECK(line_reads(&state, 500002) && line_reads(&state, INDEX_LINES - 1),
+              "after a cache with entries %s lines read wrong", damage[i].what);
+
+        // The edit lands on the line asked for
+        keys(&state, ":500003\riQ\x1b");
+        char got[4] = "";
+        text_get_line(state.text, 500002, 0, got, 2);
+        CHECK(memcmp(got, "Ql", 2) == 0, "after a cache with entries %s :500003 edited elsewhere",
+              damage[i].what);
+        buffer_free_all(&state, 0);
+    }
+
+    // A cache for the file as it was before it grew is stale
+    write_file(cache, intact, cache_length);
+    FILE* file = fopen(path, "ab");
+    if (file) {
+        fputs("line 1100001 appended\n", file);
+        fclose(file);
+    }
+    CHECK(!load_large(&state, path), "a stale cache was used");
+    CHECK(text_line_count(state.text) == INDEX_LINES + 1, // The final newline is not a line
+          "after a stale cache the file has %zu lines", text_line_count(state.text));
+    CHECK(line_reads(&state, 500002), "after a stale cache line 500003 reads wrong");
+    buffer_free_all(&state, 0);
+
+    free(intact);
+    free(data);
+    remove(cache);
+    remove(path);
+}
+
+// ---------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+static int client_connect(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    for (int tries = 0; tries < 200; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+        if (fd >= 0) close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Send keys, then read what the server sends for wait_ms
+static void client_send(int fd, const char* data, int wait_ms) {
+    if (data && write(fd, data, strlen(data)) < 0) return;
+    char buffer[65536];
+    double end = clock_ms() + wait_ms;
+    for (;;) {
+        int left = (int)(end - clock_ms());
+        if (left <= 0) break;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, left) <= 0 || read(fd, buffer, sizeof(buffer)) <= 0) break;
+    }
+}
+
+// Everything the server sends until it closes the connection
+static size_t client_read_all(int fd, char* reply, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 5000) <= 0) break;
+        ssize_t n = read(fd, reply + length, size - 1 - length);
+        if (n <= 0) break;
+        length += (size_t)n;
+        if (length == size - 1) break;
+    }
+    reply[length] = '\0';
+    return length;
+}
+
+static void client_request(const char* sock, const char* request, char* reply, size_t size) {
+    reply[0] = '\0';
+    int fd = client_connect(sock);
+    if (fd < 0) return;
+    if (write(fd, request, strlen(request)) >= 0) client_read_all(fd, reply, size);
+    close(fd);
+}
+
+static void test_server(void) {
+    char path[1024], sock[1024], swap[1040];
+    snprintf(path, sizeof(path), "%s/check-server.txt", test_dir);
+    snprintf(sock, sizeof(sock), "%s/check.sock", test_dir);
+    snprintf(swap, sizeof(swap), "%s.tvi-swp", path);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        CHECK(0, "cannot write %s", path);
+        return;
+    }
+    fputs("one\ntwo\n", file);
+    fclose(file);
+    remove(swap);
+    char* full = realpath(path, NULL);
+    if (!full) exit(1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stderr)) _exit(1);
+        EditorState state;
+        init_editor(&state);
+        state.use_swap = 1;
+        screen_set_backend(&posix_term);
+        buffer_switch(&state, buffer_add(&state, full, 0));
+        int status = server_run(&state, sock);
+        save_wait(&state);
+        buffer_free_all(&state, 1);
+        _exit(status);
+    }
+
+    char reply[4096];
+    char expect[2048];
+    client_request(sock, "tvi1 ls\n", reply, sizeof(reply));
+    snprintf(expect, sizeof(expect), "ok\n1 %% %s\n", full);
+    CHECK(strcmp(reply, expect) == 0, "ls answered \"%s\"", reply);
+    client_request(sock, "tvi1 frob\n", reply, sizeof(reply));
+    CHECK(strcmp(reply, "error unknown request\n") == 0, "a bad request got \"%s\"", reply);
+
+    // Edit and save through a client, then detach
+    int fd = client_connect(sock);
+    char request[2048];
+    snprintf(request, sizeof(request), "tvi1 open 24 80 %s\n", full);
+    if (fd >= 0 && write(fd, request, strlen(request)) > 0) {
+        client_send(fd, NULL, 200);
+        client_send(fd, "iX", 100);
+        client_send(fd, "\x1b", 100);
+        client_send(fd, ":w\r", 300);
+        client_send(fd, "jiY", 100);
+        client_send(fd, "\x1b", 100);
+        client_send(fd, ":q\r", 0);
+        char tail[65536];
+        client_read_all(fd, tail, sizeof(tail));
+    }
+    if (fd >= 0) close(fd);
+
+    file = fopen(path, "rb");
+    char saved[64] = "";
+    size_t n = file ? fread(saved, 1, sizeof(saved) - 1, file) : 0;
+    saved[n] = '\0';
+    if (file) fclose(file);
+    CHECK(strcmp(saved, "Xone\ntwo\n") == 0, "the client's save wrote \"%s\"", saved);
+
+    // The unsaved edit outlives the client, and its swap file the server
+    client_request(sock, "tvi1 ls\n", reply, sizeof(reply));
+    snprintf(expect, sizeof(expect), "ok\n1 %% %s +\n", full);
+    CHECK(strcmp(reply, expect) == 0, "ls after detaching answered \"%s\"", reply);
+    client_request(sock, "tvi1 stop\n", reply, sizeof(reply));
+    CHECK(strcmp(reply, "ok\n") == 0, "stop answered \"%s\"", reply);
+    int status = 1;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "the server exited with status %d", status);
+    CHECK(access(sock, F_OK) != 0, "the server left its socket");
+    CHECK(access(swap, F_OK) == 0, "the server deleted the swap file of a modified buffer");
+
+    remove(swap);
+    remove(path);
+    free(full);
+}
+
+// Load path as tvi -r would and check that the document is expected
+static void expect_recovered(const char* path, const char* expected, const char* what) {
+    EditorState state;
+    init_editor(&state);
+    state.use_swap = 1;
+    buffer_switch(&state, buffer_add(&state, path, 1));
+    CHECK(strncmp(state.message, "Recovered", 9) == 0, "%s: %s", what, state.message);
+    CHECK(text_is(&state, expected), "%s: the recovered text differs", what);
+    buffer_free_all(&state, 1);
+}
+
+#define RECOVER_RUNS 6
+
+// A child edits the file, saving in some runs, and flushes its swap file
+// twice, writing the document out as it stood at each flush. It then dies
+// without cleaning up, and the swap file must bring back the second.
+static void test_recover(void) {
+    char path[1024], swap[1040], first[1040], second[1040];
+    snprintf(path, sizeof(path), "%s/check-recover.txt", test_dir);
+    snprintf(swap, sizeof(swap), "%s.tvi-swp", path);
+    snprintf(first, sizeof(first), "%s.first", path);
+    snprintf(second, sizeof(second), "%s.second", path);
+
+    for (int run = 0; run < RECOVER_RUNS; run++) {
+        const char* original = "alpha\nbeta\ngamma\n";
+        write_file(path, original, strlen(original));
+        remove(swap);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            random_state = (unsigned long)run + 100;
+            EditorState state;
+            init_editor(&state);
+            state.use_swap = 1;
+            buffer_switch(&state, buffer_add(&state, path, 0));
+            for (int i = 0; i < 200; i++) {
+                random_edit(&state);
+                if (run % 2 == 0 && i == 100) {
+                    keys(&state, ":w\r");
+                    save_wait(&state);
+                }
+            }
+            swap_flush(&state);
+            size_t length;
+            char* doc = read_all(&state, &length);
+            write_file(first, doc, length);
+            free(doc);
+            for (int i = 0; i < 50; i++) random_edit(&state);
+            swap_flush(&state);
+            doc = read_all(&state, &length);
+            write_file(second, doc, length);
+            _exit(0);
+        }
+        int status = 1;
+        waitpid(pid, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "run %d: the editor exited with status %d",
+              run, status);
+
+        size_t first_length, second_length, swap_length;
+        char* at_first = read_file(first, &first_length);
+        char* at_second = read_file(second, &second_length);
+        char* journal = read_file(swap, &swap_length);
+        if (!at_first || !at_second || !journal) {
+            CHECK(0, "run %d: the editor left no swap file or snapshots", run);
+            free(at_first);
+            free(at_second);
+            free(journal);
+            continue;
+        }
+
+        // Twice in a row: recovering keeps journaling into the same file
+        char what[64];
+        snprintf(what, sizeof(what), "run %d", run);
+        expect_recovered(path, at_second, what);
+        snprintf(what, sizeof(what), "run %d, recovered again", run);
+        expect_recovered(path, at_second, what);
+
+        // Garbage after the last batch is not a batch
+        char* extended = malloc(swap_length + 64);
+        if (!extended) exit(1);
+        memcpy(extended, journal, swap_length);
+        for (int i = 0; i < 64; i++) extended[swap_length + i] = (char)random_below(256);
+        write_file(swap, extended, swap_length + 64);
+        snprintf(what, sizeof(what), "run %d, garbage after the journal", run);
+        expect_recovered(path, at_second, what);
+        free(extended);
+
+        // A torn last batch is dropped, leaving the document as of the
+        // batch before
+        write_file(swap, journal, swap_length - 3);
+        snprintf(what, sizeof(what), "run %d, last batch torn", run);
+        expect_recovered(path, at_first, what);
+
+        free(at_first);
+        free(at_second);
+        free(journal);
+    }
+    remove(swap);
+    remove(path);
+    remove(first);
+    remove(second);
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+
+static void run(const char* name, void (*test)(void)) {
+    int before = failures;
+    printf("%s\n", name);
+    fflush(stdout);
+    test();
+    printf("%s: %s\n", name, failures == before ? "ok" : "FAILED");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) test_dir = argv[1];
+
+#ifndef _WIN32
+    run("server", test_server);
+#endif
+
+    screen_set_backend(&script_term);
+    run("motions", test_motions);
+    run("input", test_input);
+    run("scroll", test_scroll);
+    run("undo", test_undo);
+    run("regex", test_regex);
+    run("lz", test_lz);
+    run("index", test_index);
+#ifndef _WIN32
+    run("recover", test_recover);
+#endif
+
+    printf("%s\n", failures ? "FAILED" : "all tests passed");
+    return failures ? 1 : 0;
+}